@@ -0,0 +1,283 @@
+// Throughput and compression benchmark for the .zdzeg encoder and decoder.
+// It drives libzdzeg, the codec the encoder and viewer are built on, entirely
+// in memory: every image is encoded into a buffer and decoded back from it.
+// SDL_image is only used to load the corpus.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+
+#include "zdzeg.h"
+
+// One benchmark image, loaded and converted to RGB24 before timing starts.
+typedef struct {
+    char* path;
+    SDL_Surface* surface;
+} bench_image;
+
+// Latencies of one stage over every image and repeat of a case.
+typedef struct {
+    double* ms;
+    int count;
+    double total_ms;
+} bench_samples;
+
+static Uint64 bench_ticks_per_ms;
+
+static double elapsed_ms(Uint64 start) {
+    return (double)(SDL_GetPerformanceCounter() - start) / bench_ticks_per_ms;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of the sorted samples.
+static double percentile(const bench_samples* s, double p) {
+    if (s->count == 0) return 0.0;
+    int rank = (int)(p * s->count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > s->count) rank = s->count;
+    return s->ms[rank - 1];
+}
+
+// Same image extensions as the encoder accepts.
+static int is_supported_image(const char* filename) {
+    const char* ext = strrchr(filename, '.');
+    if (!ext) return 0;
+    return strcasecmp(ext, ".png") == 0 || strcasecmp(ext, ".jpg") == 0 ||
+           strcasecmp(ext, ".jpeg") == 0 || strcasecmp(ext, ".bmp") == 0;
+}
+
+// Loads one image into the corpus. Returns 0 on success, 1 if it was skipped.
+static int add_image(bench_image** images, int* count, int* capacity, const char* path) {
+    SDL_Surface* loaded = IMG_Load(path);
+    if (!loaded) {
+        fprintf(stderr, "IMG_Load failed for %s: %s\n", path, IMG_GetError());
+        return 1;
+    }
+    SDL_Surface* surface = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_RGB24, 0);
+    SDL_FreeSurface(loaded);
+    if (!surface) {
+        fprintf(stderr, "SDL_ConvertSurfaceFormat failed for %s: %s\n", path, SDL_GetError());
+        return 1;
+    }
+    if (*count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        bench_image* temp = (bench_image*)realloc(*images, *capacity * sizeof(bench_image));
+        if (!temp) {
+            SDL_FreeSurface(surface);
+            return 1;
+        }
+        *images = temp;
+    }
+    (*images)[*count].path = strdup(path);
+    (*images)[*count].surface = surface;
+    (*count)++;
+    return 0;
+}
+
+// Adds a file, or every supported image directly inside a directory.
+static void add_path(bench_image** images, int* count, int* capacity, const char* path) {
+    struct stat path_stat;
+    if (stat(path, &path_stat) != 0) {
+        fprintf(stderr, "Error: Could not access path '%s'.\n", path);
+        return;
+    }
+    if (!S_ISDIR(path_stat.st_mode)) {
+        add_image(images, count, capacity, path);
+        return;
+    }
+    DIR* dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "Error: Could not open directory at %s\n", path);
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char full_path[1024];
+        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
+        struct stat st;
+        if (stat(full_path, &st) == 0 && S_ISREG(st.st_mode) && is_supported_image(entry->d_name)) {
+            add_image(images, count, capacity, full_path);
+        }
+    }
+    closedir(dir);
+}
+
+int main(int argc, char* argv[]) {
+    // -r N repeats every image N times per case, -t N benchmarks tiled files,
+    // -F turns row filters off to measure what they cost and save, -c
+    // codec[:level] picks the compression codec.
+    const char* usage = "Usage: %s [-r repeats] [-t tile_size] [-F] [-c codec[:level]] <file_or_directory>...\n";
+    int repeats = 3;
+    int tile_size = 0;
+    int row_filters = ZDZEG_ROW_FILTERS_AUTO;
+    int codec = ZDZEG_CODEC_ZLIB;
+    int level = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:t:Fc:")) != -1) {
+        if (opt == 'c') {
+            if (zdzeg_codec_parse(optarg, &codec, &level) != ZDZEG_OK) {
+                fprintf(stderr, "Error: Codec '%s' is unknown or not built in.\n", optarg);
+                return 1;
+            }
+        } else if (opt == 'F') {
+            row_filters = ZDZEG_ROW_FILTERS_OFF;
+        } else if (opt == 'r') {
+            repeats = atoi(optarg);
+            if (repeats < 1) {
+                fprintf(stderr, "Error: Repeats must be at least 1.\n");
+                return 1;
+            }
+        } else if (opt == 't') {
+            tile_size = atoi(optarg);
+            if (tile_size <= 0 || tile_size > 4096) {
+                fprintf(stderr, "Error: Tile size must be between 1 and 4096.\n");
+                return 1;
+            }
+        } else {
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    if (SDL_Init(0) < 0) {
+        fprintf(stderr, "SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+        return 1;
+    }
+    IMG_Init(IMG_INIT_PNG | IMG_INIT_JPG | IMG_INIT_TIF | IMG_INIT_WEBP);
+    bench_ticks_per_ms = SDL_GetPerformanceFrequency() / 1000;
+    if (bench_ticks_per_ms == 0) bench_ticks_per_ms = 1;
+
+    // --- 1. Load the corpus ---
+    bench_image* images = NULL;
+    int image_count = 0, image_capacity = 0;
+    for (int i = optind; i < argc; ++i) add_path(&images, &image_count, &image_capacity, argv[i]);
+    if (image_count == 0) {
+        fprintf(stderr, "No images to benchmark.\n");
+        IMG_Quit();
+        SDL_Quit();
+        return 1;
+    }
+    fprintf(stderr, "Benchmarking %d images, %d repeats per case.\n", image_count, repeats);
+
+    bench_samples encode_samples = {(double*)malloc(sizeof(double) * image_count * repeats), 0, 0.0};
+    bench_samples decode_samples = {(double*)malloc(sizeof(double) * image_count * repeats), 0, 0.0};
+    zdzeg_encoder* enc = zdzeg_encoder_create();
+    unsigned char* encoded = NULL;
+    unsigned char* pixels = NULL;
+    int failures = 0;
+    // Buffers big enough for the largest image, full colour being the worst case
+    size_t encoded_cap = 0, pixels_cap = 0;
+    for (int i = 0; i < image_count; ++i) {
+        SDL_Surface* surface = images[i].surface;
+        zdzeg_params worst = {4, ZDZEG_CHANNEL_FULL, tile_size, ZDZEG_CODING_RUNS, row_filters, codec, level,
+                               ZDZEG_TUNE_OFF, 0, 0};
+        size_t bound = zdzeg_encode_bound(surface->w, surface->h, &worst);
+        size_t argb_size = (size_t)surface->w * surface->h * 4;
+        if (bound > encoded_cap) encoded_cap = bound;
+        if (argb_size > pixels_cap) pixels_cap = argb_size;
+    }
+    if (encoded_cap == 0) {
+        fprintf(stderr, "Error: Level %d is out of range for %s.\n", level, zdzeg_codec_name(codec));
+        return 1;
+    }
+    encoded = (unsigned char*)malloc(encoded_cap);
+    pixels = (unsigned char*)malloc(pixels_cap);
+    if (!encode_samples.ms || !decode_samples.ms || !enc || !encoded || !pixels) {
+        fprintf(stderr, "Memory allocation for the benchmark buffers failed.\n");
+        return 1;
+    }
+
+    // --- 2. Sweep every levels value and channel ---
+    const char* channels[] = {"red", "green", "blue", "full", "bw"};
+    printf("levels,channel,images,raw_bytes,compressed_bytes,ratio,encode_mb_s,decode_mb_s,"
+           "encode_p50_ms,encode_p99_ms,decode_p50_ms,decode_p99_ms,failures\n");
+    for (int levels = 4; levels <= 32; ++levels) {
+        for (int channel_idx = 0; channel_idx < 5; ++channel_idx) {
+            encode_samples.count = decode_samples.count = 0;
+            encode_samples.total_ms = decode_samples.total_ms = 0.0;
+            uint64_t raw_bytes = 0, raw_once = 0, compressed_bytes = 0;
+            int case_failures = 0;
+
+            for (int i = 0; i < image_count; ++i) {
+                SDL_Surface* surface = images[i].surface;
+                zdzeg_params params = {levels, channel_idx, tile_size, ZDZEG_CODING_PACKED, row_filters, codec, level,
+                                       ZDZEG_TUNE_OFF, 0, 0};
+                for (int r = 0; r < repeats; ++r) {
+                    // Encode into the memory buffer
+                    size_t encoded_len = 0;
+                    Uint64 start = SDL_GetPerformanceCounter();
+                    int result = zdzeg_encode_mem(enc, (const unsigned char*)surface->pixels, surface->w, surface->h,
+                                                  surface->pitch, &params, encoded, encoded_cap, &encoded_len);
+                    double encode_ms = elapsed_ms(start);
+
+                    // Decode it back into ARGB pixels
+                    int failed = result != ZDZEG_OK;
+                    double decode_ms = 0.0;
+                    if (!failed) {
+                        int w, h;
+                        start = SDL_GetPerformanceCounter();
+                        failed = zdzeg_decode_mem(encoded, encoded_len, pixels, pixels_cap, 0, &w, &h) != ZDZEG_OK;
+                        decode_ms = elapsed_ms(start);
+                    }
+                    if (failed) {
+                        case_failures++;
+                    } else {
+                        encode_samples.ms[encode_samples.count++] = encode_ms;
+                        decode_samples.ms[decode_samples.count++] = decode_ms;
+                        encode_samples.total_ms += encode_ms;
+                        decode_samples.total_ms += decode_ms;
+                        uint64_t image_bytes = (uint64_t)surface->w * surface->h * 3;
+                        raw_bytes += image_bytes;
+                        if (r == 0) {
+                            raw_once += image_bytes;
+                            compressed_bytes += encoded_len;
+                        }
+                    }
+                }
+            }
+
+            // --- 3. One CSV row per case ---
+            qsort(encode_samples.ms, encode_samples.count, sizeof(double), compare_doubles);
+            qsort(decode_samples.ms, decode_samples.count, sizeof(double), compare_doubles);
+            double raw_mb = raw_bytes / 1e6;
+            printf("%d,%s,%d,%llu,%llu,%.3f,%.2f,%.2f,%.3f,%.3f,%.3f,%.3f,%d\n",
+                   levels, channels[channel_idx], image_count,
+                   (unsigned long long)raw_once, (unsigned long long)compressed_bytes,
+                   compressed_bytes ? (double)raw_once / compressed_bytes : 0.0,
+                   encode_samples.total_ms > 0 ? raw_mb / (encode_samples.total_ms / 1000.0) : 0.0,
+                   decode_samples.total_ms > 0 ? raw_mb / (decode_samples.total_ms / 1000.0) : 0.0,
+                   percentile(&encode_samples, 0.50), percentile(&encode_samples, 0.99),
+                   percentile(&decode_samples, 0.50), percentile(&decode_samples, 0.99),
+                   case_failures);
+            fflush(stdout);
+            failures += case_failures;
+        }
+    }
+
+    // Clean up
+    for (int i = 0; i < image_count; ++i) {
+        free(images[i].path);
+        SDL_FreeSurface(images[i].surface);
+    }
+    free(images);
+    free(encoded);
+    free(pixels);
+    free(encode_samples.ms);
+    free(decode_samples.ms);
+    zdzeg_encoder_free(enc);
+    IMG_Quit();
+    SDL_Quit();
+    return failures ? 1 : 0;
+}
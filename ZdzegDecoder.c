@@ -0,0 +1,501 @@
+// Headless .zdzeg decoder: turns a file, or every .zdzeg file under a
+// folder, into PPM, PNG or raw RGB24 images. It only needs libzdzeg, zlib and
+// pthreads, so it runs on machines without SDL or a display.
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "zdzeg.h"
+
+#define FORMAT_PPM 0
+#define FORMAT_PNG 1
+#define FORMAT_RAW 2
+
+static const char* const format_names[] = {"ppm", "png", "raw"};
+static const char* const format_extensions[] = {".ppm", ".png", ".rgb"};
+
+typedef struct {
+    int format;     // FORMAT_*
+    int box_w;      // with -s, decode the smallest pyramid level covering
+    int box_h;      // a box_w x box_h box; 0 for full resolution
+    int png_level;  // zlib level of PNG output
+    int turns;      // quarter turns clockwise applied to the output, 0-3
+} decode_options;
+
+// Whether `name` ends in ".zdzeg".
+static int has_zdzeg_suffix(const char* name) {
+    size_t len = strlen(name);
+    return len > 6 && strcmp(name + len - 6, ".zdzeg") == 0;
+}
+
+// Writes a PNG chunk: length, type, data and the CRC of type and data.
+static int write_png_chunk(FILE* out, const char* type, const unsigned char* data, size_t len) {
+    unsigned char head[8], crc_bytes[4];
+    zdzeg_put_be32(head, (uint32_t)len);
+    memcpy(head + 4, type, 4);
+    uLong crc = crc32(0L, (const Bytef*)type, 4);
+    if (len > 0) crc = crc32(crc, data, (uInt)len);
+    zdzeg_put_be32(crc_bytes, (uint32_t)crc);
+    return fwrite(head, 1, 8, out) == 8 && (len == 0 || fwrite(data, 1, len, out) == len) &&
+           fwrite(crc_bytes, 1, 4, out) == 4;
+}
+
+// Writes ARGB8888 pixels as an 8-bit RGB PNG. Rows are deflated one at a time
+// and flushed in IDAT chunks, so no second copy of the image is built.
+static int write_png(FILE* out, const uint32_t* argb, int w, int h, int level) {
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    unsigned char ihdr[13];
+    zdzeg_put_be32(ihdr, (uint32_t)w);
+    zdzeg_put_be32(ihdr + 4, (uint32_t)h);
+    ihdr[8] = 8;  // bit depth
+    ihdr[9] = 2;  // truecolour
+    ihdr[10] = 0; // deflate
+    ihdr[11] = 0; // adaptive filtering, every row uses filter 0
+    ihdr[12] = 0; // no interlace
+    if (fwrite(signature, 1, 8, out) != 8 || !write_png_chunk(out, "IHDR", ihdr, sizeof(ihdr))) return 0;
+
+    size_t row_len = 1 + (size_t)w * 3;
+    unsigned char* row = (unsigned char*)malloc(row_len);
+    unsigned char chunk[65536];
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (!row || deflateInit(&zs, level) != Z_OK) {
+        free(row);
+        return 0;
+    }
+    int ok = 1;
+    zs.next_out = chunk;
+    zs.avail_out = sizeof(chunk);
+    for (int y = 0; y <= h && ok; ++y) {
+        int flush = Z_FINISH;
+        if (y < h) {
+            const uint32_t* in = argb + (size_t)y * w;
+            row[0] = 0;
+            for (int x = 0; x < w; ++x) {
+                row[1 + x * 3] = (unsigned char)(in[x] >> 16);
+                row[2 + x * 3] = (unsigned char)(in[x] >> 8);
+                row[3 + x * 3] = (unsigned char)in[x];
+            }
+            zs.next_in = row;
+            zs.avail_in = (uInt)row_len;
+            flush = Z_NO_FLUSH;
+        }
+        for (;;) {
+            int result = deflate(&zs, flush);
+            if (result == Z_STREAM_ERROR) {
+                ok = 0;
+                break;
+            }
+            if (zs.avail_out == 0 || (result == Z_STREAM_END && zs.avail_out < sizeof(chunk))) {
+                ok = write_png_chunk(out, "IDAT", chunk, sizeof(chunk) - zs.avail_out);
+                zs.next_out = chunk;
+                zs.avail_out = sizeof(chunk);
+                if (!ok) break;
+            }
+            if (result == Z_STREAM_END || (flush == Z_NO_FLUSH && zs.avail_in == 0 && zs.avail_out > 0)) break;
+        }
+    }
+    deflateEnd(&zs);
+    free(row);
+    return ok && write_png_chunk(out, "IEND", NULL, 0);
+}
+
+// Writes ARGB8888 pixels as RGB24, behind a binary PPM header unless `raw`.
+static int write_rgb(FILE* out, const uint32_t* argb, int w, int h, int raw) {
+    if (!raw && fprintf(out, "P6\n%d %d\n255\n", w, h) < 0) return 0;
+    unsigned char* row = (unsigned char*)malloc((size_t)w * 3);
+    if (!row) return 0;
+    int ok = 1;
+    for (int y = 0; y < h && ok; ++y) {
+        const uint32_t* in = argb + (size_t)y * w;
+        for (int x = 0; x < w; ++x) {
+            row[x * 3] = (unsigned char)(in[x] >> 16);
+            row[x * 3 + 1] = (unsigned char)(in[x] >> 8);
+            row[x * 3 + 2] = (unsigned char)in[x];
+        }
+        ok = fwrite(row, 3, w, out) == (size_t)w;
+    }
+    free(row);
+    return ok;
+}
+
+// Side of the square blocks rotate_argb works through. A block's 32 source
+// rows and 32 destination rows, 4 KiB each, stay in L1 while it is copied.
+#define ROTATE_BLOCK 32
+
+// Turns w x h ARGB8888 pixels `turns` quarter turns clockwise into `dst`,
+// which is h x w for odd turns. Both images are addressed by their pitch in
+// bytes. Odd turns are a transpose done block by block, so the cache lines
+// of the destination rows a block writes are reused instead of being
+// evicted between columns; it is plain scalar code.
+static void rotate_argb(const unsigned char* src, int w, int h, int src_pitch, unsigned char* dst, int dst_pitch,
+                        int turns) {
+    if (turns == 2) {
+        for (int y = 0; y < h; ++y) {
+            const uint32_t* in = (const uint32_t*)(src + (size_t)y * src_pitch);
+            uint32_t* out = (uint32_t*)(dst + (size_t)(h - 1 - y) * dst_pitch) + (w - 1);
+            for (int x = 0; x < w; ++x) out[-x] = in[x];
+        }
+        return;
+    }
+    for (int by = 0; by < h; by += ROTATE_BLOCK) {
+        int y_end = by + ROTATE_BLOCK < h ? by + ROTATE_BLOCK : h;
+        for (int bx = 0; bx < w; bx += ROTATE_BLOCK) {
+            int x_end = bx + ROTATE_BLOCK < w ? bx + ROTATE_BLOCK : w;
+            for (int y = by; y < y_end; ++y) {
+                const uint32_t* in = (const uint32_t*)(src + (size_t)y * src_pitch);
+                // Clockwise, source row y becomes destination column h - 1 - y,
+                // read top to bottom; counter-clockwise, column y, bottom to top
+                int dst_x = turns == 1 ? h - 1 - y : y;
+                for (int x = bx; x < x_end; ++x) {
+                    int dst_y = turns == 1 ? x : w - 1 - x;
+                    ((uint32_t*)(dst + (size_t)dst_y * dst_pitch))[dst_x] = in[x];
+                }
+            }
+        }
+    }
+}
+
+// Decodes `path` into a new ARGB8888 buffer, turned as the options ask.
+// Returns ZDZEG_OK or an error.
+static int decode_file(const char* path, const decode_options* opts, uint32_t** out, int* w, int* h) {
+    zdzeg_image img;
+    // The box is for the output, so it is turned back for the image
+    int box_w = opts->turns & 1 ? opts->box_h : opts->box_w;
+    int box_h = opts->turns & 1 ? opts->box_w : opts->box_h;
+    int result = box_w > 0 ? zdzeg_open_fit(path, box_w, box_h, &img) : zdzeg_open(path, &img);
+    if (result != ZDZEG_OK) return result;
+    *w = img.width;
+    *h = img.height;
+    *out = (uint32_t*)malloc((size_t)img.width * img.height * 4);
+    if (!*out) {
+        zdzeg_close(&img);
+        return ZDZEG_ERR_NOMEM;
+    }
+    zdzeg_rect full = {0, 0, img.width, img.height};
+    result = zdzeg_decode_argb(&img, &full, *out, img.width * 4);
+    zdzeg_close(&img);
+    if (result == ZDZEG_OK && opts->turns != 0) {
+        uint32_t* turned = (uint32_t*)malloc((size_t)*w * *h * 4);
+        if (turned) {
+            int turned_w = opts->turns & 1 ? *h : *w;
+            rotate_argb((const unsigned char*)*out, *w, *h, *w * 4, (unsigned char*)turned, turned_w * 4, opts->turns);
+            *h = opts->turns & 1 ? *w : *h;
+            *w = turned_w;
+        } else {
+            result = ZDZEG_ERR_NOMEM;
+        }
+        free(*out);
+        *out = turned;
+    }
+    if (result != ZDZEG_OK) {
+        free(*out);
+        *out = NULL;
+    }
+    return result;
+}
+
+static int write_image(FILE* out, const uint32_t* argb, int w, int h, const decode_options* opts) {
+    if (opts->format == FORMAT_PNG) return write_png(out, argb, w, h, opts->png_level);
+    return write_rgb(out, argb, w, h, opts->format == FORMAT_RAW);
+}
+
+// Creates every missing directory leading up to the file `path`.
+static int make_parent_dirs(const char* path) {
+    char temp[4096];
+    snprintf(temp, sizeof(temp), "%s", path);
+    for (char* p = temp + 1; *p; ++p) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(temp, 0755) != 0 && errno != EEXIST) return 0;
+        *p = '/';
+    }
+    return 1;
+}
+
+// One file of a batch. Jobs with no output path go to stdout, in order.
+typedef struct {
+    char* input;
+    char* output;
+    int failed;
+} decode_job;
+
+typedef struct {
+    decode_job* jobs;
+    int job_count;
+    int next_job;
+    int next_to_stdout; // stdout jobs must be written in job order
+    const decode_options* opts;
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+} decode_queue;
+
+static void* decode_worker(void* data) {
+    decode_queue* queue = (decode_queue*)data;
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        int idx = queue->next_job < queue->job_count ? queue->next_job++ : -1;
+        pthread_mutex_unlock(&queue->lock);
+        if (idx < 0) break;
+
+        decode_job* job = &queue->jobs[idx];
+        if (job->failed) continue; // no output path could be made
+        uint32_t* argb = NULL;
+        int w = 0, h = 0;
+        int result = decode_file(job->input, queue->opts, &argb, &w, &h);
+        if (result != ZDZEG_OK) fprintf(stderr, "Could not decode %s: %s\n", job->input, zdzeg_strerror(result));
+        if (!job->output) {
+            // Finished images wait here for their turn, so at most one per
+            // thread is held in memory
+            pthread_mutex_lock(&queue->lock);
+            while (queue->next_to_stdout != idx) pthread_cond_wait(&queue->turn, &queue->lock);
+            pthread_mutex_unlock(&queue->lock);
+            if (argb && !write_image(stdout, argb, w, h, queue->opts)) {
+                fprintf(stderr, "Could not write %s to standard output\n", job->input);
+                result = ZDZEG_ERR_IO;
+            } else if (argb) {
+                fprintf(stderr, "%s (%dx%d)\n", job->input, w, h);
+            }
+            fflush(stdout);
+            pthread_mutex_lock(&queue->lock);
+            queue->next_to_stdout++;
+            pthread_cond_broadcast(&queue->turn);
+            pthread_mutex_unlock(&queue->lock);
+        } else if (argb) {
+            FILE* out = make_parent_dirs(job->output) ? fopen(job->output, "wb") : NULL;
+            int ok = out && write_image(out, argb, w, h, queue->opts);
+            if (out && fclose(out) != 0) ok = 0;
+            if (ok) {
+                fprintf(stderr, "%s -> %s (%dx%d)\n", job->input, job->output, w, h);
+            } else {
+                fprintf(stderr, "Could not write %s\n", job->output);
+                if (out) remove(job->output);
+                result = ZDZEG_ERR_IO;
+            }
+        }
+        free(argb);
+        job->failed = result != ZDZEG_OK;
+    }
+    return NULL;
+}
+
+// Decodes every job with `thread_count` worker threads. Returns the number
+// of failures.
+static int run_decode_pool(decode_job* jobs, int job_count, int thread_count, const decode_options* opts) {
+    decode_queue queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.jobs = jobs;
+    queue.job_count = job_count;
+    queue.opts = opts;
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.turn, NULL);
+    if (thread_count > job_count) thread_count = job_count;
+    pthread_t* threads = (pthread_t*)calloc(thread_count > 1 ? thread_count - 1 : 1, sizeof(pthread_t));
+    int started = 0;
+    // The calling thread decodes too, so start one thread fewer
+    for (int i = 0; threads && i < thread_count - 1; ++i) {
+        if (pthread_create(&threads[started], NULL, decode_worker, &queue) == 0) started++;
+    }
+    decode_worker(&queue);
+    for (int i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_cond_destroy(&queue.turn);
+    pthread_mutex_destroy(&queue.lock);
+    int failures = 0;
+    for (int i = 0; i < job_count; ++i) failures += jobs[i].failed;
+    return failures;
+}
+
+// Output path for `input`: its .zdzeg suffix replaced by the format's
+// extension, and placed under `out_dir` (keeping the path below `root`)
+// when one is given.
+static char* output_path(const char* input, const char* root, const char* out_dir, const decode_options* opts) {
+    const char* rel = input;
+    if (out_dir) {
+        rel = input + strlen(root);
+        while (*rel == '/') ++rel;
+    }
+    size_t stem_len = strlen(rel) - (has_zdzeg_suffix(rel) ? 6 : 0);
+    const char* ext = format_extensions[opts->format];
+    size_t size = (out_dir ? strlen(out_dir) + 1 : 0) + stem_len + strlen(ext) + 1;
+    char* path = (char*)malloc(size);
+    if (!path) return NULL;
+    if (out_dir) snprintf(path, size, "%s/%.*s%s", out_dir, (int)stem_len, rel, ext);
+    else snprintf(path, size, "%.*s%s", (int)stem_len, rel, ext);
+    return path;
+}
+
+typedef struct {
+    char** files;
+    int count;
+    int capacity;
+} file_list;
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Collects every .zdzeg file below `dir`, skipping hidden folders and
+// symbolic links to folders like the encoder's batch mode.
+static void scan_directory(file_list* list, const char* dir) {
+    DIR* d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "Could not open directory %s\n", dir);
+        return;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.') continue;
+        size_t len = strlen(dir) + strlen(ent->d_name) + 2;
+        char* full = (char*)malloc(len);
+        if (!full) break;
+        snprintf(full, len, "%s/%s", dir, ent->d_name);
+        struct stat st;
+        if (lstat(full, &st) != 0) {
+            free(full);
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            scan_directory(list, full);
+            free(full);
+        } else if (S_ISREG(st.st_mode) && has_zdzeg_suffix(ent->d_name)) {
+            if (list->count == list->capacity) {
+                int capacity = list->capacity ? list->capacity * 2 : 64;
+                char** grown = (char**)realloc(list->files, capacity * sizeof(char*));
+                if (!grown) {
+                    free(full);
+                    break;
+                }
+                list->files = grown;
+                list->capacity = capacity;
+            }
+            list->files[list->count++] = full;
+        } else {
+            free(full);
+        }
+    }
+    closedir(d);
+}
+
+int main(int argc, char* argv[]) {
+    // Parse options: -f picks the output format (ppm, png or raw RGB24), -o
+    // names the output file, or the output folder for a folder, and "-o -"
+    // writes to standard output. -j N decodes N files at once (0 means one
+    // per CPU core), -s WxH decodes only the pyramid level needed for a
+    // WxH box, -z N sets the PNG compression level and -r N turns the output
+    // N quarter turns clockwise.
+    const char* usage = "Usage: %s [-f ppm|png|raw] [-o output|-] [-j threads] [-s WxH] [-z png_level] [-r quarter_turns] <file_or_directory_path>\n";
+    decode_options opts = {FORMAT_PPM, 0, 0, 6, 0};
+    const char* output = NULL;
+    int thread_count = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:o:j:s:z:r:")) != -1) {
+        if (opt == 'f') {
+            opts.format = -1;
+            for (int i = 0; i < 3; ++i) {
+                if (strcmp(optarg, format_names[i]) == 0) opts.format = i;
+            }
+            if (opts.format < 0) {
+                fprintf(stderr, "Error: Invalid format '%s'. Must be one of: ppm, png, raw.\n", optarg);
+                return 1;
+            }
+        } else if (opt == 'o') {
+            output = optarg;
+        } else if (opt == 'j') {
+            thread_count = atoi(optarg);
+        } else if (opt == 's') {
+            if (sscanf(optarg, "%dx%d", &opts.box_w, &opts.box_h) != 2 || opts.box_w <= 0 || opts.box_h <= 0) {
+                fprintf(stderr, "Error: Invalid size '%s'. Must be WIDTHxHEIGHT.\n", optarg);
+                return 1;
+            }
+        } else if (opt == 'z') {
+            opts.png_level = atoi(optarg);
+            if (opts.png_level < 0 || opts.png_level > 9) {
+                fprintf(stderr, "Error: PNG level must be between 0 and 9.\n");
+                return 1;
+            }
+        } else if (opt == 'r') {
+            // Any number of turns, negative ones counter-clockwise
+            opts.turns = ((atoi(optarg) % 4) + 4) % 4;
+        } else {
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 1) {
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+    if (thread_count <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpus > 0 ? (int)cpus : 1;
+    }
+    int to_stdout = output && strcmp(output, "-") == 0;
+    if (to_stdout && isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "Error: Refusing to write image data to a terminal.\n");
+        return 1;
+    }
+
+    char* path = strdup(argv[optind]);
+    if (!path) return 1;
+    // A trailing slash would otherwise end up doubled in every path
+    for (size_t len = strlen(path); len > 1 && path[len - 1] == '/'; --len) path[len - 1] = '\0';
+    struct stat path_stat;
+    if (stat(path, &path_stat) != 0) {
+        fprintf(stderr, "Error: Could not access path '%s'. Does it exist?\n", path);
+        free(path);
+        return 1;
+    }
+
+    file_list list = {NULL, 0, 0};
+    const char* out_dir = NULL;
+    if (S_ISREG(path_stat.st_mode)) {
+        list.files = (char**)malloc(sizeof(char*));
+        if (list.files) list.files[list.count++] = strdup(path);
+    } else if (S_ISDIR(path_stat.st_mode)) {
+        scan_directory(&list, path);
+        qsort(list.files, list.count, sizeof(char*), compare_paths);
+        if (to_stdout && opts.format == FORMAT_PNG) {
+            fprintf(stderr, "Error: Only ppm and raw images can be written to standard output one after another.\n");
+            free(path);
+            return 1;
+        }
+        if (!to_stdout) out_dir = output;
+    } else {
+        fprintf(stderr, "Error: Path '%s' is neither a regular file nor a directory.\n", path);
+        free(path);
+        return 1;
+    }
+
+    decode_job* jobs = (decode_job*)calloc(list.count > 0 ? list.count : 1, sizeof(decode_job));
+    if (!jobs) {
+        free(path);
+        return 1;
+    }
+    for (int i = 0; i < list.count; ++i) {
+        jobs[i].input = list.files[i];
+        if (to_stdout) continue;
+        if (output && !out_dir) jobs[i].output = strdup(output);
+        else jobs[i].output = output_path(list.files[i], path, out_dir, &opts);
+        if (!jobs[i].output) jobs[i].failed = 1;
+    }
+    int failures = list.count > 0 ? run_decode_pool(jobs, list.count, thread_count, &opts) : 0;
+    if (S_ISDIR(path_stat.st_mode)) {
+        fprintf(stderr, "Decoded %d, failed %d.\n", list.count - failures, failures);
+    }
+    for (int i = 0; i < list.count; ++i) {
+        free(jobs[i].input);
+        free(jobs[i].output);
+    }
+    free(jobs);
+    free(list.files);
+    free(path);
+    return failures > 0 ? 1 : 0;
+}
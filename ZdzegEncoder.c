@@ -1,17 +1,19 @@
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <zlib.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 
 // For directory and file handling
 #include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
-// Helper macro to get the pixel value from an SDL surface
-// This is for 24-bit RGB, assuming the format is correct.
-#define GET_PIXEL(surf, x, y) ((unsigned char*)surf->pixels + y * surf->pitch + x * 3)
+#include "zdzeg.h"
 
 /**
  * Checks if a file path has a supported image extension.
@@ -33,208 +35,917 @@ int is_supported_image(const char* filename) {
         return 0;
 }
 
-// Function to encode an image into the custom .zdzeg format
-int zdzeg_encode(const char* input_path, int levels, const char* channel_name) {
-    // --- 1. Validate parameters ---
-    const char* valid_channels[] = {"red", "green", "blue", "full", "bw"};
-    int channel_idx = -1;
-    for (int i = 0; i < 5; ++i) {
-        if (strcmp(channel_name, valid_channels[i]) == 0) {
-            channel_idx = i;
-            break;
-        }
-    }
-    if (channel_idx == -1) {
-        fprintf(stderr, "Error: Invalid channel '%s'. Must be one of: red, green, blue, full, bw.\n", channel_name);
+// One output of a source: a number of levels and a channel.
+typedef struct {
+    int levels;
+    int channel;              // ZDZEG_CHANNEL_*
+    const char* channel_name;
+} encode_variant;
+
+// Most variants one run can write, so a set of them fits a 64-bit mask.
+#define MAX_VARIANTS 64
+
+// Encoder settings shared by every file of a run.
+typedef struct {
+    encode_variant variants[MAX_VARIANTS]; // every levels x channel combination
+    int variant_count;
+    int tile_size;   // 0 writes one stream for the whole image
+    int coding;      // ZDZEG_CODING_*
+    int row_filters; // ZDZEG_ROW_FILTERS_*
+    int codec;       // ZDZEG_CODEC_*
+    int level;       // compression level, 0 for the codec's default
+    int tune;        // ZDZEG_TUNE_*
+    int tune_slack;  // percent, for ZDZEG_TUNE_FAST_DECODE
+    int pyramid;     // reduced levels stored for fast zoomed-out viewing
+    const char* output; // -o: output file of a single variant, "-" for stdout, or NULL
+    const char* pack;   // --pack: archive that receives every output, or NULL
+} encode_options;
+
+// Builds the output name of an input: "<name>_<levels>_<channel>.zdzeg".
+void output_path_for(const char* input_path, const encode_variant* variant, char* out, size_t size) {
+    const char* dot = strrchr(input_path, '.');
+    if (!dot) dot = input_path + strlen(input_path);
+    int basename_len = dot - input_path;
+    snprintf(out, size, "%.*s_%d_%s.zdzeg", basename_len, input_path, variant->levels, variant->channel_name);
+}
+
+// One variant of a source being written from the shared decoded surface.
+typedef struct {
+    const char* input_path;
+    const SDL_Surface* surface;
+    const encode_options* opts;
+    const encode_variant* variant;
+    zdzeg_encoder* enc;
+    char* out_text;
+    size_t out_len;
+    char* err_text;
+    size_t err_len;
+    int failed;
+    char* packed; // the encoded file when opts->pack is set
+    size_t packed_len;
+} variant_job;
+
+// Quantizes, run codes and compresses one variant into its output file, or
+// into job->packed for an archive. Returns 0 on success.
+int write_variant(variant_job* job, FILE* out, FILE* err) {
+    const SDL_Surface* surface = job->surface;
+    const encode_options* opts = job->opts;
+    char output_path[1024];
+    if (opts->pack) snprintf(output_path, sizeof(output_path), "%s", opts->pack);
+    else if (opts->output) snprintf(output_path, sizeof(output_path), "%s", opts->output);
+    else output_path_for(job->input_path, job->variant, output_path, sizeof(output_path));
+    int to_stdout = !opts->pack && strcmp(output_path, "-") == 0;
+
+    // The header is patched once the streams are written, which a pipe can't
+    // do, so output for stdout is streamed into memory and copied out whole.
+    // Archive members are kept in memory until the archive reaches them.
+    char* stream_data = NULL;
+    size_t stream_len = 0;
+    FILE* f = to_stdout || opts->pack ? open_memstream(&stream_data, &stream_len) : fopen(output_path, "wb");
+    if (!f) {
+        fprintf(err, "Could not open output file: %s\n", output_path);
         return 1;
     }
-    if (levels < 4 || levels > 32) {
-        fprintf(stderr, "Error: Levels must be between 4 and 32.\n");
+    zdzeg_params params = {job->variant->levels, job->variant->channel, opts->tile_size, opts->coding, opts->row_filters,
+                           opts->codec, opts->level, opts->tune, opts->tune_slack, opts->pyramid};
+    int result = zdzeg_encode_file(job->enc, (const unsigned char*)surface->pixels, surface->w, surface->h,
+                                   surface->pitch, &params, f);
+
+    // Close the file, removing it if anything went wrong
+    if (fclose(f) != 0 && result == ZDZEG_OK) result = ZDZEG_ERR_IO;
+    if (to_stdout && result == ZDZEG_OK && (fwrite(stream_data, 1, stream_len, stdout) != stream_len || fflush(stdout) != 0)) {
+        result = ZDZEG_ERR_IO;
+    }
+    if (opts->pack && result == ZDZEG_OK) {
+        job->packed = stream_data;
+        job->packed_len = stream_len;
+    } else {
+        free(stream_data);
+    }
+    if (result != ZDZEG_OK) {
+        if (result == ZDZEG_ERR_IO) fprintf(err, "Could not write output file: %s\n", output_path);
+        else fprintf(err, "Encoding %s failed: %s.\n", job->input_path, zdzeg_strerror(result));
+        if (!to_stdout && !opts->pack) remove(output_path);
         return 1;
     }
 
-    // --- 2. Load Image with SDL_image ---
-    SDL_Surface* img_surface = IMG_Load(input_path);
+    const char* tuning = zdzeg_encoder_tuning(job->enc);
+    const char* input_name = strcmp(job->input_path, "-") == 0 ? "standard input" : job->input_path;
+    const char* output_name = to_stdout ? "standard output" : output_path;
+    if (tuning) fprintf(out, "Successfully encoded %s -> %s (auto: %s)\n", input_name, output_name, tuning);
+    else fprintf(out, "Successfully encoded %s -> %s\n", input_name, output_name);
+    return 0;
+}
+
+// Thread entry for one variant; its messages are buffered so the variants
+// of a file print in order.
+int variant_worker(void* data) {
+    variant_job* job = (variant_job*)data;
+    FILE* out = open_memstream(&job->out_text, &job->out_len);
+    FILE* err = open_memstream(&job->err_text, &job->err_len);
+    job->failed = write_variant(job, out ? out : stdout, err ? err : stderr);
+    if (out) fclose(out);
+    if (err) fclose(err);
+    return 0;
+}
+
+// Reads all of standard input into memory, for "-" as the input path.
+unsigned char* read_stdin(size_t* len) {
+    size_t capacity = 1 << 20;
+    unsigned char* data = (unsigned char*)malloc(capacity);
+    *len = 0;
+    while (data) {
+        size_t n = fread(data + *len, 1, capacity - *len, stdin);
+        *len += n;
+        if (n == 0) break;
+        if (*len == capacity) {
+            unsigned char* grown = (unsigned char*)realloc(data, capacity * 2);
+            if (!grown) {
+                free(data);
+                return NULL;
+            }
+            data = grown;
+            capacity *= 2;
+        }
+    }
+    if (data && ferror(stdin)) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+// Function to encode an image into the custom .zdzeg format.
+// The image is loaded once and every variant of `opts` selected by `mask`
+// is written from it, in parallel when there are several. `encoders` holds
+// one reusable encoder per variant, or is NULL. Progress goes to `out` and
+// errors to `err`, so batch workers can buffer them and print each file's
+// messages in order. With opts->pack, packed[v] and packed_len[v] receive
+// the encoded file of variant v instead. Returns the mask of the variants
+// written.
+uint64_t zdzeg_encode(const char* input_path, const encode_options* opts, uint64_t mask, zdzeg_encoder** encoders,
+                      FILE* out, FILE* err, char** packed, size_t* packed_len) {
+    // --- 1. Load Image with SDL_image ---
+    SDL_Surface* img_surface = NULL;
+    if (strcmp(input_path, "-") == 0) {
+        size_t len;
+        unsigned char* data = read_stdin(&len);
+        SDL_RWops* rw = data && len <= INT_MAX ? SDL_RWFromConstMem(data, (int)len) : NULL;
+        if (rw) img_surface = IMG_Load_RW(rw, 1);
+        else fprintf(err, "Could not read an image from standard input.\n");
+        free(data);
+    } else {
+        img_surface = IMG_Load(input_path);
+    }
     if (!img_surface) {
-        fprintf(stderr, "IMG_Load failed for %s: %s\n", input_path, IMG_GetError());
-        return 1;
+        fprintf(err, "IMG_Load failed for %s: %s\n", strcmp(input_path, "-") == 0 ? "standard input" : input_path, IMG_GetError());
+        return 0;
     }
 
     // Convert to a specific pixel format (RGB24) for easier access
     SDL_Surface* formatted_surface = SDL_ConvertSurfaceFormat(img_surface, SDL_PIXELFORMAT_RGB24, 0);
     SDL_FreeSurface(img_surface);
     if (!formatted_surface) {
-        fprintf(stderr, "SDL_ConvertSurfaceFormat failed for %s: %s\n", input_path, SDL_GetError());
+        fprintf(err, "SDL_ConvertSurfaceFormat failed for %s: %s\n", input_path, SDL_GetError());
+        return 0;
+    }
+
+    // --- 2. Write every variant from the one decoded surface ---
+    variant_job jobs[MAX_VARIANTS];
+    int variant_idx[MAX_VARIANTS];
+    int count = 0;
+    for (int v = 0; v < opts->variant_count; ++v) {
+        if (!(mask & (1ULL << v))) continue;
+        memset(&jobs[count], 0, sizeof(variant_job));
+        jobs[count].input_path = input_path;
+        jobs[count].surface = formatted_surface;
+        jobs[count].opts = opts;
+        jobs[count].variant = &opts->variants[v];
+        jobs[count].enc = encoders ? encoders[v] : NULL;
+        variant_idx[count++] = v;
+    }
+    if (count == 1) {
+        jobs[0].failed = write_variant(&jobs[0], out, err);
+    } else {
+        SDL_Thread* threads[MAX_VARIANTS];
+        for (int i = 0; i < count; ++i) threads[i] = SDL_CreateThread(variant_worker, "zdzeg_variant", &jobs[i]);
+        for (int i = 0; i < count; ++i) {
+            // A variant whose thread did not start is written here instead
+            if (threads[i]) SDL_WaitThread(threads[i], NULL);
+            else variant_worker(&jobs[i]);
+            if (jobs[i].out_text) fputs(jobs[i].out_text, out);
+            if (jobs[i].err_text) fputs(jobs[i].err_text, err);
+            free(jobs[i].out_text);
+            free(jobs[i].err_text);
+        }
+    }
+    SDL_FreeSurface(formatted_surface);
+
+    uint64_t written = 0;
+    for (int i = 0; i < count; ++i) {
+        if (!jobs[i].failed) written |= 1ULL << variant_idx[i];
+        if (packed && !jobs[i].failed) {
+            packed[variant_idx[i]] = jobs[i].packed;
+            packed_len[variant_idx[i]] = jobs[i].packed_len;
+        } else {
+            free(jobs[i].packed);
+        }
+    }
+    return written;
+}
+
+// 64-bit FNV-1a hash of a file's contents. Sources whose timestamp changed
+// but whose bytes did not keep their output. Returns 0 on success.
+int hash_file(const char* path, unsigned long long* hash) {
+    FILE* f = fopen(path, "rb");
+    unsigned char* buffer = (unsigned char*)malloc(65536);
+    if (!f || !buffer) {
+        if (f) fclose(f);
+        free(buffer);
         return 1;
     }
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    size_t n;
+    while ((n = fread(buffer, 1, 65536, f)) > 0) {
+        for (size_t i = 0; i < n; ++i) h = (h ^ buffer[i]) * 0x100000001b3ULL;
+    }
+    int failed = ferror(f);
+    fclose(f);
+    free(buffer);
+    *hash = h;
+    return failed;
+}
+
+// --- Batch manifest ---
+// A directory batch keeps MANIFEST_NAME in the directory it was given, one
+// tab-separated line per output it wrote:
+//   output  source  size  mtime_sec  mtime_nsec  hash  parameters
+// with paths relative to that directory. A source whose size and mtime still
+// match is skipped without being read; one whose content hash still matches
+// is skipped without being encoded.
+#define MANIFEST_NAME ".zdzeg-manifest"
+#define MANIFEST_HEADER "# zdzeg manifest 1\n"
+
+typedef struct {
+    char* output;
+    char* source;
+    long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+    unsigned long long hash;
+    char* params;
+    int drop;      // removed when the manifest is saved
+} manifest_entry;
+
+typedef struct {
+    manifest_entry* entries;
+    int count;
+    int sorted_count; // entries[0..sorted_count) are sorted by output
+    int capacity;
+} manifest;
+
+int compare_entries(const void* a, const void* b) {
+    return strcmp(((const manifest_entry*)a)->output, ((const manifest_entry*)b)->output);
+}
+
+// Appends an entry, taking ownership of its strings. Returns 0 on success.
+int manifest_add(manifest* m, const manifest_entry* entry) {
+    if (m->count == m->capacity) {
+        int capacity = m->capacity ? m->capacity * 2 : 256;
+        manifest_entry* temp = (manifest_entry*)realloc(m->entries, capacity * sizeof(manifest_entry));
+        if (!temp) return 1;
+        m->entries = temp;
+        m->capacity = capacity;
+    }
+    m->entries[m->count++] = *entry;
+    return 0;
+}
 
-    int w = formatted_surface->w;
-    int h = formatted_surface->h;
-    unsigned char* pixels = (unsigned char*)formatted_surface->pixels;
+// Reads the manifest at `path`. A missing or unreadable manifest just starts
+// an empty one, which encodes everything.
+void manifest_load(manifest* m, const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) return;
+    char* line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_cap, f)) > 0) {
+        if (line[0] == '#') continue;
+        if (line[len - 1] == '\n') line[len - 1] = '\0';
+        char* fields[7];
+        char* save = NULL;
+        int n = 0;
+        for (char* tok = strtok_r(line, "\t", &save); tok && n < 7; tok = strtok_r(NULL, "\t", &save)) fields[n++] = tok;
+        if (n != 7) continue;
+        manifest_entry entry = {0};
+        entry.size = strtoll(fields[2], NULL, 10);
+        entry.mtime_sec = strtoll(fields[3], NULL, 10);
+        entry.mtime_nsec = strtol(fields[4], NULL, 10);
+        entry.hash = strtoull(fields[5], NULL, 16);
+        entry.output = strdup(fields[0]);
+        entry.source = strdup(fields[1]);
+        entry.params = strdup(fields[6]);
+        if (!entry.output || !entry.source || !entry.params || manifest_add(m, &entry)) {
+            free(entry.output);
+            free(entry.source);
+            free(entry.params);
+        }
+    }
+    free(line);
+    fclose(f);
+    qsort(m->entries, m->count, sizeof(manifest_entry), compare_entries);
+    m->sorted_count = m->count;
+}
 
-    // --- 3. Quantize the data ---
-    int num_channels = 0;
-    if (strcmp(channel_name, "full") == 0) num_channels = 3;
-    else if (strcmp(channel_name, "bw") == 0) num_channels = 1;
-    else num_channels = 1;
+// Finds the entry of an output among the entries that were loaded.
+manifest_entry* manifest_find(manifest* m, const char* output) {
+    manifest_entry key = {0};
+    key.output = (char*)output;
+    return (manifest_entry*)bsearch(&key, m->entries, m->sorted_count, sizeof(manifest_entry), compare_entries);
+}
 
-    unsigned long pixel_count = (unsigned long)w * h * num_channels;
-    unsigned char* quantized_data = (unsigned char*)malloc(pixel_count);
-    if (!quantized_data) {
-        fprintf(stderr, "Memory allocation for quantized data failed.\n");
-        SDL_FreeSurface(formatted_surface);
+// Writes the kept entries to `path` through a temporary file, so an
+// interrupted run leaves the previous manifest intact. Returns 0 on success.
+int manifest_save(manifest* m, const char* path) {
+    char temp_path[1120];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    FILE* f = fopen(temp_path, "w");
+    if (!f) return 1;
+    qsort(m->entries, m->count, sizeof(manifest_entry), compare_entries);
+    fputs(MANIFEST_HEADER, f);
+    for (int i = 0; i < m->count; ++i) {
+        const manifest_entry* e = &m->entries[i];
+        if (e->drop) continue;
+        fprintf(f, "%s\t%s\t%lld\t%lld\t%ld\t%016llx\t%s\n", e->output, e->source, e->size, e->mtime_sec,
+                e->mtime_nsec, e->hash, e->params);
+    }
+    if (fclose(f) != 0 || rename(temp_path, path) != 0) {
+        remove(temp_path);
         return 1;
     }
+    return 0;
+}
 
-    if (strcmp(channel_name, "full") == 0) {
-        for (int i = 0; i < w * h; ++i) {
-            unsigned char* p = GET_PIXEL(formatted_surface, i % w, i / w);
-            quantized_data[i * 3 + 0] = (unsigned char)(((int)p[0] * levels) / 256);
-            quantized_data[i * 3 + 1] = (unsigned char)(((int)p[1] * levels) / 256);
-            quantized_data[i * 3 + 2] = (unsigned char)(((int)p[2] * levels) / 256);
+void manifest_free(manifest* m) {
+    for (int i = 0; i < m->count; ++i) {
+        free(m->entries[i].output);
+        free(m->entries[i].source);
+        free(m->entries[i].params);
+    }
+    free(m->entries);
+}
+
+// The encode parameters recorded with every output, so a run with other
+// settings re-encodes files whose output name stays the same.
+void format_params(const encode_options* opts, const encode_variant* variant, char* out, size_t size) {
+    snprintf(out, size, "levels=%d channel=%s tile=%d coding=%d filters=%d codec=%s:%d tune=%d:%d pyramid=%d", variant->levels,
+             variant->channel_name, opts->tile_size, opts->coding, opts->row_filters, zdzeg_codec_name(opts->codec),
+             opts->level, opts->tune, opts->tune_slack, opts->pyramid);
+}
+
+// One file of a directory batch. Its messages are captured in memory and
+// printed by the main thread in directory order once the job is done.
+typedef struct {
+    char* path;
+    char* out_text;
+    size_t out_len;
+    char* err_text;
+    size_t err_len;
+    int done;
+    const char* source;     // path relative to the batch directory
+    struct stat st;         // of the source when it was queued
+    uint64_t todo;          // variants whose output is missing or out of date
+    uint64_t reusable;      // of those, the ones whose output is valid if the content did not change
+    unsigned long long previous_hash; // content hash recorded for the reusable outputs
+    unsigned long long hash;
+    int hashed;
+    uint64_t written;       // variants encoded by this run
+    uint64_t unchanged;     // variants kept because the content hash matched
+    char** packed;          // per variant, the encoded files waiting for the archive
+    size_t* packed_len;
+} encode_job;
+
+// Shared state for the batch worker pool.
+typedef struct {
+    encode_job* jobs;
+    int job_count;
+    int next_job;
+    const encode_options* opts;
+    SDL_mutex* lock;
+    SDL_cond* job_done;
+} encode_queue;
+
+// Worker thread: takes the next unclaimed file until the queue is empty.
+int encode_worker(void* data) {
+    encode_queue* queue = (encode_queue*)data;
+    zdzeg_encoder* encoders[MAX_VARIANTS];
+    for (int v = 0; v < queue->opts->variant_count; ++v) encoders[v] = zdzeg_encoder_create();
+    for (;;) {
+        SDL_LockMutex(queue->lock);
+        int idx = queue->next_job < queue->job_count ? queue->next_job++ : -1;
+        SDL_UnlockMutex(queue->lock);
+        if (idx < 0) break;
+
+        encode_job* job = &queue->jobs[idx];
+        FILE* out = open_memstream(&job->out_text, &job->out_len);
+        FILE* err = open_memstream(&job->err_text, &job->err_len);
+        // An archive is written whole, so its sources are always encoded
+        job->hashed = !queue->opts->pack && hash_file(job->path, &job->hash) == 0;
+        uint64_t encode = job->todo;
+        if (job->hashed && job->hash == job->previous_hash) encode &= ~job->reusable;
+        job->unchanged = job->todo & ~encode;
+        if (queue->opts->pack) {
+            job->packed = (char**)calloc(queue->opts->variant_count, sizeof(char*));
+            job->packed_len = (size_t*)calloc(queue->opts->variant_count, sizeof(size_t));
+            if (!job->packed || !job->packed_len) {
+                fprintf(err ? err : stderr, "Memory allocation failed for %s.\n", job->path);
+                encode = 0;
+            }
         }
-    } else if (strcmp(channel_name, "bw") == 0) {
-        for (int i = 0; i < w * h; ++i) {
-            unsigned char* p = GET_PIXEL(formatted_surface, i % w, i / w);
-            // Convert to grayscale using a simple average
-            unsigned char avg = (p[0] + p[1] + p[2]) / 3;
-            quantized_data[i] = (unsigned char)(((int)avg * levels) / 256);
+        if (encode) {
+            fprintf(out ? out : stdout, "Processing file: %s\n", job->path);
+            job->written = zdzeg_encode(job->path, queue->opts, encode, encoders, out ? out : stdout, err ? err : stderr,
+                                        job->packed, job->packed_len);
         }
-    } else { // Single channel (red, green, or blue)
-        int ch_offset = channel_idx; // 0 for red, 1 for green, 2 for blue
-        for (int i = 0; i < w * h; ++i) {
-            unsigned char* p = GET_PIXEL(formatted_surface, i % w, i / w);
-            quantized_data[i] = (unsigned char)(((int)p[ch_offset] * levels) / 256);
+        if (out) fclose(out);
+        if (err) fclose(err);
+
+        SDL_LockMutex(queue->lock);
+        job->done = 1;
+        SDL_CondBroadcast(queue->job_done);
+        SDL_UnlockMutex(queue->lock);
+    }
+    for (int v = 0; v < queue->opts->variant_count; ++v) zdzeg_encoder_free(encoders[v]);
+    return 0;
+}
+
+// Encodes every job with `thread_count` workers, printing each job's output
+// in order as soon as it and all jobs before it have finished. With an
+// archive, each job's files are appended to `pack` at the same point, so
+// only the files of jobs that finished early are held in memory.
+void run_encode_pool(encode_job* jobs, int job_count, int thread_count, const encode_options* opts,
+                     zdzeg_pack_writer* pack) {
+    if (job_count == 0) return;
+    encode_queue queue = {jobs, job_count, 0, opts, SDL_CreateMutex(), SDL_CreateCond()};
+    if (thread_count > job_count) thread_count = job_count;
+    if (thread_count < 1) thread_count = 1;
+
+    SDL_Thread** threads = (SDL_Thread**)calloc(thread_count, sizeof(SDL_Thread*));
+    int started = 0;
+    if (threads && queue.lock && queue.job_done) {
+        for (int i = 0; i < thread_count; ++i) {
+            threads[i] = SDL_CreateThread(encode_worker, "zdzeg_encode", &queue);
+            if (threads[i]) started++;
         }
     }
-    SDL_FreeSurface(formatted_surface);
+    if (started == 0) {
+        // No threads available; fall back to encoding on this thread.
+        fprintf(stderr, "Could not start worker threads, encoding sequentially.\n");
+        encode_worker(&queue);
+    }
 
-    // --- 4. Run-length encode (RLE) the quantized data ---
-    // A dynamic array is needed, so we'll use a larger initial size and realloc as needed.
-    size_t rle_capacity = pixel_count * 3 / 2; // A guess for initial size
-    unsigned char* rle_data = (unsigned char*)malloc(rle_capacity);
-    if (!rle_data) {
-        fprintf(stderr, "Memory allocation for RLE data failed.\n");
-        free(quantized_data);
-        return 1;
+    for (int i = 0; i < job_count; ++i) {
+        if (started > 0) {
+            SDL_LockMutex(queue.lock);
+            while (!jobs[i].done) SDL_CondWait(queue.job_done, queue.lock);
+            SDL_UnlockMutex(queue.lock);
+        }
+        if (jobs[i].out_text) fputs(jobs[i].out_text, stdout);
+        if (jobs[i].err_text) fputs(jobs[i].err_text, stderr);
+        fflush(stdout);
+        free(jobs[i].out_text);
+        free(jobs[i].err_text);
+        jobs[i].out_text = jobs[i].err_text = NULL;
+        for (int v = 0; pack && jobs[i].packed && v < opts->variant_count; ++v) {
+            if (!jobs[i].packed[v]) continue;
+            char name[1024];
+            output_path_for(jobs[i].source, &opts->variants[v], name, sizeof(name));
+            int result = zdzeg_pack_add(pack, name, (const unsigned char*)jobs[i].packed[v], jobs[i].packed_len[v]);
+            if (result != ZDZEG_OK) {
+                fprintf(stderr, "Could not add %s to %s: %s.\n", name, opts->pack, zdzeg_strerror(result));
+                jobs[i].written &= ~(1ULL << v);
+            }
+            free(jobs[i].packed[v]);
+        }
+        free(jobs[i].packed);
+        free(jobs[i].packed_len);
+        jobs[i].packed = NULL;
+        jobs[i].packed_len = NULL;
     }
-    size_t rle_size = 0;
 
-    if (pixel_count > 0) {
-        unsigned char current_val = quantized_data[0];
-        unsigned short count = 1;
-        for (unsigned long i = 1; i < pixel_count; ++i) {
-            if (quantized_data[i] == current_val && count < 65535) {
-                count++;
-            } else {
-                // Ensure there's space for the next run
-                if (rle_size + 3 > rle_capacity) {
-                    rle_capacity *= 2;
-                    unsigned char* temp = (unsigned char*)realloc(rle_data, rle_capacity);
-                    if (!temp) {
-                        fprintf(stderr, "Realloc for RLE data failed.\n");
-                        free(quantized_data);
-                        free(rle_data);
-                        return 1;
-                    }
-                    rle_data = temp;
-                }
-                rle_data[rle_size++] = current_val;
-                rle_data[rle_size++] = (count >> 8) & 0xFF;
-                rle_data[rle_size++] = count & 0xFF;
-                current_val = quantized_data[i];
-                count = 1;
+    for (int i = 0; i < thread_count && threads; ++i) {
+        if (threads[i]) SDL_WaitThread(threads[i], NULL);
+    }
+    free(threads);
+    if (queue.job_done) SDL_DestroyCond(queue.job_done);
+    if (queue.lock) SDL_DestroyMutex(queue.lock);
+}
+
+// State of a recursive directory scan.
+typedef struct {
+    const char* root;
+    size_t root_len;
+    const encode_options* opts;
+    manifest* manifest;
+    int force;        // re-encode even unchanged sources
+    encode_job* jobs;
+    int job_count;
+    int job_capacity;
+    int unchanged;
+} batch_scan;
+
+// Queues one source unless the manifest shows all its outputs are up to date.
+void queue_source(batch_scan* scan, const char* full_path, const struct stat* st) {
+    const char* source = full_path + scan->root_len + 1;
+    uint64_t todo = 0, reusable = 0;
+    unsigned long long previous_hash = 0;
+    for (int v = 0; v < scan->opts->variant_count; ++v) {
+        char output[1024], params[256];
+        output_path_for(source, &scan->opts->variants[v], output, sizeof(output));
+        format_params(scan->opts, &scan->opts->variants[v], params, sizeof(params));
+        manifest_entry* previous = manifest_find(scan->manifest, output);
+        int valid = 0;
+        if (previous && !scan->force && strcmp(previous->source, source) == 0 && strcmp(previous->params, params) == 0) {
+            char output_path[2048];
+            struct stat output_st;
+            snprintf(output_path, sizeof(output_path), "%s/%s", scan->root, output);
+            valid = stat(output_path, &output_st) == 0 && S_ISREG(output_st.st_mode);
+        }
+        if (valid && previous->size == (long long)st->st_size && previous->mtime_sec == (long long)st->st_mtim.tv_sec &&
+            previous->mtime_nsec == st->st_mtim.tv_nsec) {
+            scan->unchanged++;
+            continue;
+        }
+        todo |= 1ULL << v;
+        // Outputs recorded from other contents of the source are re-encoded
+        if (valid && (!reusable || previous->hash == previous_hash)) {
+            reusable |= 1ULL << v;
+            previous_hash = previous->hash;
+        }
+    }
+    if (!todo) return;
+
+    if (scan->job_count == scan->job_capacity) {
+        int capacity = scan->job_capacity ? scan->job_capacity * 2 : 64;
+        encode_job* temp = (encode_job*)realloc(scan->jobs, capacity * sizeof(encode_job));
+        if (!temp) {
+            fprintf(stderr, "Memory allocation for the file list failed.\n");
+            return;
+        }
+        scan->jobs = temp;
+        scan->job_capacity = capacity;
+    }
+    encode_job* job = &scan->jobs[scan->job_count];
+    memset(job, 0, sizeof(encode_job));
+    job->path = strdup(full_path);
+    if (!job->path) return;
+    job->source = job->path + scan->root_len + 1;
+    job->st = *st;
+    job->todo = todo;
+    job->reusable = reusable;
+    job->previous_hash = previous_hash;
+    scan->job_count++;
+}
+
+// Walks `dir` and its subdirectories for images. Hidden directories and
+// symbolic links to directories are skipped, so links cannot loop.
+void scan_directory(batch_scan* scan, const char* dir) {
+    DIR* d = opendir(dir);
+    if (!d) {
+        fprintf(stderr, "Error: Could not open directory at %s\n", dir);
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        // Construct the full path
+        char full_path[1024];
+        if (snprintf(full_path, sizeof(full_path), "%s/%s", dir, entry->d_name) >= (int)sizeof(full_path)) {
+            fprintf(stderr, "Skipping %s/%s: path too long.\n", dir, entry->d_name);
+            continue;
+        }
+        struct stat st;
+        if (lstat(full_path, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            if (entry->d_name[0] != '.') scan_directory(scan, full_path);
+            continue;
+        }
+        // Get file stats to check if it's a regular file, following links
+        if (stat(full_path, &st) == 0 && S_ISREG(st.st_mode) && is_supported_image(entry->d_name)) {
+            // Tabs and newlines would break the manifest lines
+            if (strpbrk(full_path, "\t\n")) {
+                fprintf(stderr, "Skipping %s: tabs and newlines are not supported in names.\n", full_path);
+                continue;
             }
+            queue_source(scan, full_path, &st);
         }
-        // Write the last run
-        if (rle_size + 3 > rle_capacity) {
-            rle_capacity += 3; // Enough for the last run
-            unsigned char* temp = (unsigned char*)realloc(rle_data, rle_capacity);
-            if (!temp) {
-                fprintf(stderr, "Realloc for final RLE run failed.\n");
-                free(quantized_data);
-                free(rle_data);
-                return 1;
+    }
+    closedir(d);
+}
+
+// Encodes the images below `root` that are new or changed since the last
+// run, removes the outputs of sources that were deleted, and updates the
+// manifest. `force` re-encodes every image.
+void encode_directory(const char* path, const encode_options* opts, int thread_count, int force) {
+    // Trailing slashes would double up in the printed paths
+    char root[1024];
+    snprintf(root, sizeof(root), "%s", path);
+    size_t root_len = strlen(root);
+    while (root_len > 1 && root[root_len - 1] == '/') root[--root_len] = '\0';
+
+    char manifest_path[1100];
+    snprintf(manifest_path, sizeof(manifest_path), "%s/%s", root, MANIFEST_NAME);
+    manifest m = {0};
+    manifest_load(&m, manifest_path);
+
+    // --- 1. Find the sources to encode ---
+    batch_scan scan = {root, root_len, opts, &m, force, NULL, 0, 0, 0};
+    scan_directory(&scan, root);
+
+    // --- 2. Encode them ---
+    run_encode_pool(scan.jobs, scan.job_count, thread_count, opts, NULL);
+
+    // --- 3. Remove the outputs of deleted sources ---
+    int removed = 0;
+    for (int i = 0; i < m.sorted_count; ++i) {
+        manifest_entry* e = &m.entries[i];
+        char path[2048];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", root, e->source);
+        if (stat(path, &st) == 0 || errno != ENOENT) continue;
+        snprintf(path, sizeof(path), "%s/%s", root, e->output);
+        if (remove(path) == 0 || errno == ENOENT) {
+            printf("Removed %s, its source was deleted\n", path);
+            e->drop = 1;
+            removed++;
+        } else {
+            fprintf(stderr, "Could not remove %s: %s\n", path, strerror(errno));
+        }
+    }
+
+    // --- 4. Record what was encoded ---
+    int encoded = 0, failed = 0;
+    for (int i = 0; i < scan.job_count; ++i) {
+        encode_job* job = &scan.jobs[i];
+        for (int v = 0; v < opts->variant_count; ++v) {
+            uint64_t bit = 1ULL << v;
+            if (!(job->todo & bit)) continue;
+            char output[1024], params[256];
+            output_path_for(job->source, &opts->variants[v], output, sizeof(output));
+            format_params(opts, &opts->variants[v], params, sizeof(params));
+            manifest_entry* e = manifest_find(&m, output);
+            if (job->written & bit) encoded++;
+            else if (job->unchanged & bit) scan.unchanged++;
+            else failed++;
+            // A failed encode has removed the output; one without a hash is
+            // encoded again next time
+            if (!((job->written | job->unchanged) & bit) || !job->hashed) {
+                if (e) e->drop = 1;
+                continue;
+            }
+            manifest_entry entry = {strdup(output), strdup(job->source), (long long)job->st.st_size,
+                                    (long long)job->st.st_mtim.tv_sec, job->st.st_mtim.tv_nsec, job->hash, strdup(params), 0};
+            if (!entry.output || !entry.source || !entry.params || (!e && manifest_add(&m, &entry))) {
+                free(entry.output);
+                free(entry.source);
+                free(entry.params);
+                if (e) e->drop = 1;
+                continue;
+            }
+            if (e) {
+                free(e->output);
+                free(e->source);
+                free(e->params);
+                *e = entry;
             }
-            rle_data = temp;
         }
-        rle_data[rle_size++] = current_val;
-        rle_data[rle_size++] = (count >> 8) & 0xFF;
-        rle_data[rle_size++] = count & 0xFF;
-    }
-
-    free(quantized_data);
-
-    // --- 5. Create header and combine with RLE data ---
-    unsigned char header[8];
-    header[0] = (w >> 24) & 0xFF;
-    header[1] = (w >> 16) & 0xFF;
-    header[2] = (w >> 8) & 0xFF;
-    header[3] = w & 0xFF;
-    header[4] = (h >> 24) & 0xFF;
-    header[5] = (h >> 16) & 0xFF;
-    header[6] = (h >> 8) & 0xFF;
-    header[7] = h & 0xFF;
-
-    // --- 6. Compress with zlib ---
-    unsigned long source_size = 8 + rle_size;
-    unsigned long compressed_size = compressBound(source_size);
-    unsigned char* compressed_data = (unsigned char*)malloc(compressed_size);
-    if (!compressed_data) {
-        fprintf(stderr, "Memory allocation for compressed data failed.\n");
-        free(rle_data);
-        return 1;
     }
+    if (manifest_save(&m, manifest_path) != 0) fprintf(stderr, "Could not write the manifest %s\n", manifest_path);
+    printf("Encoded %d, unchanged %d, failed %d, removed %d.\n", encoded, scan.unchanged, failed, removed);
 
-    unsigned char* source_data = (unsigned char*)malloc(source_size);
-    if (!source_data) {
-        fprintf(stderr, "Memory allocation for source data failed.\n");
-        free(compressed_data);
-        free(rle_data);
+    for (int i = 0; i < scan.job_count; ++i) free(scan.jobs[i].path);
+    free(scan.jobs);
+    manifest_free(&m);
+}
+
+int compare_jobs(const void* a, const void* b) {
+    return strcmp(((const encode_job*)a)->source, ((const encode_job*)b)->source);
+}
+
+// Encodes every image below `path` into the archive opts->pack, named by
+// their paths relative to `path` as in a directory run. The archive is
+// written to a temporary file and renamed over the old one once complete,
+// so viewers that have it open keep reading the previous version. Returns 0
+// on success.
+int pack_directory(const char* path, const encode_options* opts, int thread_count) {
+    char root[1024];
+    snprintf(root, sizeof(root), "%s", path);
+    size_t root_len = strlen(root);
+    while (root_len > 1 && root[root_len - 1] == '/') root[--root_len] = '\0';
+
+    // No manifest: every source is queued
+    manifest m = {0};
+    batch_scan scan = {root, root_len, opts, &m, 1, NULL, 0, 0, 0};
+    scan_directory(&scan, root);
+    // Members are stored in name order, so neighbours in a viewer are
+    // neighbours in the file
+    if (scan.jobs) qsort(scan.jobs, scan.job_count, sizeof(encode_job), compare_jobs);
+
+    char temp_path[1100];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", opts->pack);
+    FILE* f = fopen(temp_path, "wb");
+    zdzeg_pack_writer* writer = f ? zdzeg_pack_writer_create(f) : NULL;
+    if (!writer) {
+        fprintf(stderr, "Could not create the archive %s\n", temp_path);
+        if (f) fclose(f);
+        remove(temp_path);
+        for (int i = 0; i < scan.job_count; ++i) free(scan.jobs[i].path);
+        free(scan.jobs);
         return 1;
     }
-    memcpy(source_data, header, 8);
-    memcpy(source_data + 8, rle_data, rle_size);
-    free(rle_data);
+    run_encode_pool(scan.jobs, scan.job_count, thread_count, opts, writer);
 
-    int z_result = compress(compressed_data, &compressed_size, source_data, source_size);
-    free(source_data);
-    if (z_result != Z_OK) {
-        fprintf(stderr, "zlib compression failed with error code %d.\n", z_result);
-        free(compressed_data);
+    int packed = 0, failed = 0;
+    for (int i = 0; i < scan.job_count; ++i) {
+        for (int v = 0; v < opts->variant_count; ++v) {
+            if (scan.jobs[i].written & (1ULL << v)) packed++;
+            else failed++;
+        }
+        free(scan.jobs[i].path);
+    }
+    free(scan.jobs);
+    int result = zdzeg_pack_finish(writer);
+    if (fclose(f) != 0 && result == ZDZEG_OK) result = ZDZEG_ERR_IO;
+    if (result != ZDZEG_OK || rename(temp_path, opts->pack) != 0) {
+        fprintf(stderr, "Could not write the archive %s: %s.\n", opts->pack,
+                zdzeg_strerror(result != ZDZEG_OK ? result : ZDZEG_ERR_IO));
+        remove(temp_path);
         return 1;
     }
+    printf("Packed %d into %s, failed %d.\n", packed, opts->pack, failed);
+    return failed > 0;
+}
 
-    // --- 7. Save to file ---
-    char output_path[1024];
-    char* dot = strrchr(input_path, '.');
-    if (!dot) dot = (char*)input_path + strlen(input_path);
-    int basename_len = dot - input_path;
-    snprintf(output_path, sizeof(output_path), "%.*s_%d_%s.zdzeg", basename_len, input_path, levels, channel_name);
-
-    FILE* f = fopen(output_path, "wb");
-    if (!f) {
-        fprintf(stderr, "Could not open output file: %s\n", output_path);
-        free(compressed_data);
+// Expands the <levels> and <channel> arguments, each a comma-separated
+// list, into every combination. Returns 0 on success.
+int parse_variants(char* levels_arg, char* channels_arg, encode_options* opts) {
+    static const char* valid_channels[] = {"red", "green", "blue", "full", "bw"};
+    int levels[32], channels[5];
+    int level_count = 0, channel_count = 0;
+    char* save = NULL;
+    for (char* tok = strtok_r(levels_arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int value = atoi(tok);
+        if (value < 4 || value > 32) {
+            fprintf(stderr, "Error: Levels must be between 4 and 32.\n");
+            return 1;
+        }
+        // Repeated values would write the same file twice
+        int repeated = 0;
+        for (int i = 0; i < level_count; ++i) repeated |= levels[i] == value;
+        if (!repeated) levels[level_count++] = value;
+    }
+    for (char* tok = strtok_r(channels_arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int channel_idx = -1;
+        for (int i = 0; i < 5; ++i) {
+            if (strcmp(tok, valid_channels[i]) == 0) {
+                channel_idx = i;
+                break;
+            }
+        }
+        if (channel_idx == -1) {
+            fprintf(stderr, "Error: Invalid channel '%s'. Must be one of: red, green, blue, full, bw.\n", tok);
+            return 1;
+        }
+        int repeated = 0;
+        for (int i = 0; i < channel_count; ++i) repeated |= channels[i] == channel_idx;
+        if (!repeated) channels[channel_count++] = channel_idx;
+    }
+    if (level_count == 0 || channel_count == 0) {
+        fprintf(stderr, "Error: No levels or channels given.\n");
         return 1;
     }
-    fwrite(compressed_data, 1, compressed_size, f);
-    fclose(f);
-    free(compressed_data);
 
-    printf("Successfully encoded %s -> %s\n", input_path, output_path);
+    opts->variant_count = 0;
+    for (int l = 0; l < level_count; ++l) {
+        for (int c = 0; c < channel_count; ++c) {
+            if (opts->variant_count == MAX_VARIANTS) {
+                fprintf(stderr, "Error: At most %d levels and channel combinations per run.\n", MAX_VARIANTS);
+                return 1;
+            }
+            encode_variant* variant = &opts->variants[opts->variant_count++];
+            variant->levels = levels[l];
+            variant->channel = channels[c];
+            variant->channel_name = valid_channels[channels[c]];
+        }
+    }
     return 0;
 }
 
 int main(int argc, char* argv[]) {
+    // Parse options: -j N sets the number of worker threads for directory mode
+    // (0 means one per CPU core), -t N writes a tiled file with N x N tiles,
+    // -R writes plain 3-byte runs without row filters, which viewers from
+    // before packed coding can read, -F stores the quantized rows without
+    // prediction filters, -c codec[:level] picks the compression codec, -p N
+    // stores N reduced levels (1/2, 1/4, ...) for fast zoomed-out viewing,
+    // and --auto[=smallest|fast[:pct]] races deflate levels and strategies
+    // per image (or tile) and keeps the smallest result, or the fastest to
+    // decode within pct percent of it.
+    // --force re-encodes every image of a directory, even unchanged ones.
+    // -o names the output file of a single image, "-" meaning stdout; an
+    // input path of "-" reads the image from stdin and implies -o -.
+    // --pack writes every output of a directory into one .zdzpack archive.
+    const char* usage = "Usage: %s [-j threads] [-t tile_size] [-R] [-F] [-c codec[:level]] [-p levels] [--auto[=smallest|fast[:pct]]] [--force] "
+                        "[-o output|-] [--pack archive.zdzpack] <file_or_directory_path|-> <levels> <channel>\n";
+    static const struct option long_options[] = {{"auto", optional_argument, NULL, 'a'},
+                                                  {"force", no_argument, NULL, 'f'},
+                                                  {"pack", required_argument, NULL, 'P'},
+                                                  {NULL, 0, NULL, 0}};
+    encode_options opts = {{{0, 0, NULL}}, 0, 0, ZDZEG_CODING_PACKED, ZDZEG_ROW_FILTERS_AUTO, ZDZEG_CODEC_ZLIB, 0, ZDZEG_TUNE_OFF, 5, 0, NULL, NULL};
+    int thread_count = 1;
+    int force = 0;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:t:RFc:p:o:", long_options, NULL)) != -1) {
+        if (opt == 'a') {
+            char* end = NULL;
+            if (!optarg || strcmp(optarg, "smallest") == 0) {
+                opts.tune = ZDZEG_TUNE_SMALLEST;
+            } else if (strcmp(optarg, "fast") == 0) {
+                opts.tune = ZDZEG_TUNE_FAST_DECODE;
+            } else if (strncmp(optarg, "fast:", 5) == 0 && (opts.tune_slack = (int)strtol(optarg + 5, &end, 10)) >= 0 &&
+                       end != optarg + 5 && *end == '\0') {
+                opts.tune = ZDZEG_TUNE_FAST_DECODE;
+            } else {
+                fprintf(stderr, "Error: Invalid --auto mode '%s'. Must be smallest, fast or fast:percent.\n", optarg);
+                return 1;
+            }
+        } else if (opt == 'c') {
+            int result = zdzeg_codec_parse(optarg, &opts.codec, &opts.level);
+            if (result == ZDZEG_ERR_CODEC) {
+                fprintf(stderr, "Error: This build has no %s support.\n", optarg);
+                return 1;
+            } else if (result != ZDZEG_OK) {
+                fprintf(stderr, "Error: Invalid codec '%s'. Must be one of: zlib, zstd, lz4.\n", optarg);
+                return 1;
+            }
+        } else if (opt == 'p') {
+            opts.pyramid = atoi(optarg);
+            if (opts.pyramid < 0 || opts.pyramid > ZDZEG_PYRAMID_MAX) {
+                fprintf(stderr, "Error: Pyramid levels must be between 0 and %d.\n", ZDZEG_PYRAMID_MAX);
+                return 1;
+            }
+        } else if (opt == 'o') {
+            opts.output = optarg;
+        } else if (opt == 'P') {
+            opts.pack = optarg;
+        } else if (opt == 'f') {
+            force = 1;
+        } else if (opt == 'R') {
+            // Older viewers know neither packed coding nor row filters
+            opts.coding = ZDZEG_CODING_RUNS;
+            opts.row_filters = ZDZEG_ROW_FILTERS_OFF;
+        } else if (opt == 'F') {
+            opts.row_filters = ZDZEG_ROW_FILTERS_OFF;
+        } else if (opt == 'j') {
+            thread_count = atoi(optarg);
+        } else if (opt == 't') {
+            opts.tile_size = atoi(optarg);
+            if (opts.tile_size <= 0 || opts.tile_size > 4096) {
+                fprintf(stderr, "Error: Tile size must be between 1 and 4096.\n");
+                return 1;
+            }
+        } else {
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    }
+
     // Check for correct command-line arguments.
-    if (argc < 4) {
-        fprintf(stderr, "Usage: %s <file_or_directory_path> <levels> <channel>\n", argv[0]);
+    if (argc - optind < 3) {
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+    if (parse_variants(argv[optind + 1], argv[optind + 2], &opts) != 0) return 1;
+    if (opts.tune != ZDZEG_TUNE_OFF && opts.codec != ZDZEG_CODEC_ZLIB) {
+        fprintf(stderr, "Error: --auto only tunes the zlib codec.\n");
+        return 1;
+    }
+    const char* path = argv[optind];
+    int from_stdin = strcmp(path, "-") == 0;
+    if (from_stdin && !opts.output) opts.output = "-";
+    if (opts.pack && (opts.output || from_stdin)) {
+        fprintf(stderr, "Error: --pack reads a directory and can't be combined with -o or standard input.\n");
+        return 1;
+    }
+    if (opts.output && opts.variant_count > 1) {
+        fprintf(stderr, "Error: -o takes a single levels value and channel.\n");
         return 1;
     }
+    // Progress messages must not mix with a .zdzeg file on stdout
+    FILE* progress = opts.output && strcmp(opts.output, "-") == 0 ? stderr : stdout;
 
-    // Initialize SDL and SDL_image just once for the entire batch.
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+    // Initialize SDL and SDL_image just once for the entire batch. SDL is
+    // only used to load images and run the worker threads, so no video.
+    if (SDL_Init(0) < 0) {
         fprintf(stderr, "SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
         return 1;
     }
@@ -245,51 +956,46 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    int levels = atoi(argv[2]);
-    const char* channel_name = argv[3];
-    const char* path = argv[1];
+    if (thread_count <= 0) thread_count = SDL_GetCPUCount();
 
+    int failed = 0;
     struct stat path_stat;
-    if (stat(path, &path_stat) != 0) {
+    if (from_stdin) {
+        memset(&path_stat, 0, sizeof(path_stat));
+        path_stat.st_mode = S_IFREG;
+    } else if (stat(path, &path_stat) != 0) {
         fprintf(stderr, "Error: Could not access path '%s'. Does it exist?\n", path);
         IMG_Quit();
         SDL_Quit();
         return 1;
     }
 
+    if (opts.pack && !S_ISDIR(path_stat.st_mode)) {
+        fprintf(stderr, "Error: --pack needs a directory, '%s' is not one.\n", path);
+        IMG_Quit();
+        SDL_Quit();
+        return 1;
+    }
+
     // Check if the path is a regular file
     if (S_ISREG(path_stat.st_mode)) {
-        printf("Processing single file: %s\n", path);
-        zdzeg_encode(path, levels, channel_name);
+        fprintf(progress, "Processing single file: %s\n", from_stdin ? "standard input" : path);
+        zdzeg_encoder* encoders[MAX_VARIANTS];
+        for (int v = 0; v < opts.variant_count; ++v) encoders[v] = zdzeg_encoder_create();
+        uint64_t all = (opts.variant_count == MAX_VARIANTS ? 0 : 1ULL << opts.variant_count) - 1;
+        failed = zdzeg_encode(path, &opts, all, encoders, progress, stderr, NULL, NULL) != all;
+        for (int v = 0; v < opts.variant_count; ++v) zdzeg_encoder_free(encoders[v]);
     }
     // Check if the path is a directory
     else if (S_ISDIR(path_stat.st_mode)) {
-        DIR* dir = opendir(path);
-        if (!dir) {
-            fprintf(stderr, "Error: Could not open directory at %s\n", path);
+        if (opts.output) {
+            fprintf(stderr, "Error: -o only applies to a single image, not a directory.\n");
             IMG_Quit();
             SDL_Quit();
             return 1;
         }
-
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != NULL) {
-            // Construct the full path
-            char full_path[1024];
-            snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
-
-            // Get file stats to check if it's a regular file
-            struct stat st;
-            if (stat(full_path, &st) == 0 && S_ISREG(st.st_mode)) {
-                // Check if the file has a supported image extension
-                if (is_supported_image(entry->d_name)) {
-                    printf("Processing file: %s\n", full_path);
-                    zdzeg_encode(full_path, levels, channel_name);
-                }
-            }
-        }
-
-        closedir(dir);
+        if (opts.pack) failed = pack_directory(path, &opts, thread_count);
+        else encode_directory(path, &opts, thread_count, force);
     } else {
         fprintf(stderr, "Error: Path '%s' is neither a regular file nor a directory.\n", path);
         IMG_Quit();
@@ -301,5 +1007,5 @@ int main(int argc, char* argv[]) {
     IMG_Quit();
     SDL_Quit();
 
-    return 0;
+    return failed;
 }
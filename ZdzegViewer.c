@@ -1,118 +1,250 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <libgen.h>
-#include <zlib.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
+#include <zlib.h>
+
+#include "zdzeg.h"
 
 // Forward declarations
 char** get_zdzeg_files(const char* folder, int* count);
 void free_file_list(char** files, int count);
 SDL_Surface* load_zdzeg(const char* filepath, int* out_w, int* out_h);
-SDL_Surface* rotate_surface_90_degrees(SDL_Surface* surface);
-int get_levels_from_filename(const char* filename);
-int get_channel_from_filename(const char* filename, const char** keywords, int num_keywords);
-char** get_folder_content(const char* folder, int* subfolder_count, int* zdzeg_count);
+SDL_Surface* load_zdzeg_region(const char* filepath, const SDL_Rect* region, int* out_w, int* out_h);
+SDL_Surface* load_zdzeg_compact(const char* filepath, int* out_w, int* out_h);
+SDL_Texture* load_zdzeg_texture(SDL_Renderer* renderer, const char* filepath, int* out_w, int* out_h);
+SDL_Texture* load_zdzeg_texture_fit(SDL_Renderer* renderer, const char* filepath, int box_w, int box_h, int* out_w,
+                                    int* out_h, int* out_level);
+char** get_folder_content(const char* folder, int* subfolder_count, char*** files, int* zdzeg_count);
 void draw_menu(SDL_Renderer* renderer, TTF_Font* font, char** folders, int folder_count, int selected_idx);
 TTF_Font* find_and_open_font(int pt_size);
+int pan_key_held(void);
 
-// Helper function to get a value from a filename, e.g., "16"
-int get_levels_from_filename(const char* filename) {
-    char temp_filename[256];
-    strncpy(temp_filename, filename, sizeof(temp_filename) - 1);
-    temp_filename[sizeof(temp_filename) - 1] = '\0';
-    char* ext_pos = strrchr(temp_filename, '.');
-    if (ext_pos) {
-        *ext_pos = '\0';
-    }
-    char* token = strtok(temp_filename, "_");
-    while (token != NULL) {
-        int val = atoi(token);
-        if (val != 0) {
-            return val;
-        }
-        token = strtok(NULL, "_");
-    }
-    return 16;
-}
-
-// Helper function to get channel from filename
-int get_channel_from_filename(const char* filename, const char** keywords, int num_keywords) {
-    char temp_filename[256];
-    strncpy(temp_filename, filename, sizeof(temp_filename) - 1);
-    temp_filename[sizeof(temp_filename) - 1] = '\0';
-    char* ext_pos = strrchr(temp_filename, '.');
-    if (ext_pos) {
-        *ext_pos = '\0';
-    }
-    char* token = strtok(temp_filename, "_");
-    while (token != NULL) {
-        for (int i = 0; i < num_keywords; ++i) {
-            if (strcmp(token, keywords[i]) == 0) {
-                return i;
-            }
+// Defaults for the decoded image cache: pixel budget in MiB and how many
+// files on each side of the current one are decoded ahead.
+#define DEFAULT_CACHE_MB 256
+#define DEFAULT_PREFETCH 2
+
+// Longest the main loop sleeps waiting for input before checking in again.
+#define IDLE_WAIT_MS 500
+// Pan step in pixels per 60 Hz frame while a WASD key is held.
+#define PAN_FRAME_MS 16
+
+// Whether `name` ends in ".zdzeg" (so "x.zdzeg.bak" doesn't count).
+static int has_zdzeg_suffix(const char* name) {
+    size_t len = strlen(name);
+    return len > 6 && strcmp(name + len - 6, ".zdzeg") == 0;
+}
+
+// Whether `name` ends in ".zdzpack", an archive browsed like a folder.
+static int has_pack_suffix(const char* name) {
+    size_t len = strlen(name);
+    return len > 8 && strcmp(name + len - 8, ".zdzpack") == 0;
+}
+
+static int compare_names(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Appends `s` to a growable list, taking ownership of it. Returns 0 (and
+// frees `s`) when out of memory.
+static int list_append(char*** list, int* count, int* capacity, char* s) {
+    if (!s) return 0;
+    if (*count == *capacity) {
+        int new_capacity = *capacity ? *capacity * 2 : 64;
+        char** grown = (char**)realloc(*list, new_capacity * sizeof(char*));
+        if (!grown) {
+            free(s);
+            return 0;
         }
-        token = strtok(NULL, "_");
+        *list = grown;
+        *capacity = new_capacity;
     }
-    return 4;
+    (*list)[(*count)++] = s;
+    return 1;
 }
 
-// Function to get a list of all .zdzeg files in a directory
-char** get_zdzeg_files(const char* folder, int* count) {
-    DIR* dir;
-    struct dirent* ent;
-    char** files = NULL;
-    *count = 0;
-    dir = opendir(folder);
-    if (dir == NULL) {
-        fprintf(stderr, "Error opening directory: %s\n", folder);
+// --- Archives ---
+// A .zdzpack archive is browsed like a folder whose files are its members,
+// at paths "<archive>/<member name>". Those paths are resolved inside the
+// archive's mapping, so switching images makes no file system calls at all.
+// Archives stay mapped until the viewer exits, since the cache and
+// thumbnail threads may still be decoding from one after it is left; an
+// archive that changed on disk is mapped again next to the old mapping.
+typedef struct open_pack {
+    char* path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    zdzeg_pack pack;
+    struct open_pack* next;
+} open_pack;
+
+static open_pack* open_packs; // newest first
+static SDL_SpinLock open_packs_lock;
+
+// Maps the archive at `path`, or returns the mapping made earlier if the
+// file hasn't changed since. Returns NULL if it isn't a readable archive.
+static const open_pack* pack_open_path(const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return NULL;
+    SDL_AtomicLock(&open_packs_lock);
+    open_pack* p = open_packs;
+    while (p && !(strcmp(p->path, path) == 0 && p->dev == st.st_dev && p->ino == st.st_ino &&
+                  p->mtime.tv_sec == st.st_mtim.tv_sec && p->mtime.tv_nsec == st.st_mtim.tv_nsec)) {
+        p = p->next;
+    }
+    SDL_AtomicUnlock(&open_packs_lock);
+    if (p) return p;
+
+    p = (open_pack*)calloc(1, sizeof(open_pack));
+    if (p) p->path = strdup(path);
+    int result = p && p->path ? zdzeg_pack_open(path, &p->pack) : ZDZEG_ERR_NOMEM;
+    if (result != ZDZEG_OK) {
+        fprintf(stderr, "Could not open archive %s: %s\n", path, zdzeg_strerror(result));
+        if (p) free(p->path);
+        free(p);
         return NULL;
     }
-    int temp_count = 0;
-    while ((ent = readdir(dir)) != NULL) {
-        if (ent->d_type == DT_REG && strstr(ent->d_name, ".zdzeg") != NULL) {
-            temp_count++;
-        }
+    p->dev = st.st_dev;
+    p->ino = st.st_ino;
+    p->mtime = st.st_mtim;
+    SDL_AtomicLock(&open_packs_lock);
+    p->next = open_packs;
+    open_packs = p;
+    SDL_AtomicUnlock(&open_packs_lock);
+    return p;
+}
+
+// Finds the open archive that `path` points into and the member's index
+// there. Returns NULL for paths outside every open archive; *index is -1 if
+// the archive has no such member. Safe to call from any thread.
+static const open_pack* pack_member(const char* path, int* index) {
+    SDL_AtomicLock(&open_packs_lock);
+    open_pack* p = open_packs;
+    size_t len = 0;
+    while (p && !(len = strlen(p->path), strncmp(path, p->path, len) == 0 && path[len] == '/')) p = p->next;
+    SDL_AtomicUnlock(&open_packs_lock);
+    if (p) *index = zdzeg_pack_find(&p->pack, path + len + 1);
+    return p;
+}
+
+static void pack_close_all(void) {
+    while (open_packs) {
+        open_pack* next = open_packs->next;
+        zdzeg_pack_close(&open_packs->pack);
+        free(open_packs->path);
+        free(open_packs);
+        open_packs = next;
     }
-    closedir(dir);
-    if (temp_count == 0) {
-        *count = 0;
-        return NULL;
+}
+
+// Opens a .zdzeg file or archive member at the pyramid level that fits
+// box_w x box_h, or at full resolution when box_w or box_h is 0.
+static int open_zdzeg_path(const char* path, int box_w, int box_h, zdzeg_image* img) {
+    int index;
+    const open_pack* p = pack_member(path, &index);
+    if (p) return index >= 0 ? zdzeg_pack_open_image(&p->pack, index, box_w, box_h, img) : ZDZEG_ERR_IO;
+    if (box_w > 0 && box_h > 0) return zdzeg_open_fit(path, box_w, box_h, img);
+    return zdzeg_open(path, img);
+}
+
+// Lists the members of an archive as "<folder>/<name>" paths, already in
+// name order.
+static int scan_pack(const open_pack* p, const char* folder, char*** files, int* file_count) {
+    if (!files) {
+        *file_count = p->pack.count;
+        return 1;
     }
-    files = (char**)malloc(temp_count * sizeof(char*));
-    if (files == NULL) {
-        *count = 0;
-        fprintf(stderr, "Memory allocation failed for file list.\n");
-        return NULL;
+    int capacity = 0;
+    for (int i = 0; i < p->pack.count; ++i) {
+        zdzeg_pack_entry entry;
+        zdzeg_pack_get(&p->pack, i, &entry);
+        char* path = (char*)malloc(strlen(folder) + strlen(entry.name) + 2);
+        if (path) sprintf(path, "%s/%s", folder, entry.name);
+        if (!list_append(files, file_count, &capacity, path)) {
+            fprintf(stderr, "Memory allocation failed for the contents of %s.\n", folder);
+            free_file_list(*files, *file_count);
+            *files = NULL;
+            *file_count = 0;
+            return 0;
+        }
     }
-    dir = opendir(folder);
+    return 1;
+}
+
+// Reads `folder` once, collecting the names of its subfolders and the full
+// paths of its .zdzeg files into lists sorted by name. Archives count as
+// subfolders, and an archive given as `folder` lists its members. Either
+// list may be NULL; the counts are filled in regardless. Returns 0 on failure.
+static int scan_folder(const char* folder, char*** subfolders, int* subfolder_count, char*** files, int* file_count) {
+    *subfolder_count = 0;
+    *file_count = 0;
+    if (subfolders) *subfolders = NULL;
+    if (files) *files = NULL;
+    const open_pack* pack = has_pack_suffix(folder) ? pack_open_path(folder) : NULL;
+    if (pack) return scan_pack(pack, folder, files, file_count);
+    DIR* dir = opendir(folder);
     if (dir == NULL) {
-        *count = 0;
-        free(files);
-        fprintf(stderr, "Error re-opening directory: %s\n", folder);
-        return NULL;
+        fprintf(stderr, "Error opening directory: %s\n", folder);
+        return 0;
     }
-    int i = 0;
-    while ((ent = readdir(dir)) != NULL) {
-        if (ent->d_type == DT_REG && strstr(ent->d_name, ".zdzeg") != NULL) {
-            size_t path_len = strlen(folder) + strlen(ent->d_name) + 2;
-            files[i] = (char*)malloc(path_len);
-            if (files[i] == NULL) {
-                for (int j = 0; j < i; ++j) free(files[j]);
-                free(files);
-                closedir(dir);
-                *count = 0;
-                return NULL;
+    int subfolder_capacity = 0, file_capacity = 0;
+    int ok = 1;
+    struct dirent* ent;
+    while (ok && (ent = readdir(dir)) != NULL) {
+        int type = ent->d_type;
+        if (type == DT_UNKNOWN) {
+            // Some file systems don't report the type in the directory itself
+            struct stat st;
+            if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if ((type == DT_DIR && strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) ||
+            (type == DT_REG && has_pack_suffix(ent->d_name))) {
+            if (!subfolders) ++*subfolder_count;
+            else ok = list_append(subfolders, subfolder_count, &subfolder_capacity, strdup(ent->d_name));
+        } else if (type == DT_REG && has_zdzeg_suffix(ent->d_name)) {
+            if (!files) {
+                ++*file_count;
+                continue;
             }
-            sprintf(files[i], "%s/%s", folder, ent->d_name);
-            i++;
+            char* path = (char*)malloc(strlen(folder) + strlen(ent->d_name) + 2);
+            if (path) sprintf(path, "%s/%s", folder, ent->d_name);
+            ok = list_append(files, file_count, &file_capacity, path);
         }
     }
     closedir(dir);
-    *count = temp_count;
+    if (!ok) {
+        fprintf(stderr, "Memory allocation failed for the contents of %s.\n", folder);
+        if (subfolders) free_file_list(*subfolders, *subfolder_count);
+        if (files) free_file_list(*files, *file_count);
+        if (subfolders) *subfolders = NULL;
+        if (files) *files = NULL;
+        *subfolder_count = 0;
+        *file_count = 0;
+        return 0;
+    }
+    if (subfolders && *subfolders) qsort(*subfolders, *subfolder_count, sizeof(char*), compare_names);
+    if (files && *files) qsort(*files, *file_count, sizeof(char*), compare_names);
+    return 1;
+}
+
+// Function to get a sorted list of all .zdzeg files in a directory
+char** get_zdzeg_files(const char* folder, int* count) {
+    char** files;
+    int subfolder_count;
+    scan_folder(folder, NULL, &subfolder_count, &files, count);
     return files;
 }
 
@@ -128,209 +260,1082 @@ void free_file_list(char** files, int count) {
 
 // Loads and decodes a .zdzeg file into an SDL_Surface
 SDL_Surface* load_zdzeg(const char* filepath, int* out_w, int* out_h) {
-    FILE* f = fopen(filepath, "rb");
-    if (!f) {
-        fprintf(stderr, "Could not open file: %s\n", filepath);
+    return load_zdzeg_region(filepath, NULL, out_w, out_h);
+}
+
+// Shared by load_zdzeg_region and load_zdzeg_compact; `compact` allows an
+// INDEX8 surface for single-channel files.
+static SDL_Surface* load_zdzeg_surface(const char* filepath, const SDL_Rect* region, int compact, int* out_w, int* out_h) {
+    zdzeg_image img;
+    int result = open_zdzeg_path(filepath, 0, 0, &img);
+    if (result != ZDZEG_OK) {
+        fprintf(stderr, "Could not open %s: %s\n", filepath, zdzeg_strerror(result));
         return NULL;
     }
-    fseek(f, 0, SEEK_END);
-    long compressed_size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    unsigned char* compressed_data = malloc(compressed_size);
-    if (!compressed_data) {
-        fclose(f);
+    *out_w = img.width;
+    *out_h = img.height;
+
+    // Clip the requested region to the image
+    zdzeg_rect area = {0, 0, img.width, img.height};
+    if (region) {
+        int x1 = region->x + region->w < img.width ? region->x + region->w : img.width;
+        int y1 = region->y + region->h < img.height ? region->y + region->h : img.height;
+        area.x = region->x > 0 ? region->x : 0;
+        area.y = region->y > 0 ? region->y : 0;
+        area.w = x1 - area.x;
+        area.h = y1 - area.y;
+    }
+    if (area.w <= 0 || area.h <= 0) {
+        fprintf(stderr, "Requested region is outside the image: %s\n", filepath);
+        zdzeg_close(&img);
         return NULL;
     }
-    fread(compressed_data, 1, compressed_size, f);
-    fclose(f);
-    unsigned long uncompressed_size = compressed_size * 20;
-    unsigned char* uncompressed_data = malloc(uncompressed_size);
-    if (!uncompressed_data) {
-        free(compressed_data);
+
+    Uint32 palette[256];
+    int indexed = compact && zdzeg_palette(&img, palette) > 0;
+    SDL_Surface* surface = indexed ? SDL_CreateRGBSurfaceWithFormat(0, area.w, area.h, 8, SDL_PIXELFORMAT_INDEX8)
+                                   : SDL_CreateRGBSurfaceWithFormat(0, area.w, area.h, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (!surface) {
+        fprintf(stderr, "SDL_CreateRGBSurface failed: %s\n", SDL_GetError());
+        zdzeg_close(&img);
         return NULL;
     }
-    int z_result = uncompress(uncompressed_data, &uncompressed_size, compressed_data, compressed_size);
-    if (z_result == Z_BUF_ERROR) {
-        free(uncompressed_data);
-        uncompressed_data = malloc(uncompressed_size);
-        if (!uncompressed_data) {
-            free(compressed_data);
-            return NULL;
+    if (indexed) {
+        SDL_Color colors[256];
+        for (int i = 0; i < 256; ++i) {
+            colors[i].r = (palette[i] >> 16) & 0xFF;
+            colors[i].g = (palette[i] >> 8) & 0xFF;
+            colors[i].b = palette[i] & 0xFF;
+            colors[i].a = 255;
         }
-        z_result = uncompress(uncompressed_data, &uncompressed_size, compressed_data, compressed_size);
+        SDL_SetPaletteColors(surface->format->palette, colors, 0, 256);
+        result = zdzeg_decode_index8(&img, &area, surface->pixels, surface->pitch);
+    } else {
+        result = zdzeg_decode_argb(&img, &area, surface->pixels, surface->pitch);
     }
-    free(compressed_data);
-    if (z_result != Z_OK) {
-        fprintf(stderr, "Decompression failed for %s (code %d)\n", filepath, z_result);
-        free(uncompressed_data);
-        return NULL;
+    if (result != ZDZEG_OK) {
+        fprintf(stderr, "Could not decode %s: %s\n", filepath, zdzeg_strerror(result));
+        SDL_FreeSurface(surface);
+        surface = NULL;
     }
-    if (uncompressed_size < 8) {
-        fprintf(stderr, "File too small to contain header: %s\n", filepath);
-        free(uncompressed_data);
+    zdzeg_close(&img);
+    return surface;
+}
+
+// Loads and decodes only the part of a .zdzeg file inside `region` (image
+// pixels, clipped to the image; NULL means the whole image). For tiled files
+// only the tiles overlapping the region are decompressed. *out_w and *out_h
+// receive the full image size; the ARGB8888 surface has the size of the
+// clipped region.
+SDL_Surface* load_zdzeg_region(const char* filepath, const SDL_Rect* region, int* out_w, int* out_h) {
+    return load_zdzeg_surface(filepath, region, 0, out_w, out_h);
+}
+
+// Loads a whole .zdzeg file in the smallest surface that holds it: bw and
+// single-channel files become 8-bit paletted surfaces, a quarter of the size
+// of ARGB8888 and a quarter of the decode writes. SDL_CreateTextureFromSurface
+// expands them to the texture format when they are shown.
+SDL_Surface* load_zdzeg_compact(const char* filepath, int* out_w, int* out_h) {
+    return load_zdzeg_surface(filepath, NULL, 1, out_w, out_h);
+}
+
+// Loads a .zdzeg file straight into a new streaming texture in the
+// renderer's usual native format (ARGB8888), decoding into the locked
+// texture memory without any intermediate surface.
+SDL_Texture* load_zdzeg_texture(SDL_Renderer* renderer, const char* filepath, int* out_w, int* out_h) {
+    int level;
+    return load_zdzeg_texture_fit(renderer, filepath, INT_MAX, INT_MAX, out_w, out_h, &level);
+}
+
+// Like load_zdzeg_texture, but only decodes the pyramid level needed to show
+// the image scaled to fit inside box_w x box_h. *out_w and *out_h receive the
+// full image size and *out_level the level the texture holds.
+SDL_Texture* load_zdzeg_texture_fit(SDL_Renderer* renderer, const char* filepath, int box_w, int box_h, int* out_w,
+                                    int* out_h, int* out_level) {
+    zdzeg_image img;
+    int result = open_zdzeg_path(filepath, box_w, box_h, &img);
+    if (result != ZDZEG_OK) {
+        fprintf(stderr, "Could not open %s: %s\n", filepath, zdzeg_strerror(result));
         return NULL;
     }
-    int w = (uncompressed_data[0] << 24) | (uncompressed_data[1] << 16) | (uncompressed_data[2] << 8) | uncompressed_data[3];
-    int h = (uncompressed_data[4] << 24) | (uncompressed_data[5] << 16) | (uncompressed_data[6] << 8) | uncompressed_data[7];
-    if (w <= 0 || h <= 0) {
-        fprintf(stderr, "Invalid image dimensions: %dx%d\n", w, h);
-        free(uncompressed_data);
+    SDL_Texture* texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, img.width, img.height);
+    if (!texture) {
+        fprintf(stderr, "Texture could not be created! SDL Error: %s\n", SDL_GetError());
+        zdzeg_close(&img);
         return NULL;
     }
-    *out_w = w;
-    *out_h = h;
-    const unsigned char* raw_rle = uncompressed_data + 8;
-    unsigned long raw_rle_len = uncompressed_size - 8;
-    char* filename = strrchr(filepath, '/') ? strrchr(filepath, '/') + 1 : (char*)filepath;
-    const char* channels[] = {"red", "green", "blue", "full", "bw"};
-    int channel_idx = get_channel_from_filename(filename, channels, 5);
-    int levels_val = get_levels_from_filename(filename);
-    int num_channels = (strcmp(channels[channel_idx], "full") == 0) ? 3 : 1;
-    unsigned char* pixels_decoded = malloc(w * h * num_channels);
-    if (!pixels_decoded) {
-        free(uncompressed_data);
-        return NULL;
+    void* pixels;
+    int pitch;
+    zdzeg_rect area = {0, 0, img.width, img.height};
+    int failed = SDL_LockTexture(texture, NULL, &pixels, &pitch) != 0;
+    if (!failed) {
+        failed = zdzeg_decode_argb(&img, &area, pixels, pitch) != ZDZEG_OK;
+        SDL_UnlockTexture(texture);
+    }
+    if (failed) {
+        fprintf(stderr, "Failed to decode %s into a texture\n", filepath);
+        SDL_DestroyTexture(texture);
+        texture = NULL;
+    } else {
+        *out_w = img.full_width;
+        *out_h = img.full_height;
+        *out_level = img.level;
+    }
+    zdzeg_close(&img);
+    return texture;
+}
+
+// --- Decoded image cache ---
+// A background thread decodes the images around the current one into
+// surfaces (8-bit paletted for single-channel files, ARGB8888 otherwise),
+// kept in a least-recently-used list whose pixel bytes stay under a fixed
+// budget. Switching to a cached image only uploads it.
+typedef struct cache_entry {
+    char* path;
+    SDL_Surface* surface;
+    size_t bytes;
+    struct cache_entry* prev;
+    struct cache_entry* next;
+} cache_entry;
+
+typedef struct {
+    SDL_mutex* lock;
+    SDL_cond* wake;      // signalled when the wanted list changes or on quit
+    SDL_cond* decoded;   // signalled when the thread finishes a file
+    SDL_Thread* thread;
+    cache_entry* head;   // most recently used
+    cache_entry* tail;   // least recently used
+    size_t bytes;
+    size_t budget;
+    char** wanted;       // files to keep decoded, most important first
+    int wanted_count;
+    int next_wanted;     // first wanted file the thread hasn't tried yet
+    char* in_flight;     // file the thread is decoding right now
+    int in_flight_stale; // the file changed while in flight; drop the result
+    int quit;
+} image_cache;
+
+static size_t surface_bytes(const SDL_Surface* surface) {
+    return surface ? (size_t)surface->pitch * surface->h : 0;
+}
+
+static cache_entry* cache_find(image_cache* cache, const char* path) {
+    for (cache_entry* e = cache->head; e; e = e->next) {
+        if (strcmp(e->path, path) == 0) return e;
     }
-    int pixels_idx = 0;
-    for (unsigned long i = 0; i + 2 < raw_rle_len; i += 3) {
-        unsigned char val = raw_rle[i];
-        unsigned short count = (raw_rle[i+1] << 8) | raw_rle[i+2];
-        if ((unsigned long)(pixels_idx + count) > (unsigned long)(w * h * num_channels)) {
-            fprintf(stderr, "RLE count exceeds buffer, corrupt file: %s\n", filepath);
-            free(uncompressed_data);
-            free(pixels_decoded);
+    return NULL;
+}
+
+static void cache_unlink(image_cache* cache, cache_entry* e) {
+    if (e->prev) e->prev->next = e->next; else cache->head = e->next;
+    if (e->next) e->next->prev = e->prev; else cache->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void cache_push_front(image_cache* cache, cache_entry* e) {
+    e->prev = NULL;
+    e->next = cache->head;
+    if (cache->head) cache->head->prev = e; else cache->tail = e;
+    cache->head = e;
+}
+
+static void cache_free_entry(image_cache* cache, cache_entry* e) {
+    cache_unlink(cache, e);
+    cache->bytes -= e->bytes;
+    if (e->surface) SDL_FreeSurface(e->surface);
+    free(e->path);
+    free(e);
+}
+
+static int cache_is_wanted(const image_cache* cache, const char* path) {
+    for (int i = 0; i < cache->wanted_count; ++i) {
+        if (strcmp(cache->wanted[i], path) == 0) return 1;
+    }
+    return 0;
+}
+
+// Adds a decode result, evicting from the cold end to stay within budget.
+// When `keep_wanted` is set, files on the wanted list are not evicted, so
+// prefetching never pushes out the images around the current one. Failed
+// decodes (NULL) aren't kept, so a file caught half-written is decoded
+// again next time. Takes ownership of `surface`. Called with the lock held.
+static void cache_insert(image_cache* cache, const char* path, SDL_Surface* surface, int keep_wanted) {
+    size_t bytes = surface_bytes(surface);
+    if (!surface || bytes > cache->budget || cache_find(cache, path)) {
+        if (surface) SDL_FreeSurface(surface);
+        return;
+    }
+    cache_entry* e = cache->tail;
+    while (e && cache->bytes + bytes > cache->budget) {
+        cache_entry* prev = e->prev;
+        if (!keep_wanted || !cache_is_wanted(cache, e->path)) cache_free_entry(cache, e);
+        e = prev;
+    }
+    if (cache->bytes + bytes > cache->budget) {
+        if (surface) SDL_FreeSurface(surface);
+        return;
+    }
+    cache_entry* entry = (cache_entry*)calloc(1, sizeof(cache_entry));
+    char* path_copy = strdup(path);
+    if (!entry || !path_copy) {
+        free(entry);
+        free(path_copy);
+        if (surface) SDL_FreeSurface(surface);
+        return;
+    }
+    entry->path = path_copy;
+    entry->surface = surface;
+    entry->bytes = bytes;
+    cache_push_front(cache, entry);
+    cache->bytes += bytes;
+}
+
+static int cache_thread(void* arg) {
+    image_cache* cache = (image_cache*)arg;
+    SDL_LockMutex(cache->lock);
+    while (!cache->quit) {
+        // Each wanted file is tried once, so one that doesn't fit next to
+        // the others isn't decoded over and over
+        const char* next = NULL;
+        while (cache->next_wanted < cache->wanted_count && !next) {
+            const char* path = cache->wanted[cache->next_wanted++];
+            if (!cache_find(cache, path)) next = path;
+        }
+        if (!next) {
+            SDL_CondWait(cache->wake, cache->lock);
+            continue;
+        }
+        cache->in_flight = strdup(next);
+        if (!cache->in_flight) break;
+        SDL_UnlockMutex(cache->lock);
+
+        int w, h;
+        SDL_Surface* surface = load_zdzeg_compact(cache->in_flight, &w, &h);
+
+        SDL_LockMutex(cache->lock);
+        if (cache->in_flight_stale && surface) SDL_FreeSurface(surface);
+        else cache_insert(cache, cache->in_flight, surface, 1);
+        free(cache->in_flight);
+        cache->in_flight = NULL;
+        cache->in_flight_stale = 0;
+        SDL_CondBroadcast(cache->decoded);
+    }
+    SDL_UnlockMutex(cache->lock);
+    return 0;
+}
+
+// Starts the prefetch thread. A zero budget disables caching.
+int image_cache_init(image_cache* cache, size_t budget) {
+    memset(cache, 0, sizeof(*cache));
+    cache->budget = budget;
+    if (budget == 0) return 1;
+    cache->lock = SDL_CreateMutex();
+    cache->wake = SDL_CreateCond();
+    cache->decoded = SDL_CreateCond();
+    if (!cache->lock || !cache->wake || !cache->decoded) {
+        fprintf(stderr, "Failed to create image cache locks: %s\n", SDL_GetError());
+        return 0;
+    }
+    cache->thread = SDL_CreateThread(cache_thread, "zdzeg-prefetch", cache);
+    if (!cache->thread) {
+        fprintf(stderr, "Failed to start prefetch thread: %s\n", SDL_GetError());
+        return 0;
+    }
+    return 1;
+}
+
+void image_cache_destroy(image_cache* cache) {
+    if (cache->thread) {
+        SDL_LockMutex(cache->lock);
+        cache->quit = 1;
+        SDL_CondSignal(cache->wake);
+        SDL_UnlockMutex(cache->lock);
+        SDL_WaitThread(cache->thread, NULL);
+    }
+    while (cache->head) cache_free_entry(cache, cache->head);
+    free_file_list(cache->wanted, cache->wanted_count);
+    if (cache->decoded) SDL_DestroyCond(cache->decoded);
+    if (cache->wake) SDL_DestroyCond(cache->wake);
+    if (cache->lock) SDL_DestroyMutex(cache->lock);
+    memset(cache, 0, sizeof(*cache));
+}
+
+// Points the prefetcher at files[current] and the `radius` files on either
+// side of it, nearest first. Entries outside that window stay cached until
+// they are evicted. Passing no files stops prefetching.
+void image_cache_prefetch(image_cache* cache, char** files, int file_count, int current, int radius) {
+    if (!cache->thread) return;
+    int span = 0;
+    if (files && file_count > 0) span = 2 * radius + 1 < file_count ? 2 * radius + 1 : file_count;
+    char** wanted = span > 0 ? (char**)calloc(span, sizeof(char*)) : NULL;
+    if (span > 0 && !wanted) return;
+    int count = 0;
+    for (int d = 0; count < span; ++d) {
+        int next = (current + d) % file_count;
+        wanted[count] = strdup(files[next]);
+        if (!wanted[count]) break;
+        ++count;
+        if (d == 0 || count >= span) continue;
+        int prev = ((current - d) % file_count + file_count) % file_count;
+        if (prev == next) continue;
+        wanted[count] = strdup(files[prev]);
+        if (!wanted[count]) break;
+        ++count;
+    }
+    SDL_LockMutex(cache->lock);
+    free_file_list(cache->wanted, cache->wanted_count);
+    cache->wanted = wanted;
+    cache->wanted_count = count;
+    cache->next_wanted = 0;
+    SDL_CondSignal(cache->wake);
+    SDL_UnlockMutex(cache->lock);
+}
+
+// Drops the decoded copy of `filepath` after the file changed or vanished. A
+// decode of it already under way is discarded, and wanted files are tried
+// again so a new version is prefetched.
+void image_cache_forget(image_cache* cache, const char* filepath) {
+    if (!cache->thread) return;
+    SDL_LockMutex(cache->lock);
+    cache_entry* e = cache_find(cache, filepath);
+    if (e) cache_free_entry(cache, e);
+    if (cache->in_flight && strcmp(cache->in_flight, filepath) == 0) cache->in_flight_stale = 1;
+    cache->next_wanted = 0;
+    SDL_CondSignal(cache->wake);
+    SDL_UnlockMutex(cache->lock);
+}
+
+// Whether `filepath` is decoded and waiting in the cache.
+int image_cache_has(image_cache* cache, const char* filepath) {
+    if (!cache->thread) return 0;
+    SDL_LockMutex(cache->lock);
+    cache_entry* e = cache_find(cache, filepath);
+    int has = e && e->surface;
+    SDL_UnlockMutex(cache->lock);
+    return has;
+}
+
+// Builds a texture for `filepath`, from the cache when it is there. On a miss
+// the file is decoded here and kept if it fits; a file the prefetch thread is
+// already decoding is waited for rather than decoded twice. Returns NULL
+// without touching out_w/out_h if the file can't be decoded.
+SDL_Texture* image_cache_texture(image_cache* cache, SDL_Renderer* renderer, const char* filepath, int* out_w, int* out_h) {
+    if (!cache->thread) return load_zdzeg_texture(renderer, filepath, out_w, out_h);
+
+    SDL_LockMutex(cache->lock);
+    while (cache->in_flight && strcmp(cache->in_flight, filepath) == 0) {
+        SDL_CondWait(cache->decoded, cache->lock);
+    }
+    cache_entry* e = cache_find(cache, filepath);
+    if (!e) {
+        SDL_UnlockMutex(cache->lock);
+        int w, h;
+        SDL_Surface* surface = load_zdzeg_compact(filepath, &w, &h);
+        if (surface_bytes(surface) > cache->budget) {
+            // Too large to cache: upload it once and let it go
+            SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, surface);
+            if (texture) {
+                *out_w = surface->w;
+                *out_h = surface->h;
+            } else {
+                fprintf(stderr, "Texture could not be created! SDL Error: %s\n", SDL_GetError());
+            }
+            SDL_FreeSurface(surface);
+            return texture;
+        }
+        SDL_LockMutex(cache->lock);
+        cache_insert(cache, filepath, surface, 0);
+        e = cache_find(cache, filepath);
+        if (!e) {
+            SDL_UnlockMutex(cache->lock);
             return NULL;
         }
-        for (int k = 0; k < count; ++k) {
-            pixels_decoded[pixels_idx++] = val;
+    }
+    cache_unlink(cache, e);
+    cache_push_front(cache, e);
+    SDL_Texture* texture = NULL;
+    if (e->surface) {
+        texture = SDL_CreateTextureFromSurface(renderer, e->surface);
+        if (texture) {
+            *out_w = e->surface->w;
+            *out_h = e->surface->h;
+        } else {
+            fprintf(stderr, "Texture could not be created! SDL Error: %s\n", SDL_GetError());
         }
     }
-    free(uncompressed_data);
-    float* channel_values = malloc(levels_val * sizeof(float));
-    if (!channel_values) {
-        free(pixels_decoded);
+    SDL_UnlockMutex(cache->lock);
+    return texture;
+}
+
+// Texture for switching to `filepath`. With fit_w > 0 (fit-to-screen in a
+// fit_w x fit_h window) an image that isn't cached yet opens at the pyramid
+// level that fills the window; otherwise it comes from the cache at full
+// resolution. *out_level receives the level the texture holds.
+SDL_Texture* view_texture(image_cache* cache, SDL_Renderer* renderer, const char* filepath, int fit_w, int fit_h,
+                          int* out_w, int* out_h, int* out_level) {
+    if (fit_w > 0 && !image_cache_has(cache, filepath)) {
+        return load_zdzeg_texture_fit(renderer, filepath, fit_w, fit_h, out_w, out_h, out_level);
+    }
+    SDL_Texture* texture = image_cache_texture(cache, renderer, filepath, out_w, out_h);
+    if (texture) *out_level = 0;
+    return texture;
+}
+
+// Whether one of the WASD pan keys is currently held down.
+int pan_key_held(void) {
+    const Uint8* state = SDL_GetKeyboardState(NULL);
+    return state[SDL_SCANCODE_W] || state[SDL_SCANCODE_A] || state[SDL_SCANCODE_S] || state[SDL_SCANCODE_D];
+}
+
+// --- Thumbnail grid ---
+// The grid shows every image of a folder scaled to fit a THUMB_SIZE square.
+// Worker threads make the missing thumbnails, those on screen first, from
+// the smallest pyramid level that is large enough. Thumbnails are stored in
+// THUMB_CACHE_NAME inside the folder, keyed by file name, size and mtime, so
+// reopening a folder shows the grid without decoding any image. An archive's
+// cache sits next to it, named after it, and its members take the
+// archive's mtime.
+#define THUMB_SIZE 128
+#define THUMB_GAP 16
+#define THUMB_THREADS_MAX 4
+#define THUMB_CACHE_NAME ".zdz-thumbs"
+// Cache file: "ZTHM" and a version byte, then per thumbnail the name length
+// (16-bit), the name, file size and mtime seconds (64-bit), mtime nanoseconds
+// (32-bit), width and height (16-bit), data length (32-bit) and the
+// zlib-compressed RGB24 pixels. Numbers are big-endian.
+#define THUMB_CACHE_MAGIC "ZTHM"
+#define THUMB_CACHE_VERSION 1
+
+enum { THUMB_MISSING, THUMB_WORKING, THUMB_READY, THUMB_FAILED };
+
+typedef struct {
+    const char* path;      // points into the viewer's file list
+    const char* name;      // file name part of path, or the member name in an archive
+    long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+    int state;             // THUMB_*
+    int redo;              // the file changed while its thumbnail was being made
+    int w, h;
+    unsigned char* data;   // compressed RGB24 once READY
+    unsigned long data_len;
+    SDL_Texture* texture;  // only kept while the cell is on screen
+} thumb;
+
+typedef struct {
+    char* cache_path;
+    thumb* thumbs;
+    int count;
+    SDL_mutex* lock;
+    SDL_Thread* threads[THUMB_THREADS_MAX];
+    int thread_count;
+    int active;          // workers that haven't run out of thumbnails to make
+    int next;            // workers look for missing thumbnails from here
+    int dirty;           // thumbnails were made since the cache file was read
+    int quit;
+    Uint32 ready_event;  // pushed each time a thumbnail is done
+    int columns;         // layout of the last draw, for keyboard navigation
+    int rows;
+    int top_row;
+} thumb_grid;
+
+static void put_be(unsigned char* p, unsigned long long v, int bytes) {
+    for (int i = bytes - 1; i >= 0; --i, v >>= 8) p[i] = (unsigned char)v;
+}
+
+static unsigned long long get_be(const unsigned char* p, int bytes) {
+    unsigned long long v = 0;
+    for (int i = 0; i < bytes; ++i) v = (v << 8) | p[i];
+    return v;
+}
+
+// Decodes `path` at the pyramid level nearest THUMB_SIZE and averages it
+// down to fit THUMB_SIZE x THUMB_SIZE. Returns the compressed RGB24 pixels.
+static unsigned char* make_thumbnail(const char* path, int* out_w, int* out_h, unsigned long* out_len) {
+    zdzeg_image img;
+    if (open_zdzeg_path(path, THUMB_SIZE, THUMB_SIZE, &img) != ZDZEG_OK) return NULL;
+    int sw = img.width, sh = img.height;
+    Uint32* argb = (Uint32*)malloc((size_t)sw * sh * 4);
+    zdzeg_rect area = {0, 0, sw, sh};
+    int failed = !argb || zdzeg_decode_argb(&img, &area, argb, sw * 4) != ZDZEG_OK;
+    zdzeg_close(&img);
+    if (failed) {
+        free(argb);
         return NULL;
     }
-    for (int i = 0; i < levels_val; ++i)
-        channel_values[i] = (float)i * 255.0f / (levels_val - 1);
-    SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormat(0, w, h, 24, SDL_PIXELFORMAT_RGB24);
-    if (!surface) {
-        fprintf(stderr, "SDL_CreateRGBSurface failed: %s\n", SDL_GetError());
-        free(pixels_decoded);
-        free(channel_values);
+    int tw = sw, th = sh;
+    if (sw > THUMB_SIZE || sh > THUMB_SIZE) {
+        if (sw >= sh) {
+            tw = THUMB_SIZE;
+            th = (int)((long long)sh * THUMB_SIZE / sw);
+        } else {
+            th = THUMB_SIZE;
+            tw = (int)((long long)sw * THUMB_SIZE / sh);
+        }
+        if (tw < 1) tw = 1;
+        if (th < 1) th = 1;
+    }
+    unsigned long rgb_len = (unsigned long)tw * th * 3;
+    unsigned char* rgb = (unsigned char*)malloc(rgb_len);
+    uLongf packed_len = compressBound(rgb_len);
+    unsigned char* packed = (unsigned char*)malloc(packed_len);
+    if (!rgb || !packed) {
+        free(argb);
+        free(rgb);
+        free(packed);
         return NULL;
     }
-    SDL_SetSurfacePalette(surface, NULL);
-    unsigned char* surface_pixels = (unsigned char*)surface->pixels;
-    if (strcmp(channels[channel_idx], "full") == 0) {
-        for (int i = 0; i < w * h; ++i) {
-            surface_pixels[i*3 + 0] = (unsigned char)channel_values[pixels_decoded[i*3+0]];
-            surface_pixels[i*3 + 1] = (unsigned char)channel_values[pixels_decoded[i*3+1]];
-            surface_pixels[i*3 + 2] = (unsigned char)channel_values[pixels_decoded[i*3+2]];
-        }
-    } else if (strcmp(channels[channel_idx], "bw") == 0) {
-        for (int i = 0; i < w * h; ++i) {
-            unsigned char val = (unsigned char)channel_values[pixels_decoded[i]];
-            surface_pixels[i*3 + 0] = val;
-            surface_pixels[i*3 + 1] = val;
-            surface_pixels[i*3 + 2] = val;
+    // Each thumbnail pixel is the mean of the source block it covers
+    unsigned char* out = rgb;
+    for (int ty = 0; ty < th; ++ty) {
+        int y0 = (int)((long long)ty * sh / th), y1 = (int)((long long)(ty + 1) * sh / th);
+        if (y1 <= y0) y1 = y0 + 1;
+        for (int tx = 0; tx < tw; ++tx) {
+            int x0 = (int)((long long)tx * sw / tw), x1 = (int)((long long)(tx + 1) * sw / tw);
+            if (x1 <= x0) x1 = x0 + 1;
+            unsigned long r = 0, g = 0, b = 0, n = (unsigned long)(x1 - x0) * (y1 - y0);
+            for (int y = y0; y < y1; ++y) {
+                const Uint32* row = argb + (size_t)y * sw;
+                for (int x = x0; x < x1; ++x) {
+                    r += (row[x] >> 16) & 0xFF;
+                    g += (row[x] >> 8) & 0xFF;
+                    b += row[x] & 0xFF;
+                }
+            }
+            *out++ = (unsigned char)(r / n);
+            *out++ = (unsigned char)(g / n);
+            *out++ = (unsigned char)(b / n);
         }
-    } else {
-        int c_idx = (strcmp(channels[channel_idx], "red") == 0) ? 0 : (strcmp(channels[channel_idx], "green") == 0) ? 1 : 2;
-        memset(surface_pixels, 0, w*h*3);
-        for (int i = 0; i < w * h; ++i) {
-            surface_pixels[i*3 + c_idx] = (unsigned char)channel_values[pixels_decoded[i]];
+    }
+    free(argb);
+    int result = compress2(packed, &packed_len, rgb, rgb_len, Z_BEST_SPEED);
+    free(rgb);
+    if (result != Z_OK) {
+        free(packed);
+        return NULL;
+    }
+    *out_w = tw;
+    *out_h = th;
+    *out_len = packed_len;
+    return packed;
+}
+
+static int thumb_worker(void* arg) {
+    thumb_grid* grid = (thumb_grid*)arg;
+    SDL_LockMutex(grid->lock);
+    while (!grid->quit) {
+        thumb* t = NULL;
+        for (int i = 0; i < grid->count && !t; ++i) {
+            thumb* candidate = &grid->thumbs[(grid->next + i) % grid->count];
+            if (candidate->state == THUMB_MISSING) t = candidate;
+        }
+        if (!t) break;
+        t->state = THUMB_WORKING;
+        SDL_UnlockMutex(grid->lock);
+
+        int w = 0, h = 0;
+        unsigned long len = 0;
+        unsigned char* data = make_thumbnail(t->path, &w, &h, &len);
+
+        SDL_LockMutex(grid->lock);
+        if (t->redo) {
+            // Made from contents that have since changed; try again
+            free(data);
+            t->redo = 0;
+            t->state = THUMB_MISSING;
+            continue;
         }
+        t->data = data;
+        t->data_len = len;
+        t->w = w;
+        t->h = h;
+        t->state = data ? THUMB_READY : THUMB_FAILED;
+        if (data) grid->dirty = 1;
+        SDL_Event event;
+        memset(&event, 0, sizeof(event));
+        event.type = grid->ready_event;
+        SDL_PushEvent(&event);
     }
-    free(pixels_decoded);
-    free(channel_values);
-    return surface;
+    --grid->active;
+    SDL_UnlockMutex(grid->lock);
+    return 0;
 }
 
-// Function to rotate an SDL_Surface 90 degrees clockwise
-SDL_Surface* rotate_surface_90_degrees(SDL_Surface* surface) {
-    if (!surface) return NULL;
-    int old_w = surface->w;
-    int old_h = surface->h;
-    SDL_Surface* new_surface = SDL_CreateRGBSurfaceWithFormat(0, old_h, old_w, 24, SDL_PIXELFORMAT_RGB24);
-    if (!new_surface) {
-        fprintf(stderr, "Failed to create new surface for rotation: %s\n", SDL_GetError());
-        return NULL;
+// Starts up to `threads` workers, reusing the slots of workers that have
+// finished. Called from the main thread.
+static void thumb_grid_start(thumb_grid* grid, int threads) {
+    SDL_LockMutex(grid->lock);
+    int idle = grid->active == 0;
+    SDL_UnlockMutex(grid->lock);
+    if (idle) {
+        // Every earlier worker has returned or is about to
+        for (int i = 0; i < grid->thread_count; ++i) SDL_WaitThread(grid->threads[i], NULL);
+        grid->thread_count = 0;
     }
-    SDL_LockSurface(surface);
-    SDL_LockSurface(new_surface);
-    unsigned char* old_pixels = (unsigned char*)surface->pixels;
-    unsigned char* new_pixels = (unsigned char*)new_surface->pixels;
-    for (int y = 0; y < old_h; ++y) {
-        for (int x = 0; x < old_w; ++x) {
-            int old_idx = (y * old_w + x) * 3;
-            int new_idx = ((old_w - 1 - x) * old_h + y) * 3;
-            new_pixels[new_idx + 0] = old_pixels[old_idx + 0];
-            new_pixels[new_idx + 1] = old_pixels[old_idx + 1];
-            new_pixels[new_idx + 2] = old_pixels[old_idx + 2];
+    for (int i = 0; i < threads && grid->thread_count < THUMB_THREADS_MAX; ++i) {
+        SDL_LockMutex(grid->lock);
+        ++grid->active;
+        SDL_UnlockMutex(grid->lock);
+        grid->threads[grid->thread_count] = SDL_CreateThread(thumb_worker, "zdzeg-thumbs", grid);
+        if (grid->threads[grid->thread_count]) {
+            ++grid->thread_count;
+        } else {
+            SDL_LockMutex(grid->lock);
+            --grid->active;
+            SDL_UnlockMutex(grid->lock);
         }
     }
-    SDL_UnlockSurface(surface);
-    SDL_UnlockSurface(new_surface);
-    return new_surface;
+    if (grid->thread_count == 0) fprintf(stderr, "Failed to start thumbnail threads: %s\n", SDL_GetError());
 }
 
-// Scans a folder for subdirectories and .zdzeg files
-char** get_folder_content(const char* folder, int* subfolder_count, int* zdzeg_count) {
-    DIR* dir;
-    struct dirent* ent;
-    char** subfolders = NULL;
-    *subfolder_count = 0;
-    *zdzeg_count = 0;
-    dir = opendir(folder);
-    if (dir == NULL) {
-        fprintf(stderr, "Error opening directory: %s\n", folder);
-        return NULL;
-    }
-    int temp_sub_count = 0;
-    int temp_file_count = 0;
-    while ((ent = readdir(dir)) != NULL) {
-        if (ent->d_type == DT_DIR && strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
-            temp_sub_count++;
+static int compare_thumb_names(const void* a, const void* b) {
+    return strcmp((*(thumb* const*)a)->name, (*(thumb* const*)b)->name);
+}
+
+// Fills in thumbnails from the folder's cache file where the image's size
+// and mtime still match.
+static void thumb_cache_load(thumb_grid* grid) {
+    FILE* f = fopen(grid->cache_path, "rb");
+    if (!f) return;
+    unsigned char* buf = NULL;
+    long size = -1;
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+        buf = (unsigned char*)malloc(size);
+        if (buf && fread(buf, 1, size, f) != (size_t)size) {
+            free(buf);
+            buf = NULL;
         }
-        if (ent->d_type == DT_REG && strstr(ent->d_name, ".zdzeg") != NULL) {
-            temp_file_count++;
+    }
+    fclose(f);
+    thumb** by_name = (thumb**)malloc(grid->count * sizeof(thumb*));
+    if (!buf || !by_name || size < 5 || memcmp(buf, THUMB_CACHE_MAGIC, 4) != 0 || buf[4] != THUMB_CACHE_VERSION) {
+        free(buf);
+        free(by_name);
+        return;
+    }
+    for (int i = 0; i < grid->count; ++i) by_name[i] = &grid->thumbs[i];
+    qsort(by_name, grid->count, sizeof(thumb*), compare_thumb_names);
+
+    const unsigned char* p = buf + 5;
+    const unsigned char* end = buf + size;
+    char name[PATH_MAX];
+    while (end - p >= 2) {
+        size_t name_len = get_be(p, 2);
+        if (name_len >= sizeof(name) || (size_t)(end - p) < 2 + name_len + 28) break;
+        memcpy(name, p + 2, name_len);
+        name[name_len] = '\0';
+        p += 2 + name_len;
+        long long file_size = (long long)get_be(p, 8);
+        long long mtime_sec = (long long)get_be(p + 8, 8);
+        long mtime_nsec = (long)get_be(p + 16, 4);
+        int w = (int)get_be(p + 20, 2), h = (int)get_be(p + 22, 2);
+        unsigned long data_len = get_be(p + 24, 4);
+        p += 28;
+        if ((unsigned long)(end - p) < data_len) break;
+        thumb key;
+        key.name = name;
+        thumb* key_ptr = &key;
+        thumb** found = (thumb**)bsearch(&key_ptr, by_name, grid->count, sizeof(thumb*), compare_thumb_names);
+        if (found) {
+            thumb* t = *found;
+            if (t->state == THUMB_MISSING && t->size == file_size && t->mtime_sec == mtime_sec &&
+                t->mtime_nsec == mtime_nsec && w > 0 && h > 0 && w <= THUMB_SIZE && h <= THUMB_SIZE) {
+                t->data = (unsigned char*)malloc(data_len);
+                if (t->data) {
+                    memcpy(t->data, p, data_len);
+                    t->data_len = data_len;
+                    t->w = w;
+                    t->h = h;
+                    t->state = THUMB_READY;
+                }
+            }
         }
+        p += data_len;
     }
-    closedir(dir);
-    *subfolder_count = temp_sub_count;
-    *zdzeg_count = temp_file_count;
-    if (temp_sub_count == 0) {
-        return NULL;
+    free(by_name);
+    free(buf);
+}
+
+// Writes every finished thumbnail to the folder's cache file. Thumbnails of
+// images that are gone are dropped along the way.
+static void thumb_cache_save(thumb_grid* grid) {
+    char temp_path[PATH_MAX + 8];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", grid->cache_path);
+    FILE* f = fopen(temp_path, "wb");
+    if (!f) return;
+    unsigned char header[28];
+    memcpy(header, THUMB_CACHE_MAGIC, 4);
+    header[4] = THUMB_CACHE_VERSION;
+    int ok = fwrite(header, 1, 5, f) == 5;
+    for (int i = 0; i < grid->count && ok; ++i) {
+        const thumb* t = &grid->thumbs[i];
+        if (t->state != THUMB_READY) continue;
+        size_t name_len = strlen(t->name);
+        put_be(header, name_len, 2);
+        ok = fwrite(header, 1, 2, f) == 2 && fwrite(t->name, 1, name_len, f) == name_len;
+        put_be(header, (unsigned long long)t->size, 8);
+        put_be(header + 8, (unsigned long long)t->mtime_sec, 8);
+        put_be(header + 16, (unsigned long long)t->mtime_nsec, 4);
+        put_be(header + 20, t->w, 2);
+        put_be(header + 22, t->h, 2);
+        put_be(header + 24, t->data_len, 4);
+        ok = ok && fwrite(header, 1, 28, f) == 28 && fwrite(t->data, 1, t->data_len, f) == t->data_len;
     }
-    subfolders = (char**)malloc(temp_sub_count * sizeof(char*));
-    if (!subfolders) {
-        fprintf(stderr, "Memory allocation failed for subfolder list.\n");
-        return NULL;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(temp_path, grid->cache_path) != 0) {
+        fprintf(stderr, "Could not write thumbnail cache: %s\n", grid->cache_path);
+        remove(temp_path);
     }
-    dir = opendir(folder);
-    if (!dir) {
-        free(subfolders);
-        fprintf(stderr, "Error re-opening directory: %s\n", folder);
-        return NULL;
+}
+
+// Opens the grid for `files` in `folder`, reading cached thumbnails and
+// starting workers for the rest. Returns 0 on failure.
+int thumb_grid_open(thumb_grid* grid, const char* folder, char** files, int file_count, Uint32 ready_event) {
+    memset(grid, 0, sizeof(*grid));
+    grid->ready_event = ready_event;
+    int index;
+    const open_pack* pack = file_count > 0 ? pack_member(files[0], &index) : NULL;
+    grid->cache_path = (char*)malloc(strlen(folder) + strlen(THUMB_CACHE_NAME) + 2);
+    if (grid->cache_path) sprintf(grid->cache_path, pack ? "%s%s" : "%s/%s", folder, THUMB_CACHE_NAME);
+    grid->thumbs = (thumb*)calloc(file_count, sizeof(thumb));
+    grid->lock = SDL_CreateMutex();
+    if (!grid->cache_path || !grid->thumbs || !grid->lock) {
+        fprintf(stderr, "Failed to set up the thumbnail grid.\n");
+        free(grid->cache_path);
+        free(grid->thumbs);
+        if (grid->lock) SDL_DestroyMutex(grid->lock);
+        memset(grid, 0, sizeof(*grid));
+        return 0;
     }
-    int i = 0;
-    while ((ent = readdir(dir)) != NULL) {
-        if (ent->d_type == DT_DIR && strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
-            subfolders[i] = strdup(ent->d_name);
-            if (!subfolders[i]) {
-                for (int j = 0; j < i; ++j) free(subfolders[j]);
-                free(subfolders);
-                closedir(dir);
-                return NULL;
+    grid->count = file_count;
+    int missing = 0;
+    for (int i = 0; i < file_count; ++i) {
+        thumb* t = &grid->thumbs[i];
+        t->path = files[i];
+        const char* slash = strrchr(files[i], '/');
+        t->name = slash ? slash + 1 : files[i];
+        if (pack) {
+            // Straight from the index, no stat per member
+            t->name = files[i] + strlen(pack->path) + 1;
+            pack_member(files[i], &index);
+            zdzeg_pack_entry entry;
+            if (index < 0) {
+                t->state = THUMB_FAILED;
+                continue;
             }
-            i++;
+            zdzeg_pack_get(&pack->pack, index, &entry);
+            t->size = (long long)entry.size;
+            t->mtime_sec = (long long)pack->mtime.tv_sec;
+            t->mtime_nsec = pack->mtime.tv_nsec;
+            continue;
+        }
+        struct stat st;
+        if (stat(files[i], &st) != 0) {
+            t->state = THUMB_FAILED;
+            continue;
         }
+        t->size = (long long)st.st_size;
+        t->mtime_sec = (long long)st.st_mtim.tv_sec;
+        t->mtime_nsec = st.st_mtim.tv_nsec;
     }
-    closedir(dir);
+    thumb_cache_load(grid);
+    for (int i = 0; i < file_count; ++i) {
+        if (grid->thumbs[i].state == THUMB_MISSING) ++missing;
+    }
+    if (missing > 0) {
+        int threads = SDL_GetCPUCount();
+        if (threads > THUMB_THREADS_MAX) threads = THUMB_THREADS_MAX;
+        if (threads > missing) threads = missing;
+        if (threads < 1) threads = 1;
+        thumb_grid_start(grid, threads);
+    }
+    return 1;
+}
+
+// Makes the thumbnail of `path` again after the file changed, or marks it
+// failed if the file is gone.
+void thumb_grid_forget(thumb_grid* grid, const char* path) {
+    if (!grid->thumbs) return;
+    struct stat st;
+    int exists = stat(path, &st) == 0;
+    int missing = 0;
+    SDL_LockMutex(grid->lock);
+    for (int i = 0; i < grid->count; ++i) {
+        thumb* t = &grid->thumbs[i];
+        if (strcmp(t->path, path) != 0) continue;
+        if (t->texture) SDL_DestroyTexture(t->texture);
+        t->texture = NULL;
+        free(t->data);
+        t->data = NULL;
+        if (exists) {
+            t->size = (long long)st.st_size;
+            t->mtime_sec = (long long)st.st_mtim.tv_sec;
+            t->mtime_nsec = st.st_mtim.tv_nsec;
+        }
+        if (t->state == THUMB_WORKING) t->redo = 1;
+        else t->state = exists ? THUMB_MISSING : THUMB_FAILED;
+        grid->dirty = 1;
+        missing = exists;
+    }
+    int idle = grid->active == 0;
+    SDL_UnlockMutex(grid->lock);
+    if (missing && idle) thumb_grid_start(grid, 1);
+}
+
+// Stops the workers, saves new thumbnails and frees the grid.
+void thumb_grid_close(thumb_grid* grid) {
+    if (!grid->thumbs) return;
+    SDL_LockMutex(grid->lock);
+    grid->quit = 1;
+    SDL_UnlockMutex(grid->lock);
+    for (int i = 0; i < grid->thread_count; ++i) SDL_WaitThread(grid->threads[i], NULL);
+    if (grid->dirty) thumb_cache_save(grid);
+    for (int i = 0; i < grid->count; ++i) {
+        if (grid->thumbs[i].texture) SDL_DestroyTexture(grid->thumbs[i].texture);
+        free(grid->thumbs[i].data);
+    }
+    SDL_DestroyMutex(grid->lock);
+    free(grid->thumbs);
+    free(grid->cache_path);
+    memset(grid, 0, sizeof(*grid));
+}
+
+// Uploads a finished thumbnail. Called with the grid lock held.
+static SDL_Texture* thumb_texture(SDL_Renderer* renderer, const thumb* t) {
+    uLongf rgb_len = (uLongf)t->w * t->h * 3;
+    unsigned char* rgb = (unsigned char*)malloc(rgb_len);
+    if (!rgb) return NULL;
+    SDL_Texture* texture = NULL;
+    if (uncompress(rgb, &rgb_len, t->data, t->data_len) == Z_OK && rgb_len == (uLongf)t->w * t->h * 3) {
+        texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STATIC, t->w, t->h);
+        if (texture && SDL_UpdateTexture(texture, NULL, rgb, t->w * 3) != 0) {
+            SDL_DestroyTexture(texture);
+            texture = NULL;
+        }
+    }
+    free(rgb);
+    return texture;
+}
+
+// Draws the thumbnail grid, scrolled so `selected` is on screen, with the
+// selected file's name along the bottom. Textures of cells that scrolled
+// away are released.
+void draw_grid(SDL_Renderer* renderer, TTF_Font* font, thumb_grid* grid, int selected, int win_w, int win_h) {
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderClear(renderer);
+    int cell = THUMB_SIZE + THUMB_GAP;
+    int footer = font ? TTF_FontLineSkip(font) + THUMB_GAP : 0;
+    grid->columns = (win_w - THUMB_GAP) / cell > 0 ? (win_w - THUMB_GAP) / cell : 1;
+    grid->rows = (win_h - THUMB_GAP - footer) / cell > 0 ? (win_h - THUMB_GAP - footer) / cell : 1;
+    int selected_row = selected / grid->columns;
+    if (selected_row < grid->top_row) grid->top_row = selected_row;
+    if (selected_row >= grid->top_row + grid->rows) grid->top_row = selected_row - grid->rows + 1;
+    int first = grid->top_row * grid->columns;
+    int last = first + grid->rows * grid->columns;
+    if (last > grid->count) last = grid->count;
+    int left = (win_w - grid->columns * cell + THUMB_GAP) / 2;
+
+    SDL_LockMutex(grid->lock);
+    grid->next = first;
+    for (int i = 0; i < grid->count; ++i) {
+        thumb* t = &grid->thumbs[i];
+        if (i < first || i >= last) {
+            if (t->texture) SDL_DestroyTexture(t->texture);
+            t->texture = NULL;
+            continue;
+        }
+        int col = (i - first) % grid->columns, row = (i - first) / grid->columns;
+        SDL_Rect box = {left + col * cell, THUMB_GAP + row * cell, THUMB_SIZE, THUMB_SIZE};
+        if (t->state == THUMB_READY && !t->texture) t->texture = thumb_texture(renderer, t);
+        if (t->texture) {
+            SDL_Rect dest = {box.x + (THUMB_SIZE - t->w) / 2, box.y + (THUMB_SIZE - t->h) / 2, t->w, t->h};
+            SDL_RenderCopy(renderer, t->texture, NULL, &dest);
+        } else {
+            // Placeholder until the thumbnail is ready; red if it failed
+            if (t->state == THUMB_FAILED) SDL_SetRenderDrawColor(renderer, 128, 0, 0, 255);
+            else SDL_SetRenderDrawColor(renderer, 64, 64, 64, 255);
+            SDL_RenderDrawRect(renderer, &box);
+        }
+        if (i == selected) {
+            SDL_Rect frame = {box.x - 4, box.y - 4, THUMB_SIZE + 8, THUMB_SIZE + 8};
+            SDL_SetRenderDrawColor(renderer, 255, 255, 0, 255);
+            SDL_RenderDrawRect(renderer, &frame);
+        }
+    }
+    const char* name = selected >= 0 && selected < grid->count ? grid->thumbs[selected].name : NULL;
+    SDL_UnlockMutex(grid->lock);
+
+    if (font && name) {
+        SDL_Color yellow = {255, 255, 0, 255};
+        SDL_Surface* text_surface = TTF_RenderText_Solid(font, name, yellow);
+        if (text_surface) {
+            SDL_Texture* text_texture = SDL_CreateTextureFromSurface(renderer, text_surface);
+            SDL_Rect dest_rect = {left, win_h - footer + THUMB_GAP / 2, text_surface->w, text_surface->h};
+            SDL_RenderCopy(renderer, text_texture, NULL, &dest_rect);
+            SDL_DestroyTexture(text_texture);
+            SDL_FreeSurface(text_surface);
+        }
+    }
+    SDL_RenderPresent(renderer);
+}
+
+// Scans a folder for subdirectories and .zdzeg files in a single pass. The
+// sorted subfolder names are returned; when `files` isn't NULL it receives
+// the sorted .zdzeg paths too.
+char** get_folder_content(const char* folder, int* subfolder_count, char*** files, int* zdzeg_count) {
+    char** subfolders;
+    scan_folder(folder, &subfolders, subfolder_count, files, zdzeg_count);
     return subfolders;
 }
 
+// --- Folder watching ---
+// On Linux the open folder is watched with inotify, and files or subfolders
+// that appear or vanish are merged into the sorted lists in place instead of
+// rescanning the folder. Files are listed once they are closed after writing
+// or moved in, never while still being written. Elsewhere the lists only
+// change on navigation.
+typedef struct {
+    int fd; // inotify descriptor, -1 when not watching
+    int wd;
+} folder_watch;
+
+void folder_watch_stop(folder_watch* watch) {
+#ifdef __linux__
+    if (watch->fd >= 0) close(watch->fd);
+#endif
+    watch->fd = -1;
+    watch->wd = -1;
+}
+
+// Watches `folder` in place of whatever was watched before.
+void folder_watch_start(folder_watch* watch, const char* folder) {
+    folder_watch_stop(watch);
+#ifdef __linux__
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd < 0) return;
+    watch->wd = inotify_add_watch(watch->fd, folder, IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+    if (watch->wd < 0) folder_watch_stop(watch);
+#else
+    (void)folder;
+#endif
+}
+
+// Inserts a copy of `s` into the sorted list unless it is already there.
+// Returns the position it went in, or -1.
+static int sorted_insert(char*** list, int* count, const char* s) {
+    int lo = 0, hi = *count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int order = strcmp((*list)[mid], s);
+        if (order == 0) return -1;
+        if (order < 0) lo = mid + 1; else hi = mid;
+    }
+    char* copy = strdup(s);
+    char** grown = copy ? (char**)realloc(*list, (*count + 1) * sizeof(char*)) : NULL;
+    if (!grown) {
+        free(copy);
+        return -1;
+    }
+    *list = grown;
+    memmove(*list + lo + 1, *list + lo, (*count - lo) * sizeof(char*));
+    (*list)[lo] = copy;
+    ++*count;
+    return lo;
+}
+
+// Removes `s` from the sorted list. Returns the position it had, or -1.
+static int sorted_remove(char** list, int* count, const char* s) {
+    char** found = list ? (char**)bsearch(&s, list, *count, sizeof(char*), compare_names) : NULL;
+    if (!found) return -1;
+    int at = (int)(found - list);
+    free(list[at]);
+    memmove(list + at, list + at + 1, (*count - at - 1) * sizeof(char*));
+    --*count;
+    return at;
+}
+
+// Moves *idx so it keeps pointing at the same entry after an insert or
+// removal at `at`, or at its successor if that entry was removed.
+static void follow_change(int* idx, int count, int at, int inserted) {
+    if (at < 0 || !idx) return;
+    if (inserted) {
+        if (at <= *idx && count > 1) ++*idx;
+    } else if (at < *idx) {
+        --*idx;
+    }
+    if (*idx >= count) *idx = count > 0 ? count - 1 : 0;
+}
+
+// Applies the changes reported for the watched `folder` to the sorted lists
+// that aren't NULL: `files` holds full .zdzeg paths and `subfolders` names.
+// *file_idx and *subfolder_idx follow their entries. `forget` is called with
+// the path of every .zdzeg file that was rewritten, replaced or removed, so
+// stale decodes can be dropped. Returns 1 if a list changed, 0 if not and -1
+// if events were lost, or a list to update was NULL, and the folder needs a
+// rescan.
+int folder_watch_update(folder_watch* watch, const char* folder, char*** files, int* file_count, int* file_idx,
+                        char*** subfolders, int* subfolder_count, int* subfolder_idx,
+                        void (*forget)(const char* path, void* ctx), void* ctx) {
+#ifdef __linux__
+    if (watch->fd < 0) return 0;
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
+    int changed = 0;
+    ssize_t len;
+    while ((len = read(watch->fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            const struct inotify_event* ev = (const struct inotify_event*)p;
+            if (ev->mask & IN_Q_OVERFLOW) changed = -1;
+            if (ev->len == 0) continue;
+            int is_dir = (ev->mask & IN_ISDIR) != 0;
+            // A new file's IN_CREATE comes before any of its contents
+            int added = (ev->mask & (is_dir ? IN_CREATE | IN_MOVED_TO : IN_CLOSE_WRITE | IN_MOVED_TO)) != 0;
+            int removed = (ev->mask & (IN_DELETE | IN_MOVED_FROM)) != 0;
+            if (!added && !removed) continue;
+            if (!is_dir && forget && has_zdzeg_suffix(ev->name)) {
+                snprintf(path, sizeof(path), "%s/%s", folder, ev->name);
+                forget(path, ctx);
+            }
+            if (changed < 0) continue;
+            if (!files && !subfolders && (is_dir || has_pack_suffix(ev->name) || has_zdzeg_suffix(ev->name))) {
+                changed = -1;
+                continue;
+            }
+            int at = -1;
+            if (is_dir || has_pack_suffix(ev->name)) {
+                if (!subfolders) continue;
+                at = added ? sorted_insert(subfolders, subfolder_count, ev->name)
+                           : sorted_remove(*subfolders, subfolder_count, ev->name);
+                follow_change(subfolder_idx, *subfolder_count, at, added);
+            } else {
+                if (!files || !has_zdzeg_suffix(ev->name)) continue;
+                snprintf(path, sizeof(path), "%s/%s", folder, ev->name);
+                at = added ? sorted_insert(files, file_count, path) : sorted_remove(*files, file_count, path);
+                follow_change(file_idx, *file_count, at, added);
+            }
+            if (at >= 0) changed = 1;
+        }
+    }
+    return changed;
+#else
+    (void)watch; (void)folder; (void)files; (void)file_count; (void)file_idx;
+    (void)subfolders; (void)subfolder_count; (void)subfolder_idx; (void)forget; (void)ctx;
+    return 0;
+#endif
+}
+
+// The decoded copies folder_watch_update drops changed files from.
+typedef struct {
+    image_cache* cache;
+    thumb_grid* grid;
+} watch_caches;
+
+static void forget_changed_file(const char* path, void* ctx) {
+    watch_caches* caches = (watch_caches*)ctx;
+    image_cache_forget(caches->cache, path);
+    thumb_grid_forget(caches->grid, path);
+}
+
 // Draws the folder selection menu
 void draw_menu(SDL_Renderer* renderer, TTF_Font* font, char** folders, int folder_count, int selected_idx) {
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
@@ -382,10 +1387,35 @@ TTF_Font* find_and_open_font(int pt_size) {
 }
 
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s /path/to/folder_or_file.zdzeg\n", argv[0]);
+    long cache_mb = DEFAULT_CACHE_MB;
+    int prefetch = DEFAULT_PREFETCH;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:p:")) != -1) {
+        switch (opt) {
+            case 'c':
+                cache_mb = atol(optarg);
+                if (cache_mb < 0) {
+                    fprintf(stderr, "Cache size must be 0 or more MiB.\n");
+                    return 1;
+                }
+                break;
+            case 'p':
+                prefetch = atoi(optarg);
+                if (prefetch < 0) {
+                    fprintf(stderr, "Prefetch count must be 0 or more.\n");
+                    return 1;
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c cache_mb] [-p prefetch] /path/to/folder_or_file.zdzeg_or_archive.zdzpack\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-c cache_mb] [-p prefetch] /path/to/folder_or_file.zdzeg_or_archive.zdzpack\n", argv[0]);
         return 1;
     }
+    const char* start_path = argv[optind];
     if (SDL_Init(SDL_INIT_VIDEO) < 0 || TTF_Init() < 0) {
         fprintf(stderr, "SDL/TTF could not initialize! SDL Error: %s\n", SDL_GetError());
         return 1;
@@ -396,7 +1426,9 @@ int main(int argc, char* argv[]) {
         SDL_Quit();
         return 1;
     }
-    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    // Frames are only presented after a change or while panning, so vsync
+    // just paces the continuous redraw of a held pan key.
+    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
     if (!renderer) {
         fprintf(stderr, "Renderer could not be created! SDL Error: %s\n", SDL_GetError());
         SDL_DestroyWindow(window);
@@ -422,45 +1454,82 @@ int main(int argc, char* argv[]) {
     char** files = NULL;
     int current_idx = 0;
     int img_w = 0, img_h = 0;
-    SDL_Surface* pil_image = NULL;
+    SDL_Texture* image_texture = NULL;
+    int rotation = 0; // quarter turns clockwise applied to the current image
+    int tex_level = 0; // pyramid level of the texture; img_w and img_h stay the full size
+    thumb_grid grid;
+    memset(&grid, 0, sizeof(grid));
+    int in_grid = 0;
+    int grid_from_menu = 0; // leaving the grid returns to the menu rather than the image
+    int grid_selection = 0;
+    Uint32 thumb_event = SDL_RegisterEvents(1);
+    folder_watch watch = {-1, -1};
+    int rescan_after_grid = 0;
+    image_cache cache;
+    if (!image_cache_init(&cache, (size_t)cache_mb * 1024 * 1024)) {
+        image_cache_destroy(&cache);
+        TTF_CloseFont(font);
+        TTF_Quit();
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+        return 1;
+    }
 
     struct stat path_stat;
-    if (stat(argv[1], &path_stat) != 0) {
-        fprintf(stderr, "Error accessing path: %s\n", argv[1]);
+    if (stat(start_path, &path_stat) != 0) {
+        fprintf(stderr, "Error accessing path: %s\n", start_path);
         return 1;
     }
 
     if (S_ISDIR(path_stat.st_mode)) {
-        current_path = strdup(argv[1]);
+        current_path = strdup(start_path);
         if (!current_path) {
             fprintf(stderr, "Path allocation failed.\n");
             return 1;
         }
-        subfolders = get_folder_content(current_path, &subfolder_count, &file_count);
+        subfolders = get_folder_content(current_path, &subfolder_count, NULL, &file_count);
+        folder_watch_start(&watch, current_path);
         if (subfolder_count > 0 || file_count > 0) {
             in_menu = 1;
         } else {
             fprintf(stderr, "The specified directory is empty.\n");
             return 1;
         }
+    } else if (S_ISREG(path_stat.st_mode) && has_pack_suffix(start_path)) {
+        // An archive opens on its first image, like a folder entered from the menu
+        current_path = strdup(start_path);
+        if (current_path) files = get_zdzeg_files(current_path, &file_count);
+        if (!files || file_count == 0) {
+            fprintf(stderr, "No images found in the archive: %s\n", start_path);
+            return 1;
+        }
+        image_texture = load_zdzeg_texture(renderer, files[0], &img_w, &img_h);
+        if (!image_texture) {
+            fprintf(stderr, "Failed to load the first image of %s\n", start_path);
+            return 1;
+        }
+        image_cache_prefetch(&cache, files, file_count, current_idx, prefetch);
     } else if (S_ISREG(path_stat.st_mode)) {
         in_menu = 0;
-        pil_image = load_zdzeg(argv[1], &img_w, &img_h);
-        if (!pil_image) {
-            fprintf(stderr, "Failed to load the specified file: %s\n", argv[1]);
+        image_texture = load_zdzeg_texture(renderer, start_path, &img_w, &img_h);
+        if (!image_texture) {
+            fprintf(stderr, "Failed to load the specified file: %s\n", start_path);
             return 1;
         }
-        char* parent_path_temp = strdup(argv[1]);
+        char* parent_path_temp = strdup(start_path);
         current_path = strdup(dirname(parent_path_temp));
         free(parent_path_temp);
         files = get_zdzeg_files(current_path, &file_count);
+        folder_watch_start(&watch, current_path);
         if (files) {
             for (int i = 0; i < file_count; ++i) {
-                if (strcmp(files[i], argv[1]) == 0) {
+                if (strcmp(files[i], start_path) == 0) {
                     current_idx = i;
                     break;
                 }
             }
+            image_cache_prefetch(&cache, files, file_count, current_idx, prefetch);
         }
     } else {
         fprintf(stderr, "Path is not a valid directory or file.\n");
@@ -474,51 +1543,141 @@ int main(int argc, char* argv[]) {
     int scroll_x = 0;
     int scroll_y = 0;
     float scroll_speed = 10.0f;
+    int needs_redraw = 1;
+    Uint32 last_pan_tick = 0;
     while (running) {
         SDL_Event event;
+        // Sleep until something happens unless a frame is due
+        int panning = !in_menu && !in_grid && !fit_screen && pan_key_held();
+        if (!needs_redraw && !panning) {
+            SDL_WaitEventTimeout(NULL, IDLE_WAIT_MS);
+        }
         while (SDL_PollEvent(&event)) {
             if (event.type == SDL_QUIT) {
                 running = 0;
+            } else if (event.type == SDL_WINDOWEVENT) {
+                needs_redraw = 1;
+            } else if (event.type == thumb_event && thumb_event != (Uint32)-1) {
+                if (in_grid) needs_redraw = 1;
             } else if (event.type == SDL_KEYDOWN) {
-                if (in_menu) {
+                needs_redraw = 1;
+                if (in_grid) {
+                    int step = 0;
+                    switch (event.key.keysym.sym) {
+                        case SDLK_LEFT: step = -1; break;
+                        case SDLK_RIGHT: step = 1; break;
+                        case SDLK_UP: step = -grid.columns; break;
+                        case SDLK_DOWN: step = grid.columns; break;
+                        case SDLK_PAGEUP: step = -grid.columns * grid.rows; break;
+                        case SDLK_PAGEDOWN: step = grid.columns * grid.rows; break;
+                        case SDLK_HOME: grid_selection = 0; break;
+                        case SDLK_END: grid_selection = file_count - 1; break;
+                        case SDLK_f:
+                            fullscreen = !fullscreen;
+                            SDL_SetWindowFullscreen(window, fullscreen ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0);
+                            break;
+                        case SDLK_RETURN:
+                        case SDLK_KP_ENTER: {
+                            int win_w, win_h;
+                            SDL_GetWindowSize(window, &win_w, &win_h);
+                            SDL_Texture* next_texture = view_texture(&cache, renderer, files[grid_selection], fit_screen ? win_w : 0,
+                                                                     win_h, &img_w, &img_h, &tex_level);
+                            if (!next_texture) {
+                                fprintf(stderr, "Failed to load the selected image.\n");
+                                break;
+                            }
+                            if (image_texture) SDL_DestroyTexture(image_texture);
+                            image_texture = next_texture;
+                            current_idx = grid_selection;
+                            image_cache_prefetch(&cache, files, file_count, current_idx, prefetch);
+                            rotation = 0;
+                            zoom = 1.0f;
+                            scroll_x = 0;
+                            scroll_y = 0;
+                            thumb_grid_close(&grid);
+                            in_grid = 0;
+                            break;
+                        }
+                        case SDLK_g:
+                        case SDLK_ESCAPE:
+                        case SDLK_x:
+                            thumb_grid_close(&grid);
+                            in_grid = 0;
+                            if (grid_from_menu) {
+                                free_file_list(files, file_count);
+                                files = NULL;
+                                subfolders = get_folder_content(current_path, &subfolder_count, NULL, &file_count);
+                                in_menu = 1;
+                                menu_selection_idx = 0;
+                            }
+                            break;
+                    }
+                    if (step != 0) {
+                        grid_selection += step;
+                        if (grid_selection < 0) grid_selection = 0;
+                        if (grid_selection >= file_count) grid_selection = file_count - 1;
+                    }
+                } else if (in_menu) {
                     switch (event.key.keysym.sym) {
                         case SDLK_UP:
-                            menu_selection_idx = (menu_selection_idx - 1 + subfolder_count) % subfolder_count;
+                            if (subfolder_count > 0) menu_selection_idx = (menu_selection_idx - 1 + subfolder_count) % subfolder_count;
                             break;
                         case SDLK_DOWN:
-                            menu_selection_idx = (menu_selection_idx + 1) % subfolder_count;
+                            if (subfolder_count > 0) menu_selection_idx = (menu_selection_idx + 1) % subfolder_count;
                             break;
                         case SDLK_RETURN:
                         case SDLK_KP_ENTER: {
+                            if (subfolder_count == 0) break;
                             char* new_path_temp = (char*)malloc(strlen(current_path) + strlen(subfolders[menu_selection_idx]) + 2);
                             if (new_path_temp) {
                                 sprintf(new_path_temp, "%s/%s", current_path, subfolders[menu_selection_idx]);
                                 free(current_path);
                                 current_path = new_path_temp;
                                 free_file_list(subfolders, subfolder_count);
-                                subfolders = NULL;
-                                files = get_zdzeg_files(current_path, &file_count);
+                                // One scan tells both whether there are images and what the subfolders are
+                                subfolders = get_folder_content(current_path, &subfolder_count, &files, &file_count);
+                                folder_watch_start(&watch, current_path);
                                 if (file_count > 0) {
+                                    free_file_list(subfolders, subfolder_count);
+                                    subfolders = NULL;
+                                    subfolder_count = 0;
                                     in_menu = 0;
                                     current_idx = 0;
-                                    if (pil_image) SDL_FreeSurface(pil_image);
-                                    pil_image = load_zdzeg(files[current_idx], &img_w, &img_h);
+                                    if (image_texture) SDL_DestroyTexture(image_texture);
+                                    int win_w, win_h;
+                                    SDL_GetWindowSize(window, &win_w, &win_h);
+                                    image_texture = view_texture(&cache, renderer, files[current_idx], fit_screen ? win_w : 0, win_h,
+                                                                 &img_w, &img_h, &tex_level);
+                                    image_cache_prefetch(&cache, files, file_count, current_idx, prefetch);
+                                    rotation = 0;
                                     zoom = 1.0f;
                                     scroll_x = 0;
                                     scroll_y = 0;
                                 } else {
-                                    subfolders = get_folder_content(current_path, &subfolder_count, &file_count);
                                     if (subfolder_count == 0) {
                                         fprintf(stderr, "No images or subfolders found in the selected folder.\n");
-                                        in_menu = 1;
-                                    } else {
-                                        in_menu = 1;
-                                        menu_selection_idx = 0;
                                     }
+                                    menu_selection_idx = 0;
                                 }
                             }
                             break;
                         }
+                        case SDLK_g:
+                            // Thumbnails of this folder's own images
+                            files = get_zdzeg_files(current_path, &file_count);
+                            if (file_count > 0 && thumb_grid_open(&grid, current_path, files, file_count, thumb_event)) {
+                                free_file_list(subfolders, subfolder_count);
+                                subfolders = NULL;
+                                subfolder_count = 0;
+                                in_menu = 0;
+                                in_grid = 1;
+                                grid_from_menu = 1;
+                                grid_selection = 0;
+                            } else {
+                                free_file_list(files, file_count);
+                                files = NULL;
+                            }
+                            break;
                         case SDLK_x: {
                             char* parent_path = strdup(current_path);
                             char* dir = dirname(parent_path);
@@ -526,7 +1685,8 @@ int main(int argc, char* argv[]) {
                                 free(current_path);
                                 current_path = strdup(dir);
                                 free_file_list(subfolders, subfolder_count);
-                                subfolders = get_folder_content(current_path, &subfolder_count, &file_count);
+                                subfolders = get_folder_content(current_path, &subfolder_count, NULL, &file_count);
+                                folder_watch_start(&watch, current_path);
                                 menu_selection_idx = 0;
                             }
                             free(parent_path);
@@ -536,14 +1696,22 @@ int main(int argc, char* argv[]) {
                 } else {
                     switch (event.key.keysym.sym) {
                         case SDLK_RIGHT: {
+                            if (file_count == 0) break;
                             int prev_idx = current_idx;
                             current_idx = (current_idx + 1) % file_count;
-                            if (pil_image) SDL_FreeSurface(pil_image);
-                            pil_image = load_zdzeg(files[current_idx], &img_w, &img_h);
-                            if (!pil_image) {
+                            // The current texture stays until the new one is ready
+                            int win_w, win_h;
+                            SDL_GetWindowSize(window, &win_w, &win_h);
+                            SDL_Texture* next_texture = view_texture(&cache, renderer, files[current_idx], fit_screen ? win_w : 0,
+                                                                     win_h, &img_w, &img_h, &tex_level);
+                            if (next_texture) {
+                                if (image_texture) SDL_DestroyTexture(image_texture);
+                                image_texture = next_texture;
+                                rotation = 0;
+                                image_cache_prefetch(&cache, files, file_count, current_idx, prefetch);
+                            } else {
                                 fprintf(stderr, "Failed to load next image, staying on current one.\n");
                                 current_idx = prev_idx;
-                                pil_image = load_zdzeg(files[current_idx], &img_w, &img_h);
                             }
                             zoom = 1.0f;
                             scroll_x = 0;
@@ -551,36 +1719,35 @@ int main(int argc, char* argv[]) {
                             break;
                         }
                         case SDLK_LEFT: {
+                            if (file_count == 0) break;
                             int prev_idx = current_idx;
                             current_idx = (current_idx - 1 + file_count) % file_count;
-                            if (pil_image) SDL_FreeSurface(pil_image);
-                            pil_image = load_zdzeg(files[current_idx], &img_w, &img_h);
-                            if (!pil_image) {
+                            // The current texture stays until the new one is ready
+                            int win_w, win_h;
+                            SDL_GetWindowSize(window, &win_w, &win_h);
+                            SDL_Texture* next_texture = view_texture(&cache, renderer, files[current_idx], fit_screen ? win_w : 0,
+                                                                     win_h, &img_w, &img_h, &tex_level);
+                            if (next_texture) {
+                                if (image_texture) SDL_DestroyTexture(image_texture);
+                                image_texture = next_texture;
+                                rotation = 0;
+                                image_cache_prefetch(&cache, files, file_count, current_idx, prefetch);
+                            } else {
                                 fprintf(stderr, "Failed to load previous image, staying on current one.\n");
                                 current_idx = prev_idx;
-                                pil_image = load_zdzeg(files[current_idx], &img_w, &img_h);
                             }
                             zoom = 1.0f;
                             scroll_x = 0;
                             scroll_y = 0;
                             break;
                         }
-                        case SDLK_r: {
-                            SDL_Surface* new_pil_image = rotate_surface_90_degrees(pil_image);
-                            if (new_pil_image) {
-                                SDL_FreeSurface(pil_image);
-                                pil_image = new_pil_image;
-                                int temp_w = img_w;
-                                img_w = img_h;
-                                img_h = temp_w;
-                                zoom = 1.0f;
-                                scroll_x = 0;
-                                scroll_y = 0;
-                            } else {
-                                fprintf(stderr, "Failed to rotate image.\n");
-                            }
+                        case SDLK_r:
+                            // Turned when drawn; the texture itself is left alone
+                            rotation = (rotation + 1) % 4;
+                            zoom = 1.0f;
+                            scroll_x = 0;
+                            scroll_y = 0;
                             break;
-                        }
                         case SDLK_f:
                             fullscreen = !fullscreen;
                             SDL_SetWindowFullscreen(window, fullscreen ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0);
@@ -591,6 +1758,13 @@ int main(int argc, char* argv[]) {
                                 SDL_SetWindowFullscreen(window, 0);
                             }
                             break;
+                        case SDLK_g:
+                            if (files && file_count > 0 && thumb_grid_open(&grid, current_path, files, file_count, thumb_event)) {
+                                in_grid = 1;
+                                grid_from_menu = 0;
+                                grid_selection = current_idx;
+                            }
+                            break;
                         case SDLK_h:
                             fit_screen = !fit_screen;
                             zoom = 1.0f;
@@ -604,14 +1778,17 @@ int main(int argc, char* argv[]) {
                             if (!fit_screen) zoom /= 1.1f;
                             break;
                         case SDLK_x: {
-                            if (pil_image) SDL_FreeSurface(pil_image);
+                            if (image_texture) SDL_DestroyTexture(image_texture);
+                            image_texture = NULL;
+                            image_cache_prefetch(&cache, NULL, 0, 0, 0);
                             free_file_list(files, file_count);
                             files = NULL;
                             char* parent_path = strdup(current_path);
                             free(current_path);
                             current_path = strdup(dirname(parent_path));
                             free(parent_path);
-                            subfolders = get_folder_content(current_path, &subfolder_count, &file_count);
+                            subfolders = get_folder_content(current_path, &subfolder_count, NULL, &file_count);
+                            folder_watch_start(&watch, current_path);
                             in_menu = 1;
                             menu_selection_idx = 0;
                             break;
@@ -620,24 +1797,73 @@ int main(int argc, char* argv[]) {
                 }
             }
         }
+        {
+            // Merge in files and folders that appeared or vanished. The grid
+            // holds on to the file list, so its changes wait until it closes.
+            watch_caches caches = {&cache, &grid};
+            int changed = folder_watch_update(&watch, current_path, in_menu || in_grid ? NULL : &files, &file_count,
+                                              &current_idx, in_menu && !in_grid ? &subfolders : NULL, &subfolder_count,
+                                              &menu_selection_idx, forget_changed_file, &caches);
+            if (in_grid) {
+                if (changed < 0) rescan_after_grid = 1;
+                if (changed != 0) needs_redraw = 1;
+                changed = 0;
+            } else if (rescan_after_grid) {
+                rescan_after_grid = 0;
+                changed = -1;
+            }
+            if (changed < 0 && in_menu) {
+                free_file_list(subfolders, subfolder_count);
+                subfolders = get_folder_content(current_path, &subfolder_count, NULL, &file_count);
+                menu_selection_idx = 0;
+            } else if (changed < 0) {
+                char* shown = (files && file_count > 0) ? strdup(files[current_idx]) : NULL;
+                free_file_list(files, file_count);
+                files = get_zdzeg_files(current_path, &file_count);
+                current_idx = 0;
+                for (int i = 0; shown && i < file_count; ++i) {
+                    if (strcmp(files[i], shown) == 0) current_idx = i;
+                }
+                free(shown);
+            }
+            if (changed != 0) {
+                needs_redraw = 1;
+                if (!in_menu) image_cache_prefetch(&cache, files, file_count, current_idx, prefetch);
+            }
+        }
+        panning = !in_menu && !in_grid && !fit_screen && pan_key_held();
+        if (!panning) last_pan_tick = 0;
+        if (!needs_redraw && !panning) continue;
+        needs_redraw = 0;
         SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
         SDL_RenderClear(renderer);
         if (in_menu) {
             draw_menu(renderer, font, subfolders, subfolder_count, menu_selection_idx);
+        } else if (in_grid) {
+            int win_w, win_h;
+            SDL_GetWindowSize(window, &win_w, &win_h);
+            draw_grid(renderer, font, &grid, grid_selection, win_w, win_h);
         } else {
-            const Uint8* state = SDL_GetKeyboardState(NULL);
-            if (!fit_screen) {
-                if (state[SDL_SCANCODE_W]) scroll_y -= scroll_speed;
-                if (state[SDL_SCANCODE_S]) scroll_y += scroll_speed;
-                if (state[SDL_SCANCODE_A]) scroll_x -= scroll_speed;
-                if (state[SDL_SCANCODE_D]) scroll_x += scroll_speed;
+            if (panning) {
+                // Move by elapsed time so the speed doesn't depend on the refresh rate
+                Uint32 now = SDL_GetTicks();
+                float step = last_pan_tick ? scroll_speed * (now - last_pan_tick) / PAN_FRAME_MS : scroll_speed;
+                last_pan_tick = now;
+                const Uint8* state = SDL_GetKeyboardState(NULL);
+                if (state[SDL_SCANCODE_W]) scroll_y -= step;
+                if (state[SDL_SCANCODE_S]) scroll_y += step;
+                if (state[SDL_SCANCODE_A]) scroll_x -= step;
+                if (state[SDL_SCANCODE_D]) scroll_x += step;
             }
             int win_w, win_h;
             SDL_GetWindowSize(window, &win_w, &win_h);
             SDL_Rect dest_rect;
+            // dest_rect is the unrotated texture's place; SDL turns it about its centre
+            int shown_w = rotation % 2 ? img_h : img_w;
+            int shown_h = rotation % 2 ? img_w : img_h;
             if (fit_screen) {
-                float ratio_w = (float)win_w / img_w;
-                float ratio_h = (float)win_h / img_h;
+                float ratio_w = (float)win_w / shown_w;
+                float ratio_h = (float)win_h / shown_h;
                 float ratio = ratio_w < ratio_h ? ratio_w : ratio_h;
                 dest_rect.w = (int)(img_w * ratio);
                 dest_rect.h = (int)(img_h * ratio);
@@ -649,19 +1875,32 @@ int main(int argc, char* argv[]) {
                 dest_rect.x = (win_w - dest_rect.w) / 2 - scroll_x;
                 dest_rect.y = (win_h - dest_rect.h) / 2 - scroll_y;
             }
-            if (pil_image) {
-                SDL_Texture* texture = SDL_CreateTextureFromSurface(renderer, pil_image);
-                if (texture) {
-                    SDL_RenderCopy(renderer, texture, NULL, &dest_rect);
-                    SDL_DestroyTexture(texture);
+            if (image_texture && tex_level > 0 &&
+                (dest_rect.w > zdzeg_level_size(img_w, tex_level) || dest_rect.h > zdzeg_level_size(img_h, tex_level))) {
+                // Zoomed in past the pyramid level on screen: fetch a finer one
+                const char* current_file = (files && file_count > 0) ? files[current_idx] : start_path;
+                int new_w, new_h, new_level;
+                SDL_Texture* finer = load_zdzeg_texture_fit(renderer, current_file, dest_rect.w, dest_rect.h, &new_w, &new_h, &new_level);
+                if (finer) {
+                    SDL_DestroyTexture(image_texture);
+                    image_texture = finer;
+                    tex_level = new_level;
                 } else {
-                    fprintf(stderr, "Texture could not be created! SDL Error: %s\n", SDL_GetError());
+                    // Keep the coarse texture rather than retrying every frame
+                    tex_level = 0;
                 }
             }
+            if (image_texture) {
+                SDL_RenderCopyEx(renderer, image_texture, NULL, &dest_rect, 90.0 * rotation, NULL, SDL_FLIP_NONE);
+            }
             SDL_RenderPresent(renderer);
         }
     }
-    if (pil_image) SDL_FreeSurface(pil_image);
+    thumb_grid_close(&grid);
+    folder_watch_stop(&watch);
+    if (image_texture) SDL_DestroyTexture(image_texture);
+    image_cache_destroy(&cache);
+    pack_close_all();
     free_file_list(files, file_count);
     free_file_list(subfolders, subfolder_count);
     free(current_path);
@@ -0,0 +1,2106 @@
+// libzdzeg: the .zdzeg codec shared by the encoder, the viewer and the tools.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef ZDZEG_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef ZDZEG_WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "zdzeg.h"
+
+const char* zdzeg_strerror(int err) {
+    switch (err) {
+        case ZDZEG_OK: return "success";
+        case ZDZEG_ERR_PARAM: return "invalid parameters";
+        case ZDZEG_ERR_NOMEM: return "out of memory";
+        case ZDZEG_ERR_IO: return "could not read or write the file";
+        case ZDZEG_ERR_SPACE: return "output buffer too small";
+        case ZDZEG_ERR_CORRUPT: return "unsupported or corrupt file";
+        case ZDZEG_ERR_COMPRESS: return "compression failed";
+        case ZDZEG_ERR_CODEC: return "compression codec not supported by this build";
+        default: return "unknown error";
+    }
+}
+
+static const char* const codec_names[ZDZEG_CODEC_COUNT] = {"zlib", "zstd", "lz4"};
+
+const char* zdzeg_codec_name(int codec) {
+    return codec >= 0 && codec < ZDZEG_CODEC_COUNT ? codec_names[codec] : "unknown";
+}
+
+
+int zdzeg_codec_available(int codec) {
+    switch (codec) {
+        case ZDZEG_CODEC_ZLIB: return 1;
+#ifdef ZDZEG_WITH_ZSTD
+        case ZDZEG_CODEC_ZSTD: return 1;
+#endif
+#ifdef ZDZEG_WITH_LZ4
+        case ZDZEG_CODEC_LZ4: return 1;
+#endif
+        default: return 0;
+    }
+}
+
+int zdzeg_codec_parse(const char* spec, int* codec, int* level) {
+    const char* colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+    for (int i = 0; i < ZDZEG_CODEC_COUNT; ++i) {
+        if (strlen(codec_names[i]) == len && strncmp(spec, codec_names[i], len) == 0) {
+            *codec = i;
+            *level = colon ? atoi(colon + 1) : 0;
+            return zdzeg_codec_available(i) ? ZDZEG_OK : ZDZEG_ERR_CODEC;
+        }
+    }
+    return ZDZEG_ERR_PARAM;
+}
+
+// Grows *buf to at least `needed` bytes, keeping its contents.
+// Returns 0 on success, 1 if the allocation failed (the old buffer stays valid).
+static int ensure_capacity(unsigned char** buf, size_t* cap, size_t needed) {
+    if (*cap >= needed) return 0;
+    size_t new_cap = *cap ? *cap : 4096;
+    while (new_cap < needed) new_cap *= 2;
+    unsigned char* temp = (unsigned char*)realloc(*buf, new_cap);
+    if (!temp) return 1;
+    *buf = temp;
+    *cap = new_cap;
+    return 0;
+}
+
+// --- Quantization kernels ---
+// Every kernel computes q = (v * levels) / 256 per sample, bit for bit like the
+// scalar code; since v * levels fits in 16 bits this is a 16-bit multiply and a
+// shift by 8. The grayscale average (r + g + b) / 3 is done in fixed point as
+// (sum * 0xAAAB) >> 17, which is exact for every sum up to 765.
+// channel_idx: 0-2 extract red/green/blue, 3 keeps all three, 4 is grayscale.
+typedef void (*quantize_fn)(const unsigned char* src, int w, int levels, int channel_idx, unsigned char* dst);
+
+typedef struct {
+    const char* name;
+    quantize_fn full;
+    quantize_fn single;
+    quantize_fn bw;
+} quantize_kernels;
+
+// Quantizes `n` samples; used directly for "full" and for the SIMD tails.
+static void quantize_samples_scalar(const unsigned char* src, int n, int levels, unsigned char* dst) {
+    for (int x = 0; x < n; ++x) {
+        dst[x] = (unsigned char)(((int)src[x] * levels) / 256);
+    }
+}
+
+static void quantize_full_scalar(const unsigned char* src, int w, int levels, int channel_idx, unsigned char* dst) {
+    (void)channel_idx;
+    quantize_samples_scalar(src, w * 3, levels, dst);
+}
+
+static void quantize_single_scalar(const unsigned char* src, int w, int levels, int channel_idx, unsigned char* dst) {
+    for (int x = 0; x < w; ++x) {
+        dst[x] = (unsigned char)(((int)src[x * 3 + channel_idx] * levels) / 256);
+    }
+}
+
+static void quantize_bw_scalar(const unsigned char* src, int w, int levels, int channel_idx, unsigned char* dst) {
+    (void)channel_idx;
+    for (int x = 0; x < w; ++x) {
+        const unsigned char* p = src + x * 3;
+        // Convert to grayscale using a simple average
+        unsigned char avg = (p[0] + p[1] + p[2]) / 3;
+        dst[x] = (unsigned char)(((int)avg * levels) / 256);
+    }
+}
+
+static const quantize_kernels scalar_kernels = {"scalar", quantize_full_scalar, quantize_single_scalar, quantize_bw_scalar};
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define ZDZEG_X86_KERNELS 1
+
+// pshufb masks that gather byte `channel` of 16 consecutive RGB24 pixels out
+// of the three 16-byte blocks that hold them (0x80 selects zero).
+static void rgb_gather_masks(int channel, unsigned char masks[3][16]) {
+    for (int j = 0; j < 16; ++j) {
+        int pos = j * 3 + channel;
+        for (int block = 0; block < 3; ++block) {
+            masks[block][j] = (pos >= block * 16 && pos < block * 16 + 16) ? (unsigned char)(pos - block * 16) : 0x80;
+        }
+    }
+}
+
+__attribute__((target("sse2")))
+static inline __m128i quantize_16_sse2(__m128i v, __m128i lv) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), lv), 8);
+    __m128i hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), lv), 8);
+    return _mm_packus_epi16(lo, hi);
+}
+
+__attribute__((target("sse2")))
+static void quantize_full_sse2(const unsigned char* src, int w, int levels, int channel_idx, unsigned char* dst) {
+    (void)channel_idx;
+    __m128i lv = _mm_set1_epi16((short)levels);
+    int n = w * 3;
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        _mm_storeu_si128((__m128i*)(dst + x), quantize_16_sse2(_mm_loadu_si128((const __m128i*)(src + x)), lv));
+    }
+    quantize_samples_scalar(src + x, n - x, levels, dst + x);
+}
+
+__attribute__((target("ssse3")))
+static void quantize_single_ssse3(const unsigned char* src, int w, int levels, int channel_idx, unsigned char* dst) {
+    unsigned char m[3][16];
+    rgb_gather_masks(channel_idx, m);
+    __m128i m0 = _mm_loadu_si128((const __m128i*)m[0]);
+    __m128i m1 = _mm_loadu_si128((const __m128i*)m[1]);
+    __m128i m2 = _mm_loadu_si128((const __m128i*)m[2]);
+    __m128i lv = _mm_set1_epi16((short)levels);
+    int x = 0;
+    for (; x + 16 <= w; x += 16) {
+        const unsigned char* p = src + x * 3;
+        __m128i v = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)p), m0),
+                                              _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 16)), m1)),
+                                 _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 32)), m2));
+        _mm_storeu_si128((__m128i*)(dst + x), quantize_16_sse2(v, lv));
+    }
+    quantize_single_scalar(src + x * 3, w - x, levels, channel_idx, dst + x);
+}
+
+__attribute__((target("ssse3")))
+static void quantize_bw_ssse3(const unsigned char* src, int w, int levels, int channel_idx, unsigned char* dst) {
+    unsigned char m[3][3][16];
+    __m128i masks[3][3];
+    for (int c = 0; c < 3; ++c) {
+        rgb_gather_masks(c, m[c]);
+        for (int block = 0; block < 3; ++block) masks[c][block] = _mm_loadu_si128((const __m128i*)m[c][block]);
+    }
+    __m128i zero = _mm_setzero_si128();
+    __m128i third = _mm_set1_epi16((short)0xAAAB);
+    __m128i lv = _mm_set1_epi16((short)levels);
+    int x = 0;
+    for (; x + 16 <= w; x += 16) {
+        const unsigned char* p = src + x * 3;
+        __m128i a = _mm_loadu_si128((const __m128i*)p);
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(p + 32));
+        __m128i sum_lo = zero, sum_hi = zero;
+        for (int ch = 0; ch < 3; ++ch) {
+            __m128i v = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, masks[ch][0]), _mm_shuffle_epi8(b, masks[ch][1])),
+                                     _mm_shuffle_epi8(c, masks[ch][2]));
+            sum_lo = _mm_add_epi16(sum_lo, _mm_unpacklo_epi8(v, zero));
+            sum_hi = _mm_add_epi16(sum_hi, _mm_unpackhi_epi8(v, zero));
+        }
+        __m128i avg_lo = _mm_srli_epi16(_mm_mulhi_epu16(sum_lo, third), 1);
+        __m128i avg_hi = _mm_srli_epi16(_mm_mulhi_epu16(sum_hi, third), 1);
+        __m128i q_lo = _mm_srli_epi16(_mm_mullo_epi16(avg_lo, lv), 8);
+        __m128i q_hi = _mm_srli_epi16(_mm_mullo_epi16(avg_hi, lv), 8);
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(q_lo, q_hi));
+    }
+    quantize_bw_scalar(src + x * 3, w - x, levels, channel_idx, dst + x);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i quantize_32_avx2(__m256i v, __m256i lv) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(v, zero), lv), 8);
+    __m256i hi = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(v, zero), lv), 8);
+    // unpack and pack both work per 128-bit lane, so the byte order survives
+    return _mm256_packus_epi16(lo, hi);
+}
+
+// Loads 16 bytes at p into the low lane and 16 bytes at p + 48 into the high
+// lane, so each lane sees its own group of 16 pixels.
+__attribute__((target("avx2")))
+static inline __m256i load_pixel_pair_avx2(const unsigned char* p) {
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p)),
+                                   _mm_loadu_si128((const __m128i*)(p + 48)), 1);
+}
+
+__attribute__((target("avx2")))
+static void quantize_full_avx2(const unsigned char* src, int w, int levels, int channel_idx, unsigned char* dst) {
+    (void)channel_idx;
+    __m256i lv = _mm256_set1_epi16((short)levels);
+    int n = w * 3;
+    int x = 0;
+    for (; x + 32 <= n; x += 32) {
+        _mm256_storeu_si256((__m256i*)(dst + x), quantize_32_avx2(_mm256_loadu_si256((const __m256i*)(src + x)), lv));
+    }
+    quantize_samples_scalar(src + x, n - x, levels, dst + x);
+}
+
+__attribute__((target("avx2")))
+static void quantize_single_avx2(const unsigned char* src, int w, int levels, int channel_idx, unsigned char* dst) {
+    unsigned char m[3][16];
+    rgb_gather_masks(channel_idx, m);
+    __m256i m0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)m[0]));
+    __m256i m1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)m[1]));
+    __m256i m2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)m[2]));
+    __m256i lv = _mm256_set1_epi16((short)levels);
+    int x = 0;
+    for (; x + 32 <= w; x += 32) {
+        const unsigned char* p = src + x * 3;
+        __m256i v = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(load_pixel_pair_avx2(p), m0),
+                                                    _mm256_shuffle_epi8(load_pixel_pair_avx2(p + 16), m1)),
+                                    _mm256_shuffle_epi8(load_pixel_pair_avx2(p + 32), m2));
+        _mm256_storeu_si256((__m256i*)(dst + x), quantize_32_avx2(v, lv));
+    }
+    quantize_single_ssse3(src + x * 3, w - x, levels, channel_idx, dst + x);
+}
+
+__attribute__((target("avx2")))
+static void quantize_bw_avx2(const unsigned char* src, int w, int levels, int channel_idx, unsigned char* dst) {
+    unsigned char m[3][3][16];
+    __m256i masks[3][3];
+    for (int c = 0; c < 3; ++c) {
+        rgb_gather_masks(c, m[c]);
+        for (int block = 0; block < 3; ++block) masks[c][block] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)m[c][block]));
+    }
+    __m256i zero = _mm256_setzero_si256();
+    __m256i third = _mm256_set1_epi16((short)0xAAAB);
+    __m256i lv = _mm256_set1_epi16((short)levels);
+    int x = 0;
+    for (; x + 32 <= w; x += 32) {
+        const unsigned char* p = src + x * 3;
+        __m256i a = load_pixel_pair_avx2(p);
+        __m256i b = load_pixel_pair_avx2(p + 16);
+        __m256i c = load_pixel_pair_avx2(p + 32);
+        __m256i sum_lo = zero, sum_hi = zero;
+        for (int ch = 0; ch < 3; ++ch) {
+            __m256i v = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, masks[ch][0]), _mm256_shuffle_epi8(b, masks[ch][1])),
+                                        _mm256_shuffle_epi8(c, masks[ch][2]));
+            sum_lo = _mm256_add_epi16(sum_lo, _mm256_unpacklo_epi8(v, zero));
+            sum_hi = _mm256_add_epi16(sum_hi, _mm256_unpackhi_epi8(v, zero));
+        }
+        __m256i avg_lo = _mm256_srli_epi16(_mm256_mulhi_epu16(sum_lo, third), 1);
+        __m256i avg_hi = _mm256_srli_epi16(_mm256_mulhi_epu16(sum_hi, third), 1);
+        __m256i q_lo = _mm256_srli_epi16(_mm256_mullo_epi16(avg_lo, lv), 8);
+        __m256i q_hi = _mm256_srli_epi16(_mm256_mullo_epi16(avg_hi, lv), 8);
+        _mm256_storeu_si256((__m256i*)(dst + x), _mm256_packus_epi16(q_lo, q_hi));
+    }
+    quantize_bw_ssse3(src + x * 3, w - x, levels, channel_idx, dst + x);
+}
+
+static const quantize_kernels sse2_kernels = {"sse2", quantize_full_sse2, quantize_single_scalar, quantize_bw_scalar};
+static const quantize_kernels ssse3_kernels = {"ssse3", quantize_full_sse2, quantize_single_ssse3, quantize_bw_ssse3};
+static const quantize_kernels avx2_kernels = {"avx2", quantize_full_avx2, quantize_single_avx2, quantize_bw_avx2};
+#endif
+
+static const quantize_kernels* active_kernels = &scalar_kernels;
+
+// Picks the fastest kernels this CPU supports; runs once, before the first
+// encode. Setting ZDZEG_NO_SIMD in the environment forces the scalar code.
+static void quantize_init(void) {
+    active_kernels = &scalar_kernels;
+    if (getenv("ZDZEG_NO_SIMD")) return;
+#ifdef ZDZEG_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) active_kernels = &avx2_kernels;
+    else if (__builtin_cpu_supports("ssse3")) active_kernels = &ssse3_kernels;
+    else if (__builtin_cpu_supports("sse2")) active_kernels = &sse2_kernels;
+#endif
+}
+
+static pthread_once_t quantize_once = PTHREAD_ONCE_INIT;
+
+// Quantizes one RGB24 row into `dst` with the selected kernels.
+static void quantize_row(const unsigned char* src, int w, int levels, int channel_idx, unsigned char* dst) {
+    if (channel_idx == 3) active_kernels->full(src, w, levels, channel_idx, dst);
+    else if (channel_idx == 4) active_kernels->bw(src, w, levels, channel_idx, dst);
+    else active_kernels->single(src, w, levels, channel_idx, dst);
+}
+
+// --- Encoding ---
+
+// Size of the run window fed to the compressor, and the usual size of each
+// compressed chunk handed to the output.
+#define STREAM_CHUNK 65536
+
+// Longest literal of a packed stream; longer stretches are split.
+#define PACKED_LITERAL_MAX 4096
+
+// Deflate settings raced against each other by auto-tuning. Z_RLE and
+// Huffman-only streams make fewer back references, so they inflate faster.
+typedef struct {
+    int level;
+    int strategy;
+    const char* name;
+} tune_candidate;
+
+static const tune_candidate tune_candidates[] = {
+    {1, Z_DEFAULT_STRATEGY, "level 1, default"},
+    {6, Z_DEFAULT_STRATEGY, "level 6, default"},
+    {9, Z_DEFAULT_STRATEGY, "level 9, default"},
+    {9, Z_FILTERED, "level 9, filtered"},
+    {9, Z_RLE, "level 9, rle"},
+    {9, Z_HUFFMAN_ONLY, "huffman only"},
+};
+#define TUNE_CANDIDATES ((int)(sizeof(tune_candidates) / sizeof(tune_candidates[0])))
+
+struct zdzeg_encoder {
+    unsigned char* row;
+    size_t row_cap;
+    unsigned char* prev_row; // previous quantized row, for row filters
+    size_t prev_row_cap;
+    unsigned char* filtered; // best and trial filtered rows, type first
+    size_t filtered_cap;
+    unsigned char* reduced[2]; // pyramid levels, alternating
+    size_t reduced_cap[2];
+    unsigned char* window;
+    unsigned char* chunk;
+    size_t chunk_cap;
+    unsigned char* literal; // values of the pending packed literal
+    unsigned char* payload; // the whole run stream, collected when tuning
+    size_t payload_cap;
+    int tuned;              // the last image was auto-tuned
+    int tune_wins[TUNE_CANDIDATES]; // streams each candidate won in it
+    char tune_report[64];
+    z_stream deflater;
+    int deflater_ready;
+    int deflater_level;
+#ifdef ZDZEG_WITH_ZSTD
+    ZSTD_CCtx* zstd;
+#endif
+#ifdef ZDZEG_WITH_LZ4
+    LZ4F_cctx* lz4;
+    LZ4F_preferences_t lz4_prefs;
+#endif
+};
+
+zdzeg_encoder* zdzeg_encoder_create(void) {
+    return (zdzeg_encoder*)calloc(1, sizeof(zdzeg_encoder));
+}
+
+void zdzeg_encoder_free(zdzeg_encoder* enc) {
+    if (!enc) return;
+    free(enc->row);
+    free(enc->prev_row);
+    free(enc->filtered);
+    free(enc->window);
+    free(enc->chunk);
+    free(enc->literal);
+    free(enc->payload);
+    free(enc->reduced[0]);
+    free(enc->reduced[1]);
+    if (enc->deflater_ready) deflateEnd(&enc->deflater);
+#ifdef ZDZEG_WITH_ZSTD
+    ZSTD_freeCCtx(enc->zstd);
+#endif
+#ifdef ZDZEG_WITH_LZ4
+    if (enc->lz4) LZ4F_freeCompressionContext(enc->lz4);
+#endif
+    free(enc);
+}
+
+// Where an encoded file goes: a seekable stream, or a caller's buffer.
+typedef struct {
+    FILE* f;
+    unsigned char* mem;
+    size_t mem_cap;
+    size_t mem_len;
+    uint64_t origin; // position of the file's first byte in `f`
+} encode_sink;
+
+static int sink_write(encode_sink* sink, const void* data, size_t len) {
+    if (sink->f) return fwrite(data, 1, len, sink->f) == len ? ZDZEG_OK : ZDZEG_ERR_IO;
+    if (len > sink->mem_cap - sink->mem_len) return ZDZEG_ERR_SPACE;
+    memcpy(sink->mem + sink->mem_len, data, len);
+    sink->mem_len += len;
+    return ZDZEG_OK;
+}
+
+// Overwrites bytes written earlier, then returns to `end`, the end of the file.
+// Both count from the start of the file.
+static int sink_patch(encode_sink* sink, uint64_t offset, const void* data, size_t len, uint64_t end) {
+    if (!sink->f) {
+        memcpy(sink->mem + offset, data, len);
+        return ZDZEG_OK;
+    }
+    // Seek to the known end rather than SEEK_END, which an open_memstream
+    // stream resolves against its current position
+    if (fseeko(sink->f, (off_t)(sink->origin + offset), SEEK_SET) != 0 || fwrite(data, 1, len, sink->f) != len ||
+        fseeko(sink->f, (off_t)(sink->origin + end), SEEK_SET) != 0) {
+        return ZDZEG_ERR_IO;
+    }
+    return ZDZEG_OK;
+}
+
+// Streaming state for one compressed stream: finished runs collect in a
+// small window that is fed to the compressor, and each compressed chunk goes
+// straight to the sink. The counters cover the stream currently being written.
+typedef struct {
+    zdzeg_encoder* enc;
+    encode_sink* sink;
+    int codec;          // ZDZEG_CODEC_*
+    int tune;           // ZDZEG_TUNE_*: collect the stream in enc->payload and race it
+    int tune_slack;
+    int packed;         // ZDZEG_CODING_PACKED tokens instead of 3-byte runs
+    int bits;           // bits per packed literal value
+    int filtered;       // rows are predicted with ZDZEG_ROW_FILTER_*
+    unsigned char mask; // residuals of filtered rows are taken modulo mask + 1
+    size_t literal_len; // values waiting in enc->literal
+    unsigned char run_val;
+    uint64_t run_count; // length of the run in progress, 0 if none
+    size_t window_len;
+    uint64_t payload_size;
+    uint64_t compressed_size;
+} run_stream;
+
+// Writes `have` bytes of compressed output from the chunk buffer to the sink.
+static int stream_emit(run_stream* rs, size_t have) {
+    rs->compressed_size += have;
+    return have > 0 ? sink_write(rs->sink, rs->enc->chunk, have) : ZDZEG_OK;
+}
+
+// Sets up the encoder's compressor for `codec` at `level` (0 for the
+// codec's default). Contexts are kept from image to image and only
+// re-created when the settings change.
+static int compressor_prepare(zdzeg_encoder* enc, int codec, int level) {
+    size_t chunk_cap = STREAM_CHUNK;
+    if (codec == ZDZEG_CODEC_ZLIB) {
+        int z_level = level ? level : Z_DEFAULT_COMPRESSION;
+        if (enc->deflater_ready && enc->deflater_level != z_level) {
+            deflateEnd(&enc->deflater);
+            enc->deflater_ready = 0;
+        }
+        if (!enc->deflater_ready) {
+            // Same parameters as compress() apart from the level: default strategy and memory.
+            int z_result = deflateInit(&enc->deflater, z_level);
+            if (z_result != Z_OK) return z_result == Z_MEM_ERROR ? ZDZEG_ERR_NOMEM : ZDZEG_ERR_COMPRESS;
+            enc->deflater_ready = 1;
+            enc->deflater_level = z_level;
+        }
+    }
+#ifdef ZDZEG_WITH_ZSTD
+    if (codec == ZDZEG_CODEC_ZSTD) {
+        if (!enc->zstd && !(enc->zstd = ZSTD_createCCtx())) return ZDZEG_ERR_NOMEM;
+        if (ZSTD_isError(ZSTD_CCtx_setParameter(enc->zstd, ZSTD_c_compressionLevel, level ? level : ZSTD_CLEVEL_DEFAULT))) {
+            return ZDZEG_ERR_COMPRESS;
+        }
+    }
+#endif
+#ifdef ZDZEG_WITH_LZ4
+    if (codec == ZDZEG_CODEC_LZ4) {
+        if (!enc->lz4 && LZ4F_isError(LZ4F_createCompressionContext(&enc->lz4, LZ4F_VERSION))) return ZDZEG_ERR_NOMEM;
+        memset(&enc->lz4_prefs, 0, sizeof(enc->lz4_prefs));
+        enc->lz4_prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+        enc->lz4_prefs.compressionLevel = level; // 0 is the fast compressor, 3 and up high compression
+        // Every update must fit in one chunk, including data buffered by earlier ones
+        size_t bound = LZ4F_compressBound(STREAM_CHUNK, &enc->lz4_prefs);
+        if (bound > chunk_cap) chunk_cap = bound;
+    }
+#endif
+    return ensure_capacity(&enc->chunk, &enc->chunk_cap, chunk_cap) ? ZDZEG_ERR_NOMEM : ZDZEG_OK;
+}
+
+// Starts a new compressed stream with the prepared compressor.
+static int stream_begin(run_stream* rs) {
+    zdzeg_encoder* enc = rs->enc;
+#ifdef ZDZEG_WITH_ZSTD
+    if (rs->codec == ZDZEG_CODEC_ZSTD) {
+        return ZSTD_isError(ZSTD_CCtx_reset(enc->zstd, ZSTD_reset_session_only)) ? ZDZEG_ERR_COMPRESS : ZDZEG_OK;
+    }
+#endif
+#ifdef ZDZEG_WITH_LZ4
+    if (rs->codec == ZDZEG_CODEC_LZ4) {
+        size_t have = LZ4F_compressBegin(enc->lz4, enc->chunk, enc->chunk_cap, &enc->lz4_prefs);
+        return LZ4F_isError(have) ? ZDZEG_ERR_COMPRESS : stream_emit(rs, have);
+    }
+#endif
+    return deflateReset(&enc->deflater) == Z_OK ? ZDZEG_OK : ZDZEG_ERR_COMPRESS;
+}
+
+// Feeds `len` bytes to the compressor and writes out every compressed
+// chunk. `finish` ends the stream.
+static int stream_compress(run_stream* rs, const unsigned char* data, size_t len, int finish) {
+    zdzeg_encoder* enc = rs->enc;
+#ifdef ZDZEG_WITH_ZSTD
+    if (rs->codec == ZDZEG_CODEC_ZSTD) {
+        ZSTD_inBuffer in = {data, len, 0};
+        size_t remaining;
+        do {
+            ZSTD_outBuffer out = {enc->chunk, enc->chunk_cap, 0};
+            remaining = ZSTD_compressStream2(enc->zstd, &out, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(remaining)) return ZDZEG_ERR_COMPRESS;
+            int result = stream_emit(rs, out.pos);
+            if (result != ZDZEG_OK) return result;
+        } while (finish ? remaining != 0 : in.pos < in.size);
+        return ZDZEG_OK;
+    }
+#endif
+#ifdef ZDZEG_WITH_LZ4
+    if (rs->codec == ZDZEG_CODEC_LZ4) {
+        size_t have = LZ4F_compressUpdate(enc->lz4, enc->chunk, enc->chunk_cap, data, len, NULL);
+        if (LZ4F_isError(have)) return ZDZEG_ERR_COMPRESS;
+        int result = stream_emit(rs, have);
+        if (result != ZDZEG_OK || !finish) return result;
+        have = LZ4F_compressEnd(enc->lz4, enc->chunk, enc->chunk_cap, NULL);
+        return LZ4F_isError(have) ? ZDZEG_ERR_COMPRESS : stream_emit(rs, have);
+    }
+#endif
+    z_stream* zs = &enc->deflater;
+    zs->next_in = (Bytef*)data;
+    zs->avail_in = (uInt)len;
+    do {
+        zs->next_out = enc->chunk;
+        zs->avail_out = (uInt)enc->chunk_cap;
+        if (deflate(zs, finish ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR) return ZDZEG_ERR_COMPRESS;
+        int result = stream_emit(rs, enc->chunk_cap - zs->avail_out);
+        if (result != ZDZEG_OK) return result;
+    } while (zs->avail_out == 0);
+    return ZDZEG_OK;
+}
+
+// One auto-tuning trial: deflates the payload with one candidate and times
+// how long the result takes to inflate.
+typedef struct {
+    const tune_candidate* candidate;
+    const unsigned char* payload;
+    size_t payload_len;
+    unsigned char* out;
+    size_t out_len;
+    double inflate_ms;
+    int result;
+} tune_trial;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void* tune_trial_run(void* data) {
+    tune_trial* trial = (tune_trial*)data;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    int z_result = deflateInit2(&zs, trial->candidate->level, Z_DEFLATED, 15, 8, trial->candidate->strategy);
+    if (z_result != Z_OK) {
+        trial->result = z_result == Z_MEM_ERROR ? ZDZEG_ERR_NOMEM : ZDZEG_ERR_COMPRESS;
+        return NULL;
+    }
+    size_t cap = deflateBound(&zs, (uLong)trial->payload_len);
+    unsigned char* check = (unsigned char*)malloc(trial->payload_len ? trial->payload_len : 1);
+    trial->out = (unsigned char*)malloc(cap);
+    if (!check || !trial->out) {
+        deflateEnd(&zs);
+        free(check);
+        trial->result = ZDZEG_ERR_NOMEM;
+        return NULL;
+    }
+    zs.next_in = (Bytef*)trial->payload;
+    zs.avail_in = (uInt)trial->payload_len;
+    zs.next_out = trial->out;
+    zs.avail_out = (uInt)cap;
+    z_result = deflate(&zs, Z_FINISH);
+    trial->out_len = zs.total_out;
+    deflateEnd(&zs);
+    trial->result = z_result == Z_STREAM_END ? ZDZEG_OK : ZDZEG_ERR_COMPRESS;
+    // Best of three inflates, to keep scheduling noise out of the comparison
+    trial->inflate_ms = 1e30;
+    for (int round = 0; round < 3 && trial->result == ZDZEG_OK; ++round) {
+        uLongf dest_len = (uLongf)trial->payload_len;
+        double start = now_ms();
+        z_result = uncompress(check, &dest_len, trial->out, (uLong)trial->out_len);
+        double ms = now_ms() - start;
+        if (z_result != Z_OK || dest_len != trial->payload_len) trial->result = ZDZEG_ERR_COMPRESS;
+        if (ms < trial->inflate_ms) trial->inflate_ms = ms;
+    }
+    free(check);
+    return NULL;
+}
+
+// Compresses the collected payload with every candidate in parallel and
+// writes out the one the tuning policy prefers.
+static int stream_race(run_stream* rs) {
+    tune_trial trials[TUNE_CANDIDATES];
+    pthread_t threads[TUNE_CANDIDATES];
+    int started[TUNE_CANDIDATES];
+    memset(trials, 0, sizeof(trials));
+    for (int i = 0; i < TUNE_CANDIDATES; ++i) {
+        trials[i].candidate = &tune_candidates[i];
+        trials[i].payload = rs->enc->payload;
+        trials[i].payload_len = (size_t)rs->payload_size;
+        started[i] = pthread_create(&threads[i], NULL, tune_trial_run, &trials[i]) == 0;
+    }
+    for (int i = 0; i < TUNE_CANDIDATES; ++i) {
+        // Trials that could not get a thread run here instead
+        if (started[i]) pthread_join(threads[i], NULL);
+        else tune_trial_run(&trials[i]);
+    }
+
+    int result = ZDZEG_ERR_COMPRESS;
+    size_t smallest = SIZE_MAX;
+    for (int i = 0; i < TUNE_CANDIDATES; ++i) {
+        if (trials[i].result == ZDZEG_OK && trials[i].out_len < smallest) smallest = trials[i].out_len;
+        else if (trials[i].result == ZDZEG_ERR_NOMEM) result = ZDZEG_ERR_NOMEM;
+    }
+    int best = -1;
+    for (int i = 0; i < TUNE_CANDIDATES; ++i) {
+        const tune_trial* t = &trials[i];
+        if (t->result != ZDZEG_OK) continue;
+        if (rs->tune == ZDZEG_TUNE_FAST_DECODE) {
+            if ((uint64_t)t->out_len * 100 > (uint64_t)smallest * (100 + rs->tune_slack)) continue;
+            if (best < 0 || t->inflate_ms < trials[best].inflate_ms) best = i;
+        } else if (best < 0 || t->out_len < trials[best].out_len ||
+                   (t->out_len == trials[best].out_len && t->inflate_ms < trials[best].inflate_ms)) {
+            best = i;
+        }
+    }
+    if (best >= 0) {
+        rs->enc->tune_wins[best]++;
+        rs->compressed_size += trials[best].out_len;
+        result = sink_write(rs->sink, trials[best].out, trials[best].out_len);
+    }
+    for (int i = 0; i < TUNE_CANDIDATES; ++i) free(trials[i].out);
+    return result;
+}
+
+const char* zdzeg_encoder_tuning(const zdzeg_encoder* enc) {
+    if (!enc || !enc->tuned) return NULL;
+    return enc->tune_report;
+}
+
+// Records which candidate won the most streams of the image just written.
+static void tune_report(zdzeg_encoder* enc) {
+    int best = 0, streams = 0;
+    for (int i = 0; i < TUNE_CANDIDATES; ++i) {
+        streams += enc->tune_wins[i];
+        if (enc->tune_wins[i] > enc->tune_wins[best]) best = i;
+    }
+    if (streams > 1) {
+        snprintf(enc->tune_report, sizeof(enc->tune_report), "%s (%d of %d tiles)", tune_candidates[best].name,
+                 enc->tune_wins[best], streams);
+    } else {
+        snprintf(enc->tune_report, sizeof(enc->tune_report), "%s", tune_candidates[best].name);
+    }
+}
+
+// Appends bytes to the run window, compressing it whenever it fills up.
+// When tuning, the whole stream is collected instead.
+static int stream_write(run_stream* rs, const unsigned char* data, size_t len) {
+    if (rs->tune) {
+        zdzeg_encoder* enc = rs->enc;
+        if (ensure_capacity(&enc->payload, &enc->payload_cap, (size_t)rs->payload_size + len)) return ZDZEG_ERR_NOMEM;
+        memcpy(enc->payload + rs->payload_size, data, len);
+        rs->payload_size += len;
+        return ZDZEG_OK;
+    }
+    if (rs->window_len + len > STREAM_CHUNK) {
+        int result = stream_compress(rs, rs->enc->window, rs->window_len, 0);
+        if (result != ZDZEG_OK) return result;
+        rs->window_len = 0;
+    }
+    memcpy(rs->enc->window + rs->window_len, data, len);
+    rs->window_len += len;
+    rs->payload_size += len;
+    return ZDZEG_OK;
+}
+
+// Stores `v` as a LEB128 varint. Returns the number of bytes written (at most 10).
+static size_t put_varint(unsigned char* p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+// Writes the pending literal as one token, its values packed MSB first.
+static int stream_flush_literal(run_stream* rs) {
+    if (rs->literal_len == 0) return ZDZEG_OK;
+    unsigned char token[10 + (PACKED_LITERAL_MAX * 8 + 7) / 8];
+    size_t n = put_varint(token, ((uint64_t)rs->literal_len << 1) | 1);
+    uint32_t acc = 0;
+    int acc_bits = 0;
+    for (size_t i = 0; i < rs->literal_len; ++i) {
+        acc = (acc << rs->bits) | rs->enc->literal[i];
+        acc_bits += rs->bits;
+        if (acc_bits >= 8) {
+            acc_bits -= 8;
+            token[n++] = (unsigned char)(acc >> acc_bits);
+        }
+    }
+    if (acc_bits > 0) token[n++] = (unsigned char)(acc << (8 - acc_bits));
+    rs->literal_len = 0;
+    return stream_write(rs, token, n);
+}
+
+// Emits a finished run. Unpacked streams write 3-byte runs (the value and a
+// big-endian 16-bit count, so `count` must fit). Packed streams write runs
+// worth at least 3 bytes of literal bits as run tokens and gather shorter
+// ones into literals.
+static int stream_run(run_stream* rs, unsigned char val, uint64_t count) {
+    if (!rs->packed) {
+        unsigned char run[3] = {val, (count >> 8) & 0xFF, count & 0xFF};
+        return stream_write(rs, run, 3);
+    }
+    if (count * rs->bits >= 24) {
+        int result = stream_flush_literal(rs);
+        if (result != ZDZEG_OK) return result;
+        unsigned char token[11];
+        size_t n = put_varint(token, count << 1);
+        token[n++] = val;
+        return stream_write(rs, token, n);
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+        if (rs->literal_len == PACKED_LITERAL_MAX) {
+            int result = stream_flush_literal(rs);
+            if (result != ZDZEG_OK) return result;
+        }
+        rs->enc->literal[rs->literal_len++] = val;
+    }
+    return ZDZEG_OK;
+}
+
+// Extends the run in progress with `n` samples, emitting every run they finish.
+static int stream_samples(run_stream* rs, const unsigned char* samples, size_t n) {
+    uint64_t max_count = rs->packed ? UINT32_MAX : 65535;
+    for (size_t i = 0; i < n; ++i) {
+        if (rs->run_count > 0 && samples[i] == rs->run_val && rs->run_count < max_count) {
+            rs->run_count++;
+        } else {
+            if (rs->run_count > 0) {
+                int result = stream_run(rs, rs->run_val, rs->run_count);
+                if (result != ZDZEG_OK) return result;
+            }
+            rs->run_val = samples[i];
+            rs->run_count = 1;
+        }
+    }
+    return ZDZEG_OK;
+}
+
+// Writes filter type `type` and the residuals of `row` into `out`. `prev` is
+// the row above (NULL for the first row) and `bpp` the samples per pixel.
+// Returns a cost estimate: the sum of the residuals' distances from 0 plus
+// the number of places where a new run would start.
+static unsigned long filter_row(int type, const unsigned char* row, const unsigned char* prev, size_t n, int bpp,
+                                unsigned char mask, unsigned char* out) {
+    unsigned long cost = 0;
+    out[0] = (unsigned char)type;
+    for (size_t i = 0; i < n; ++i) {
+        int a = i >= (size_t)bpp ? row[i - bpp] : 0;
+        int b = prev ? prev[i] : 0;
+        int c = prev && i >= (size_t)bpp ? prev[i - bpp] : 0;
+        int pred = 0;
+        switch (type) {
+            case ZDZEG_ROW_FILTER_SUB: pred = a; break;
+            case ZDZEG_ROW_FILTER_UP: pred = b; break;
+            case ZDZEG_ROW_FILTER_AVERAGE: pred = (a + b) >> 1; break;
+            case ZDZEG_ROW_FILTER_PAETH: pred = zdzeg_paeth(a, b, c); break;
+        }
+        unsigned char r = (unsigned char)((row[i] - pred) & mask);
+        out[i + 1] = r;
+        // Residuals wrap around, so a residual near mask is a small negative one
+        cost += r <= mask - r ? r : (unsigned long)(mask + 1 - r);
+        if (i > 0 && r != out[i]) cost++;
+    }
+    return cost;
+}
+
+// Quantizes a rectangle of the image row by row and writes its runs as one
+// complete compressed stream. Runs carry over row boundaries, exactly as if the
+// whole rectangle had been quantized first. Filtered streams prefix every
+// row with the filter that gives the smallest residuals.
+static int stream_region(run_stream* rs, const unsigned char* rgb, int pitch, int x0, int y0, int rw, int rh, int levels, int channel_idx) {
+    int bpp = channel_idx == ZDZEG_CHANNEL_FULL ? 3 : 1;
+    size_t row_len = (size_t)rw * bpp;
+    rs->literal_len = 0;
+    rs->run_count = 0;
+    rs->window_len = 0;
+    rs->payload_size = 0;
+    rs->compressed_size = 0;
+    int result = rs->tune ? ZDZEG_OK : stream_begin(rs);
+    for (int y = y0; y < y0 + rh && result == ZDZEG_OK; ++y) {
+        zdzeg_encoder* enc = rs->enc;
+        quantize_row(rgb + (size_t)y * pitch + (size_t)x0 * 3, rw, levels, channel_idx, enc->row);
+        if (!rs->filtered) {
+            result = stream_samples(rs, enc->row, row_len);
+            continue;
+        }
+        const unsigned char* prev = y > y0 ? enc->prev_row : NULL;
+        unsigned char* best = enc->filtered;
+        unsigned char* trial = enc->filtered + row_len + 1;
+        // Filter types are stored as values, so only those that fit in a value are tried
+        int type_count = rs->mask < ZDZEG_ROW_FILTER_COUNT - 1 ? rs->mask + 1 : ZDZEG_ROW_FILTER_COUNT;
+        unsigned long best_cost = filter_row(ZDZEG_ROW_FILTER_NONE, enc->row, prev, row_len, bpp, rs->mask, best);
+        for (int type = ZDZEG_ROW_FILTER_SUB; type < type_count && best_cost > 0; ++type) {
+            unsigned long cost = filter_row(type, enc->row, prev, row_len, bpp, rs->mask, trial);
+            if (cost < best_cost) {
+                unsigned char* temp = best;
+                best = trial;
+                trial = temp;
+                best_cost = cost;
+            }
+        }
+        result = stream_samples(rs, best, row_len + 1);
+        // The quantized row becomes the previous one; capacities travel with the buffers
+        unsigned char* temp = enc->prev_row;
+        enc->prev_row = enc->row;
+        enc->row = temp;
+        size_t temp_cap = enc->prev_row_cap;
+        enc->prev_row_cap = enc->row_cap;
+        enc->row_cap = temp_cap;
+    }
+    // Write the last run and literal, then flush the window and finish the stream
+    if (result == ZDZEG_OK && rs->run_count > 0) result = stream_run(rs, rs->run_val, rs->run_count);
+    if (result == ZDZEG_OK) result = stream_flush_literal(rs);
+    if (result == ZDZEG_OK) {
+        result = rs->tune ? stream_race(rs) : stream_compress(rs, rs->enc->window, rs->window_len, 1);
+    }
+    return result;
+}
+
+static int check_params(int width, int height, const zdzeg_params* params) {
+    if (width <= 0 || height <= 0) return ZDZEG_ERR_PARAM;
+    if (params->levels < 4 || params->levels > 32) return ZDZEG_ERR_PARAM;
+    if (params->channel < 0 || params->channel >= ZDZEG_CHANNEL_COUNT) return ZDZEG_ERR_PARAM;
+    if (params->tile_size < 0 || params->tile_size > 4096) return ZDZEG_ERR_PARAM;
+    if (params->coding != ZDZEG_CODING_PACKED && params->coding != ZDZEG_CODING_RUNS) return ZDZEG_ERR_PARAM;
+    if (params->row_filters != ZDZEG_ROW_FILTERS_AUTO && params->row_filters != ZDZEG_ROW_FILTERS_OFF) return ZDZEG_ERR_PARAM;
+    static const int max_levels[ZDZEG_CODEC_COUNT] = {9, 22, 12};
+    if (params->codec < 0 || params->codec >= ZDZEG_CODEC_COUNT) return ZDZEG_ERR_PARAM;
+    if (params->level < 0 || params->level > max_levels[params->codec]) return ZDZEG_ERR_PARAM;
+    if (!zdzeg_codec_available(params->codec)) return ZDZEG_ERR_CODEC;
+    if (params->tune < ZDZEG_TUNE_OFF || params->tune > ZDZEG_TUNE_FAST_DECODE || params->tune_slack < 0) return ZDZEG_ERR_PARAM;
+    if (params->tune != ZDZEG_TUNE_OFF && params->codec != ZDZEG_CODEC_ZLIB) return ZDZEG_ERR_PARAM;
+    if (params->pyramid < 0 || params->pyramid > ZDZEG_PYRAMID_MAX) return ZDZEG_ERR_PARAM;
+    return ZDZEG_OK;
+}
+
+// Number of pyramid levels actually written: halving stops once the image
+// is down to a single pixel.
+static int pyramid_count(int width, int height, int requested) {
+    int count = 0;
+    while (count < requested && (zdzeg_level_size(width, count) > 1 || zdzeg_level_size(height, count) > 1)) count++;
+    return count;
+}
+
+// Largest compressed stream `codec` can make out of `len` bytes.
+static uint64_t compressed_bound(int codec, uint64_t len) {
+#ifdef ZDZEG_WITH_ZSTD
+    if (codec == ZDZEG_CODEC_ZSTD) return ZSTD_compressBound((size_t)len);
+#endif
+#ifdef ZDZEG_WITH_LZ4
+    if (codec == ZDZEG_CODEC_LZ4) {
+        LZ4F_preferences_t prefs;
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+        return LZ4F_compressFrameBound((size_t)len, &prefs);
+    }
+#endif
+    (void)codec;
+    return compressBound((uLong)len);
+}
+
+static uint64_t image_bound(int width, int height, const zdzeg_params* params);
+
+size_t zdzeg_encode_bound(int width, int height, const zdzeg_params* params) {
+    if (check_params(width, height, params) != ZDZEG_OK) return 0;
+    uint64_t bound = image_bound(width, height, params);
+    int levels = pyramid_count(width, height, params->pyramid);
+    for (int k = 1; k <= levels; ++k) {
+        bound += image_bound(zdzeg_level_size(width, k), zdzeg_level_size(height, k), params);
+    }
+    if (levels > 0) bound += (uint64_t)levels * ZDZEG_PYRAMID_ENTRY_SIZE + ZDZEG_PYRAMID_FOOTER_SIZE;
+    return bound > SIZE_MAX ? SIZE_MAX : (size_t)bound;
+}
+
+// Largest single image (without its pyramid) of this size.
+static uint64_t image_bound(int width, int height, const zdzeg_params* params) {
+    int tile_size = params->tile_size > 0 ? params->tile_size : (width > height ? width : height);
+    int tiles_x = zdzeg_tile_count(width, tile_size);
+    int tiles_y = zdzeg_tile_count(height, tile_size);
+    int nch = params->channel == ZDZEG_CHANNEL_FULL ? 3 : 1;
+    uint64_t bound = ZDZEG_HEADER_SIZE;
+    if (params->tile_size > 0) bound += ZDZEG_TILE_INFO_SIZE + (uint64_t)tiles_x * tiles_y * ZDZEG_TILE_ENTRY_SIZE;
+    // At worst every sample, including the filter type of each filtered row,
+    // starts a new 3-byte run, or a 2-byte literal when packed
+    int filter_samples = params->row_filters == ZDZEG_ROW_FILTERS_AUTO ? 1 : 0;
+    for (int ty = 0; ty < tiles_y; ++ty) {
+        int rh = height - ty * tile_size < tile_size ? height - ty * tile_size : tile_size;
+        for (int tx = 0; tx < tiles_x; ++tx) {
+            int rw = width - tx * tile_size < tile_size ? width - tx * tile_size : tile_size;
+            bound += compressed_bound(params->codec, ((uint64_t)rw * nch + filter_samples) * rh * 3);
+        }
+    }
+    return bound;
+}
+
+// Writes a complete .zdzeg image to the sink, starting `base` bytes into it,
+// and stores its size in *out_size. Sizes and offsets are only known once the
+// image has been streamed, so placeholders go out first and are rewritten at
+// the end. `extra_flags` are added to the header's flags.
+static int encode_image(zdzeg_encoder* enc, const unsigned char* rgb, int w, int h, int pitch,
+                        const zdzeg_params* params, int extra_flags, encode_sink* sink, uint64_t base,
+                        uint64_t* out_size) {
+    int result = ZDZEG_OK;
+
+    int levels = params->levels;
+    int channel_idx = params->channel;
+    int tiled = params->tile_size > 0;
+    int tile_size = tiled ? params->tile_size : w;
+    int tiles_x = tiled ? zdzeg_tile_count(w, tile_size) : 1;
+    int tiles_y = tiled ? zdzeg_tile_count(h, tile_size) : 1;
+    size_t tile_count = (size_t)tiles_x * tiles_y;
+    size_t row_len = (size_t)(tile_size < w ? tile_size : w) * (channel_idx == ZDZEG_CHANNEL_FULL ? 3 : 1);
+
+    // --- 1. Set up the streaming buffers ---
+    unsigned char* tile_dir = NULL;
+    size_t tile_dir_size = tiled ? ZDZEG_TILE_INFO_SIZE + tile_count * ZDZEG_TILE_ENTRY_SIZE : 0;
+    int filtered = params->row_filters == ZDZEG_ROW_FILTERS_AUTO;
+    if (ensure_capacity(&enc->row, &enc->row_cap, row_len) ||
+        (filtered && ensure_capacity(&enc->prev_row, &enc->prev_row_cap, row_len)) ||
+        (filtered && ensure_capacity(&enc->filtered, &enc->filtered_cap, 2 * (row_len + 1))) ||
+        (!enc->window && !(enc->window = (unsigned char*)malloc(STREAM_CHUNK))) ||
+        (!enc->literal && !(enc->literal = (unsigned char*)malloc(PACKED_LITERAL_MAX))) ||
+        (tiled && !(tile_dir = (unsigned char*)calloc(1, tile_dir_size)))) {
+        return ZDZEG_ERR_NOMEM;
+    }
+    result = compressor_prepare(enc, params->codec, params->level);
+    if (result != ZDZEG_OK) {
+        free(tile_dir);
+        return result;
+    }
+    int packed = params->coding == ZDZEG_CODING_PACKED;
+    int flags = (tiled ? ZDZEG_FLAG_TILED : 0) | (packed ? ZDZEG_FLAG_PACKED : 0) | (filtered ? ZDZEG_FLAG_FILTERED : 0) | extra_flags;
+    run_stream rs;
+    memset(&rs, 0, sizeof(rs));
+    rs.enc = enc;
+    rs.sink = sink;
+    rs.codec = params->codec;
+    rs.tune = params->tune;
+    rs.tune_slack = params->tune_slack;
+    rs.packed = packed;
+    rs.bits = zdzeg_value_bits(levels);
+    rs.filtered = filtered;
+    rs.mask = (unsigned char)((1 << rs.bits) - 1);
+
+    // --- 2. Header and tile directory placeholders ---
+    zdzeg_header hdr = {ZDZEG_VERSION, levels, channel_idx, flags, params->codec, w, h, 0};
+    unsigned char header[ZDZEG_HEADER_SIZE];
+    zdzeg_write_header(header, &hdr);
+    result = sink_write(sink, header, ZDZEG_HEADER_SIZE);
+    if (tiled && result == ZDZEG_OK) {
+        zdzeg_put_be32(tile_dir, (uint32_t)tile_size);
+        zdzeg_put_be32(tile_dir + 4, (uint32_t)tile_size);
+        result = sink_write(sink, tile_dir, tile_dir_size);
+    }
+
+    // --- 3. Quantize, run-length encode and compress each tile ---
+    uint64_t offset = ZDZEG_HEADER_SIZE + tile_dir_size;
+    for (int ty = 0; ty < tiles_y && result == ZDZEG_OK; ++ty) {
+        for (int tx = 0; tx < tiles_x && result == ZDZEG_OK; ++tx) {
+            int x0 = tx * tile_size;
+            int y0 = ty * tile_size;
+            int rw = tiled ? (w - x0 < tile_size ? w - x0 : tile_size) : w;
+            int rh = tiled ? (h - y0 < tile_size ? h - y0 : tile_size) : h;
+            result = stream_region(&rs, rgb, pitch, x0, y0, rw, rh, levels, channel_idx);
+            if (result != ZDZEG_OK) break;
+            hdr.payload_size += rs.payload_size;
+            if (tiled) {
+                unsigned char* entry = tile_dir + ZDZEG_TILE_INFO_SIZE + ((size_t)ty * tiles_x + tx) * ZDZEG_TILE_ENTRY_SIZE;
+                zdzeg_put_be64(entry, offset);
+                zdzeg_put_be32(entry + 8, (uint32_t)rs.compressed_size);
+                zdzeg_put_be32(entry + 12, (uint32_t)rs.payload_size);
+            }
+            offset += rs.compressed_size;
+        }
+    }
+
+    // --- 4. Rewrite the header and directory with the final sizes ---
+    if (result == ZDZEG_OK) {
+        zdzeg_write_header(header, &hdr);
+        result = sink_patch(sink, base, header, ZDZEG_HEADER_SIZE, base + offset);
+        if (tiled && result == ZDZEG_OK) {
+            result = sink_patch(sink, base + ZDZEG_HEADER_SIZE, tile_dir, tile_dir_size, base + offset);
+        }
+    }
+    *out_size = offset;
+    free(tile_dir);
+    return result;
+}
+
+// Halves an RGB24 image by averaging 2x2 blocks into `dst` (rows dw * 3
+// bytes apart). The last row and column of an odd size average with
+// themselves.
+static void downsample_rgb(const unsigned char* src, int w, int h, int pitch, unsigned char* dst, int dw, int dh) {
+    for (int y = 0; y < dh; ++y) {
+        const unsigned char* row0 = src + (size_t)(2 * y) * pitch;
+        const unsigned char* row1 = 2 * y + 1 < h ? row0 + pitch : row0;
+        unsigned char* out = dst + (size_t)y * dw * 3;
+        for (int x = 0; x < dw; ++x) {
+            int x0 = 2 * x * 3;
+            int x1 = 2 * x + 1 < w ? x0 + 3 : x0;
+            for (int c = 0; c < 3; ++c) {
+                out[x * 3 + c] = (unsigned char)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+            }
+        }
+    }
+}
+
+// Appends `levels` reduced copies of the image and the pyramid directory,
+// starting `offset` bytes into the sink.
+static int encode_pyramid(zdzeg_encoder* enc, const unsigned char* rgb, int w, int h, int pitch,
+                          const zdzeg_params* params, int levels, encode_sink* sink, uint64_t offset) {
+    unsigned char dir[ZDZEG_PYRAMID_MAX * ZDZEG_PYRAMID_ENTRY_SIZE + ZDZEG_PYRAMID_FOOTER_SIZE];
+    const unsigned char* src = rgb;
+    int src_w = w, src_h = h, src_pitch = pitch;
+    for (int k = 1; k <= levels; ++k) {
+        int dw = zdzeg_level_size(w, k);
+        int dh = zdzeg_level_size(h, k);
+        unsigned char** dst = &enc->reduced[k & 1];
+        if (ensure_capacity(dst, &enc->reduced_cap[k & 1], (size_t)dw * dh * 3)) return ZDZEG_ERR_NOMEM;
+        downsample_rgb(src, src_w, src_h, src_pitch, *dst, dw, dh);
+        uint64_t size = 0;
+        int result = encode_image(enc, *dst, dw, dh, dw * 3, params, 0, sink, offset, &size);
+        if (result != ZDZEG_OK) return result;
+        zdzeg_put_be64(dir + (k - 1) * ZDZEG_PYRAMID_ENTRY_SIZE, offset);
+        zdzeg_put_be64(dir + (k - 1) * ZDZEG_PYRAMID_ENTRY_SIZE + 8, size);
+        offset += size;
+        src = *dst;
+        src_w = dw;
+        src_h = dh;
+        src_pitch = dw * 3;
+    }
+    unsigned char* footer = dir + levels * ZDZEG_PYRAMID_ENTRY_SIZE;
+    zdzeg_put_be32(footer, (uint32_t)levels);
+    memcpy(footer + 4, ZDZEG_PYRAMID_MAGIC, 4);
+    return sink_write(sink, dir, footer + ZDZEG_PYRAMID_FOOTER_SIZE - dir);
+}
+
+// Runs encode_image with the caller's encoder, or a temporary one.
+static int encode_with(zdzeg_encoder* enc, const unsigned char* rgb, int w, int h, int pitch,
+                       const zdzeg_params* params, encode_sink* sink) {
+    int result = check_params(w, h, params);
+    if (result != ZDZEG_OK) return result;
+    pthread_once(&quantize_once, quantize_init);
+    zdzeg_encoder* temp = enc ? NULL : zdzeg_encoder_create();
+    if (!enc && !temp) return ZDZEG_ERR_NOMEM;
+    if (!enc) enc = temp;
+    enc->tuned = 0;
+    memset(enc->tune_wins, 0, sizeof(enc->tune_wins));
+
+    int levels = pyramid_count(w, h, params->pyramid);
+    uint64_t size = 0;
+    result = encode_image(enc, rgb, w, h, pitch, params, levels ? ZDZEG_FLAG_PYRAMID : 0, sink, 0, &size);
+    if (result == ZDZEG_OK && levels > 0) result = encode_pyramid(enc, rgb, w, h, pitch, params, levels, sink, size);
+    if (result == ZDZEG_OK && params->tune != ZDZEG_TUNE_OFF) {
+        enc->tuned = 1;
+        tune_report(enc);
+    }
+    zdzeg_encoder_free(temp);
+    return result;
+}
+
+int zdzeg_encode_mem(zdzeg_encoder* enc, const unsigned char* rgb, int width, int height, int pitch,
+                     const zdzeg_params* params, unsigned char* out, size_t out_cap, size_t* out_len) {
+    encode_sink sink = {NULL, out, out_cap, 0, 0};
+    int result = encode_with(enc, rgb, width, height, pitch, params, &sink);
+    *out_len = result == ZDZEG_OK ? sink.mem_len : 0;
+    return result;
+}
+
+int zdzeg_encode_file(zdzeg_encoder* enc, const unsigned char* rgb, int width, int height, int pitch,
+                      const zdzeg_params* params, FILE* f) {
+    off_t start = ftello(f);
+    if (start < 0) return ZDZEG_ERR_IO;
+    encode_sink sink = {f, NULL, 0, 0, (uint64_t)start};
+    return encode_with(enc, rgb, width, height, pitch, params, &sink);
+}
+
+// --- Decoding ---
+
+// Decompression contexts, created on first use and reused for every stream
+// one thread decodes (the tiles of a tiled file, for instance).
+typedef struct {
+    z_stream inflater;
+    int inflater_ready;
+#ifdef ZDZEG_WITH_ZSTD
+    ZSTD_DCtx* zstd;
+#endif
+#ifdef ZDZEG_WITH_LZ4
+    LZ4F_dctx* lz4;
+#endif
+} decompressor;
+
+static void decompressor_free(decompressor* d) {
+    if (d->inflater_ready) inflateEnd(&d->inflater);
+#ifdef ZDZEG_WITH_ZSTD
+    ZSTD_freeDCtx(d->zstd);
+#endif
+#ifdef ZDZEG_WITH_LZ4
+    if (d->lz4) LZ4F_freeDecompressionContext(d->lz4);
+#endif
+    memset(d, 0, sizeof(*d));
+}
+
+// Decompresses one complete stream of `codec` into `dst`, which must come out
+// exactly `dst_len` bytes long.
+static int decompress_stream(decompressor* d, int codec, const unsigned char* src, size_t src_len,
+                             unsigned char* dst, size_t dst_len) {
+#ifdef ZDZEG_WITH_ZSTD
+    if (codec == ZDZEG_CODEC_ZSTD) {
+        if (!d->zstd && !(d->zstd = ZSTD_createDCtx())) return ZDZEG_ERR_NOMEM;
+        size_t n = ZSTD_decompressDCtx(d->zstd, dst, dst_len, src, src_len);
+        return !ZSTD_isError(n) && n == dst_len ? ZDZEG_OK : ZDZEG_ERR_CORRUPT;
+    }
+#endif
+#ifdef ZDZEG_WITH_LZ4
+    if (codec == ZDZEG_CODEC_LZ4) {
+        if (!d->lz4 && LZ4F_isError(LZ4F_createDecompressionContext(&d->lz4, LZ4F_VERSION))) return ZDZEG_ERR_NOMEM;
+        size_t in_pos = 0, out_pos = 0, hint = 1;
+        while (hint != 0 && in_pos < src_len) {
+            size_t in_size = src_len - in_pos;
+            size_t out_size = dst_len - out_pos;
+            hint = LZ4F_decompress(d->lz4, dst + out_pos, &out_size, src + in_pos, &in_size, NULL);
+            if (LZ4F_isError(hint) || (in_size == 0 && out_size == 0)) break;
+            in_pos += in_size;
+            out_pos += out_size;
+        }
+        if (hint != 0 || out_pos != dst_len) {
+            // Leave the context ready for the next frame
+            LZ4F_resetDecompressionContext(d->lz4);
+            return ZDZEG_ERR_CORRUPT;
+        }
+        return ZDZEG_OK;
+    }
+#endif
+    if (codec != ZDZEG_CODEC_ZLIB) return ZDZEG_ERR_CODEC;
+    if (!d->inflater_ready) {
+        memset(&d->inflater, 0, sizeof(d->inflater));
+        int z_result = inflateInit(&d->inflater);
+        if (z_result != Z_OK) return z_result == Z_MEM_ERROR ? ZDZEG_ERR_NOMEM : ZDZEG_ERR_CORRUPT;
+        d->inflater_ready = 1;
+    } else if (inflateReset(&d->inflater) != Z_OK) {
+        return ZDZEG_ERR_CORRUPT;
+    }
+    // Like uncompress(), but with a context that survives from stream to stream
+    d->inflater.next_in = (Bytef*)src;
+    d->inflater.avail_in = (uInt)src_len;
+    d->inflater.next_out = dst;
+    d->inflater.avail_out = (uInt)dst_len;
+    int z_result = inflate(&d->inflater, Z_FINISH);
+    if (z_result == Z_MEM_ERROR) return ZDZEG_ERR_NOMEM;
+    return z_result == Z_STREAM_END && d->inflater.total_out == dst_len ? ZDZEG_OK : ZDZEG_ERR_CORRUPT;
+}
+
+// Inflates a version 1 file, whose decompressed size is not stored anywhere.
+// The output buffer grows as needed, so the data is only decompressed once.
+// Returns Z_OK and hands the buffer to the caller, or a zlib error code.
+static int inflate_v1(const unsigned char* data, unsigned long size, unsigned char** out, unsigned long* out_size) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    int z_result = inflateInit(&zs);
+    if (z_result != Z_OK) return z_result;
+    unsigned long capacity = size * 4 + 1024;
+    unsigned char* buf = malloc(capacity);
+    if (!buf) {
+        inflateEnd(&zs);
+        return Z_MEM_ERROR;
+    }
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = (uInt)size;
+    do {
+        if (zs.total_out == capacity) {
+            unsigned char* temp = realloc(buf, capacity * 2);
+            if (!temp) {
+                z_result = Z_MEM_ERROR;
+                break;
+            }
+            buf = temp;
+            capacity *= 2;
+        }
+        zs.next_out = buf + zs.total_out;
+        zs.avail_out = (uInt)(capacity - zs.total_out);
+        z_result = inflate(&zs, Z_NO_FLUSH);
+    } while (z_result == Z_OK);
+    if (z_result == Z_STREAM_END) {
+        z_result = Z_OK;
+    } else if (z_result == Z_OK || z_result == Z_BUF_ERROR) {
+        z_result = Z_DATA_ERROR; // truncated stream
+    }
+    *out_size = zs.total_out;
+    inflateEnd(&zs);
+    if (z_result != Z_OK) {
+        free(buf);
+        return z_result;
+    }
+    *out = buf;
+    return Z_OK;
+}
+
+// ARGB8888 colour of every quantized value, one table per sample slot of a
+// pixel. A pixel is the OR of its slots, so "full" images use all three
+// tables and the other channels only the first. Values a corrupt file might
+// contain beyond `levels` are clamped instead of read out of bounds.
+// With `index8` set, single-channel pixels are written as their one-byte
+// level instead and the tables go unused.
+typedef struct {
+    uint32_t lut[3][256];
+    int num_channels;
+    int index8;
+} argb_palette;
+
+static void build_palette(argb_palette* pal, int levels_val, int channel_idx) {
+    pal->num_channels = (channel_idx == ZDZEG_CHANNEL_FULL) ? 3 : 1;
+    pal->index8 = 0;
+    for (int i = 0; i < 256; ++i) {
+        int level = i < levels_val ? i : levels_val - 1;
+        uint32_t val = (unsigned char)((float)level * 255.0f / (levels_val - 1));
+        if (channel_idx == ZDZEG_CHANNEL_FULL) {
+            pal->lut[0][i] = 0xFF000000u | (val << 16);
+            pal->lut[1][i] = val << 8;
+            pal->lut[2][i] = val;
+        } else if (channel_idx == ZDZEG_CHANNEL_BW) {
+            pal->lut[0][i] = 0xFF000000u | (val << 16) | (val << 8) | val;
+        } else {
+            pal->lut[0][i] = 0xFF000000u | (val << (16 - 8 * channel_idx)); // 0 red, 1 green, 2 blue
+        }
+    }
+}
+
+// Cursor over a stream of 3-byte runs (value, big-endian 16-bit count), or
+// over the tokens of a packed stream when `bits` is non-zero.
+typedef struct {
+    const unsigned char* rle;
+    unsigned long len;
+    unsigned long pos;
+    unsigned char val;
+    unsigned long left; // values left in the current run or literal
+    int bits;           // bits per literal value, 0 for 3-byte runs
+    int literal;        // the current token is a literal
+    unsigned long bit_pos; // position of the next literal value, in bits
+} run_reader;
+
+// Starts reading the runs of `img` (or of one of its tiles) from `rle`.
+static void run_reader_init(run_reader* r, const unsigned char* rle, unsigned long len, const zdzeg_image* img) {
+    memset(r, 0, sizeof(*r));
+    r->rle = rle;
+    r->len = len;
+    r->bits = img->packed ? zdzeg_value_bits(img->levels) : 0;
+}
+
+// Residual mask of a filtered image, or 0 if its rows are not filtered.
+static unsigned char filter_mask(const zdzeg_image* img) {
+    return img->filtered ? (unsigned char)((1 << zdzeg_value_bits(img->levels)) - 1) : 0;
+}
+
+// Reads the next packed token. Returns 1 if the stream ended or is damaged.
+static int run_next_token(run_reader* r) {
+    uint64_t token = 0;
+    for (int shift = 0;; shift += 7) {
+        if (r->pos >= r->len || shift > 63) return 1;
+        unsigned char b = r->rle[r->pos++];
+        token |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) break;
+    }
+    uint64_t count = token >> 1;
+    if (count == 0 || count > UINT32_MAX) return 1;
+    r->literal = (int)(token & 1);
+    if (r->literal) {
+        uint64_t bytes = (count * r->bits + 7) / 8;
+        if (bytes > r->len - r->pos) return 1;
+        r->bit_pos = r->pos * 8;
+        r->pos += (unsigned long)bytes;
+    } else {
+        if (r->pos >= r->len) return 1;
+        r->val = r->rle[r->pos++];
+    }
+    r->left = (unsigned long)count;
+    return 0;
+}
+
+// Makes sure the current run has values left. Returns 1 if the stream ended.
+static inline int run_refill(run_reader* r) {
+    while (r->left == 0) {
+        if (r->bits) {
+            if (run_next_token(r)) return 1;
+            continue;
+        }
+        if (r->pos + 2 >= r->len) return 1;
+        r->literal = 0;
+        r->val = r->rle[r->pos];
+        r->left = (r->rle[r->pos + 1] << 8) | r->rle[r->pos + 2];
+        r->pos += 3;
+    }
+    return 0;
+}
+
+// Takes the next value of the current literal, which must have one left.
+static inline unsigned char literal_next(run_reader* r) {
+    const unsigned char* p = r->rle + (r->bit_pos >> 3);
+    int shift = (int)(r->bit_pos & 7);
+    unsigned int window = (unsigned int)p[0] << 8;
+    // Only touch the next byte when the value crosses into it
+    if (shift + r->bits > 8) window |= p[1];
+    r->bit_pos += r->bits;
+    return (unsigned char)((window >> (16 - r->bits - shift)) & ((1u << r->bits) - 1));
+}
+
+// Skips `n` values. Returns 1 if the runs end first.
+static int runs_skip(run_reader* r, unsigned long n) {
+    while (n > 0) {
+        if (run_refill(r)) return 1;
+        unsigned long take = r->left < n ? r->left : n;
+        if (r->literal) r->bit_pos += take * r->bits;
+        r->left -= take;
+        n -= take;
+    }
+    return 0;
+}
+
+// Expands the next `n` values into `dst`. Returns 1 if the runs end first.
+static int runs_read_samples(run_reader* r, unsigned char* dst, unsigned long n) {
+    while (n > 0) {
+        if (run_refill(r)) return 1;
+        unsigned long take = r->left < n ? r->left : n;
+        if (r->literal) {
+            for (unsigned long i = 0; i < take; ++i) dst[i] = literal_next(r);
+        } else {
+            memset(dst, r->val, take);
+        }
+        dst += take;
+        r->left -= take;
+        n -= take;
+    }
+    return 0;
+}
+
+// Expands the next `n` single-sample pixels straight to ARGB through `lut`,
+// filling each run with one 32-bit colour. Returns 1 if the runs end first.
+static int runs_read_argb(run_reader* r, uint32_t* dst, unsigned long n, const uint32_t* lut) {
+    while (n > 0) {
+        if (run_refill(r)) return 1;
+        unsigned long take = r->left < n ? r->left : n;
+        if (r->literal) {
+            for (unsigned long i = 0; i < take; ++i) dst[i] = lut[literal_next(r)];
+        } else {
+            uint32_t color = lut[r->val];
+            for (unsigned long i = 0; i < take; ++i) dst[i] = color;
+        }
+        dst += take;
+        r->left -= take;
+        n -= take;
+    }
+    return 0;
+}
+
+// Reverses a row filter in place: `row` holds the residuals on entry and the
+// values on return. `prev` is the row above, or NULL for the first row.
+static void unfilter_row(int type, unsigned char* row, const unsigned char* prev, size_t n, int bpp, unsigned char mask) {
+    switch (type) {
+        case ZDZEG_ROW_FILTER_NONE:
+            break;
+        case ZDZEG_ROW_FILTER_SUB:
+            for (size_t i = bpp; i < n; ++i) row[i] = (row[i] + row[i - bpp]) & mask;
+            break;
+        case ZDZEG_ROW_FILTER_UP:
+            if (!prev) break;
+            for (size_t i = 0; i < n; ++i) row[i] = (row[i] + prev[i]) & mask;
+            break;
+        case ZDZEG_ROW_FILTER_AVERAGE:
+            for (size_t i = 0; i < n; ++i) {
+                int a = i >= (size_t)bpp ? row[i - bpp] : 0;
+                int b = prev ? prev[i] : 0;
+                row[i] = (row[i] + ((a + b) >> 1)) & mask;
+            }
+            break;
+        default: // ZDZEG_ROW_FILTER_PAETH
+            for (size_t i = 0; i < n; ++i) {
+                int a = i >= (size_t)bpp ? row[i - bpp] : 0;
+                int b = prev ? prev[i] : 0;
+                int c = prev && i >= (size_t)bpp ? prev[i - bpp] : 0;
+                row[i] = (row[i] + zdzeg_paeth(a, b, c)) & mask;
+            }
+            break;
+    }
+}
+
+// Filtered version of decode_block_argb. Predictions need whole rows, so
+// every row is expanded and unfiltered in full before the part inside the
+// clip is converted. `row_samples` needs 2 * bw * 3 bytes.
+static int decode_filtered_block_argb(run_reader* r, int x0, int y0, int bw, int bh, const argb_palette* pal, unsigned char mask,
+                                      const zdzeg_rect* clip, uint8_t* pixels, int pitch, unsigned char* row_samples) {
+    int nch = pal->num_channels;
+    int cx0 = x0 > clip->x ? x0 : clip->x;
+    int cx1 = x0 + bw < clip->x + clip->w ? x0 + bw : clip->x + clip->w;
+    unsigned long row_len = (unsigned long)bw * nch;
+    unsigned char* row = row_samples;
+    unsigned char* prev = row_samples + row_len;
+    // Rows below the clip are never needed
+    int y_end = y0 + bh < clip->y + clip->h ? y0 + bh : clip->y + clip->h;
+    for (int y = y0; y < y_end; ++y) {
+        unsigned char type;
+        if (runs_read_samples(r, &type, 1) || type >= ZDZEG_ROW_FILTER_COUNT) return 1;
+        if (runs_read_samples(r, row, row_len)) return 1;
+        unfilter_row(type, row, y > y0 ? prev : NULL, row_len, nch, mask);
+        if (y >= clip->y && cx0 < cx1) {
+            uint8_t* out_row = pixels + (size_t)(y - clip->y) * pitch;
+            uint32_t* out = (uint32_t*)out_row + (cx0 - clip->x);
+            const unsigned char* in = row + (size_t)(cx0 - x0) * nch;
+            unsigned long n = (unsigned long)(cx1 - cx0);
+            if (pal->index8) {
+                memcpy(out_row + (cx0 - clip->x), in, n);
+            } else if (nch == 1) {
+                for (unsigned long i = 0; i < n; ++i) out[i] = pal->lut[0][in[i]];
+            } else {
+                for (unsigned long i = 0; i < n; ++i) {
+                    out[i] = pal->lut[0][in[i*3]] | pal->lut[1][in[i*3+1]] | pal->lut[2][in[i*3+2]];
+                }
+            }
+        }
+        unsigned char* temp = prev;
+        prev = row;
+        row = temp;
+    }
+    return 0;
+}
+
+// Decodes a block of `bw` x `bh` pixels whose top-left corner is (x0, y0) in
+// the image - the whole image or one tile - from its runs, writing the part
+// inside `clip` to `pixels`, which holds the clip rectangle with `pitch` bytes
+// per row. `row_samples` needs clip->w * 3 bytes for "full" images, or
+// 2 * bw * 3 bytes when the rows are filtered (`mask` is then non-zero).
+// Returns 0 on success, 1 if the runs end early.
+static int decode_block_argb(run_reader* r, int x0, int y0, int bw, int bh, const argb_palette* pal, unsigned char mask,
+                      const zdzeg_rect* clip, uint8_t* pixels, int pitch, unsigned char* row_samples) {
+    if (mask) return decode_filtered_block_argb(r, x0, y0, bw, bh, pal, mask, clip, pixels, pitch, row_samples);
+    int nch = pal->num_channels;
+    int cx0 = x0 > clip->x ? x0 : clip->x;
+    int cx1 = x0 + bw < clip->x + clip->w ? x0 + bw : clip->x + clip->w;
+    unsigned long row_len = (unsigned long)bw * nch;
+    for (int y = y0; y < y0 + bh; ++y) {
+        if (y < clip->y || y >= clip->y + clip->h || cx0 >= cx1) {
+            if (runs_skip(r, row_len)) return 1;
+            continue;
+        }
+        uint8_t* out_row = pixels + (size_t)(y - clip->y) * pitch;
+        uint32_t* out = (uint32_t*)out_row + (cx0 - clip->x);
+        unsigned long n = (unsigned long)(cx1 - cx0);
+        if (runs_skip(r, (unsigned long)(cx0 - x0) * nch)) return 1;
+        if (pal->index8) {
+            if (runs_read_samples(r, out_row + (cx0 - clip->x), n)) return 1;
+        } else if (nch == 1) {
+            if (runs_read_argb(r, out, n, pal->lut[0])) return 1;
+        } else {
+            if (runs_read_samples(r, row_samples, n * 3)) return 1;
+            for (unsigned long i = 0; i < n; ++i) {
+                out[i] = pal->lut[0][row_samples[i*3]] | pal->lut[1][row_samples[i*3+1]] | pal->lut[2][row_samples[i*3+2]];
+            }
+        }
+        if (runs_skip(r, (unsigned long)(x0 + bw - cx1) * nch)) return 1;
+    }
+    return 0;
+}
+
+// Helper function to get a value from a filename, e.g., "16"
+static int get_levels_from_filename(const char* filename) {
+    char temp_filename[256];
+    strncpy(temp_filename, filename, sizeof(temp_filename) - 1);
+    temp_filename[sizeof(temp_filename) - 1] = '\0';
+    char* ext_pos = strrchr(temp_filename, '.');
+    if (ext_pos) {
+        *ext_pos = '\0';
+    }
+    char* save = NULL;
+    char* token = strtok_r(temp_filename, "_", &save);
+    while (token != NULL) {
+        int val = atoi(token);
+        if (val != 0) {
+            return val;
+        }
+        token = strtok_r(NULL, "_", &save);
+    }
+    return 16;
+}
+
+// Helper function to get channel from filename
+static int get_channel_from_filename(const char* filename, const char** keywords, int num_keywords) {
+    char temp_filename[256];
+    strncpy(temp_filename, filename, sizeof(temp_filename) - 1);
+    temp_filename[sizeof(temp_filename) - 1] = '\0';
+    char* ext_pos = strrchr(temp_filename, '.');
+    if (ext_pos) {
+        *ext_pos = '\0';
+    }
+    char* save = NULL;
+    char* token = strtok_r(temp_filename, "_", &save);
+    while (token != NULL) {
+        for (int i = 0; i < num_keywords; ++i) {
+            if (strcmp(token, keywords[i]) == 0) {
+                return i;
+            }
+        }
+        token = strtok_r(NULL, "_", &save);
+    }
+    return 4;
+}
+
+// Finds the pyramid directory at the end of a file whose header has
+// ZDZEG_FLAG_PYRAMID. Stores the level count and a pointer to the first
+// entry, and checks that the levels lie in order after the image's header.
+// Returns ZDZEG_OK or ZDZEG_ERR_CORRUPT.
+static int read_pyramid(const unsigned char* data, size_t size, int* count, const unsigned char** entries) {
+    if (size < ZDZEG_HEADER_SIZE + ZDZEG_PYRAMID_FOOTER_SIZE) return ZDZEG_ERR_CORRUPT;
+    const unsigned char* footer = data + size - ZDZEG_PYRAMID_FOOTER_SIZE;
+    uint32_t levels = zdzeg_get_be32(footer);
+    if (memcmp(footer + 4, ZDZEG_PYRAMID_MAGIC, 4) != 0 || levels < 1 || levels > ZDZEG_PYRAMID_MAX) return ZDZEG_ERR_CORRUPT;
+    size_t dir_size = (size_t)levels * ZDZEG_PYRAMID_ENTRY_SIZE;
+    if (size - ZDZEG_HEADER_SIZE - ZDZEG_PYRAMID_FOOTER_SIZE < dir_size) return ZDZEG_ERR_CORRUPT;
+    const unsigned char* dir = footer - dir_size;
+    uint64_t end = ZDZEG_HEADER_SIZE;
+    for (uint32_t k = 0; k < levels; ++k) {
+        uint64_t offset = zdzeg_get_be64(dir + k * ZDZEG_PYRAMID_ENTRY_SIZE);
+        uint64_t level_size = zdzeg_get_be64(dir + k * ZDZEG_PYRAMID_ENTRY_SIZE + 8);
+        // Check the offset first so the subtraction below can't wrap
+        if (offset < end || offset > (uint64_t)(dir - data) || level_size > (uint64_t)(dir - data) - offset) {
+            return ZDZEG_ERR_CORRUPT;
+        }
+        end = offset + level_size;
+    }
+    *count = (int)levels;
+    *entries = dir;
+    return ZDZEG_OK;
+}
+
+// Parses the file already in img->file. `name` supplies the levels and
+// channel of version 1 files.
+static int parse_zdzeg_data(const char* name, zdzeg_image* img) {
+    const unsigned char* compressed_data = img->data;
+    unsigned long compressed_size = img->size;
+
+    zdzeg_header hdr;
+    int header_result = zdzeg_read_header(compressed_data, compressed_size, &hdr);
+    if (header_result < 0) return ZDZEG_ERR_CORRUPT;
+    if (header_result > 0) {
+        // Version 2: everything comes from the header and the payload size is
+        // exact, so allocate once and inflate once.
+        img->width = hdr.width;
+        img->height = hdr.height;
+        img->levels = hdr.levels;
+        img->channel = hdr.channel;
+        img->codec = hdr.codec;
+        img->tiled = (hdr.flags & ZDZEG_FLAG_TILED) != 0;
+        img->packed = (hdr.flags & ZDZEG_FLAG_PACKED) != 0;
+        img->filtered = (hdr.flags & ZDZEG_FLAG_FILTERED) != 0;
+        if (hdr.flags & ZDZEG_FLAG_PYRAMID) {
+            // The image's own streams end where the first level starts
+            const unsigned char* entries;
+            if (read_pyramid(compressed_data, compressed_size, &img->pyramid_levels, &entries) != ZDZEG_OK) {
+                return ZDZEG_ERR_CORRUPT;
+            }
+            uint64_t first_level = zdzeg_get_be64(entries);
+            if (first_level < ZDZEG_HEADER_SIZE || first_level > compressed_size) return ZDZEG_ERR_CORRUPT;
+            compressed_size = (unsigned long)first_level;
+        }
+        // Filtered rows add one value per row of every tile, so at most one per pixel
+        uint64_t filter_values = img->filtered ? (img->tiled ? (uint64_t)hdr.width : 1) : 0;
+        uint64_t max_payload = ((uint64_t)hdr.width * (hdr.channel == ZDZEG_CHANNEL_FULL ? 3 : 1) + filter_values) * hdr.height * 3;
+        if ((!img->packed && hdr.payload_size % 3 != 0) || hdr.payload_size > max_payload) return ZDZEG_ERR_CORRUPT;
+        if (!zdzeg_codec_available(img->codec)) return ZDZEG_ERR_CODEC;
+        if (!img->tiled) {
+            unsigned long raw_rle_len = (unsigned long)hdr.payload_size;
+            img->payload = malloc(raw_rle_len ? raw_rle_len : 1);
+            if (!img->payload) return ZDZEG_ERR_NOMEM;
+            decompressor d;
+            memset(&d, 0, sizeof(d));
+            int result = decompress_stream(&d, img->codec, compressed_data + ZDZEG_HEADER_SIZE, compressed_size - ZDZEG_HEADER_SIZE,
+                                           img->payload, raw_rle_len);
+            decompressor_free(&d);
+            if (result != ZDZEG_OK) return result;
+            img->rle = img->payload;
+            img->rle_len = raw_rle_len;
+        }
+    } else {
+        // Version 1: width and height lead the compressed data, levels and
+        // channel come from the file name.
+        unsigned long uncompressed_size = 0;
+        int z_result = inflate_v1(compressed_data, compressed_size, &img->payload, &uncompressed_size);
+        if (z_result == Z_MEM_ERROR) return ZDZEG_ERR_NOMEM;
+        if (z_result != Z_OK) return ZDZEG_ERR_CORRUPT;
+        unsigned char* uncompressed_data = img->payload;
+        if (uncompressed_size < 8) return ZDZEG_ERR_CORRUPT;
+        int w = (uncompressed_data[0] << 24) | (uncompressed_data[1] << 16) | (uncompressed_data[2] << 8) | uncompressed_data[3];
+        int h = (uncompressed_data[4] << 24) | (uncompressed_data[5] << 16) | (uncompressed_data[6] << 8) | uncompressed_data[7];
+        if (w <= 0 || h <= 0) return ZDZEG_ERR_CORRUPT;
+        const char* channels[] = {"red", "green", "blue", "full", "bw"};
+        if (!name) name = "";
+        const char* filename = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+        img->width = w;
+        img->height = h;
+        img->channel = get_channel_from_filename(filename, channels, 5);
+        img->levels = get_levels_from_filename(filename);
+        if (img->levels < 2 || img->levels > 256) img->levels = 16;
+        img->rle = uncompressed_data + 8;
+        img->rle_len = uncompressed_size - 8;
+        // The whole-file zlib stream is no longer needed
+        zdzeg_unmap_file(&img->file);
+        img->data = NULL;
+        img->size = 0;
+    }
+    if (img->level == 0) {
+        img->full_width = img->width;
+        img->full_height = img->height;
+    }
+    return ZDZEG_OK;
+}
+
+void zdzeg_close(zdzeg_image* img) {
+    zdzeg_unmap_file(&img->file);
+    free(img->payload);
+    memset(img, 0, sizeof(*img));
+}
+
+// Closes the image again if parse_zdzeg_data fails.
+static int parse_zdzeg(const char* name, zdzeg_image* img) {
+    int result = parse_zdzeg_data(name, img);
+    if (result != ZDZEG_OK) zdzeg_close(img);
+    return result;
+}
+
+int zdzeg_open(const char* filepath, zdzeg_image* img) {
+    memset(img, 0, sizeof(*img));
+    if (zdzeg_map_file(filepath, &img->file)) return ZDZEG_ERR_IO;
+    img->data = img->file.data;
+    img->size = img->file.size;
+    return parse_zdzeg(filepath, img);
+}
+
+// Points img->data at the coarsest pyramid level that still fits box_w x
+// box_h, picked from the header and pyramid directory alone.
+static void select_fit_level(int box_w, int box_h, zdzeg_image* img) {
+    zdzeg_header hdr;
+    const unsigned char* entries = NULL;
+    int count = 0;
+    if (zdzeg_read_header(img->data, img->size, &hdr) > 0 && (hdr.flags & ZDZEG_FLAG_PYRAMID) &&
+        read_pyramid(img->data, img->size, &count, &entries) == ZDZEG_OK) {
+        // Pixels needed along each side when the image fits the box
+        double scale_w = (double)box_w / hdr.width, scale_h = (double)box_h / hdr.height;
+        double scale = scale_w < scale_h ? scale_w : scale_h;
+        int level = 0;
+        while (level < count && zdzeg_level_size(hdr.width, level + 1) >= hdr.width * scale &&
+               zdzeg_level_size(hdr.height, level + 1) >= hdr.height * scale) {
+            level++;
+        }
+        if (level > 0) {
+            const unsigned char* entry = entries + (level - 1) * ZDZEG_PYRAMID_ENTRY_SIZE;
+            img->data += zdzeg_get_be64(entry);
+            img->size = (size_t)zdzeg_get_be64(entry + 8);
+            img->level = level;
+            img->pyramid_levels = count;
+            img->full_width = hdr.width;
+            img->full_height = hdr.height;
+        }
+    }
+}
+
+int zdzeg_open_fit(const char* filepath, int box_w, int box_h, zdzeg_image* img) {
+    memset(img, 0, sizeof(*img));
+    if (zdzeg_map_file(filepath, &img->file)) return ZDZEG_ERR_IO;
+    img->data = img->file.data;
+    img->size = img->file.size;
+    select_fit_level(box_w, box_h, img);
+    return parse_zdzeg(filepath, img);
+}
+
+int zdzeg_open_mem(const unsigned char* data, size_t size, const char* name, zdzeg_image* img) {
+    memset(img, 0, sizeof(*img));
+    zdzeg_borrow_memory(data, size, &img->file);
+    img->data = img->file.data;
+    img->size = img->file.size;
+    return parse_zdzeg(name, img);
+}
+
+// Shared state for decoding the tiles of one tiled file in parallel.
+typedef struct {
+    const zdzeg_image* img;
+    const argb_palette* pal;
+    int tile_w, tile_h, tiles_x;
+    int first_tx, first_ty, span_tx, span_ty; // tiles overlapping the clip
+    zdzeg_rect clip;
+    uint8_t* pixels; // the clip rectangle, `pitch` bytes per row
+    int pitch;
+    int next_tile;
+    int failed; // first error, or ZDZEG_OK
+    pthread_mutex_t lock;
+    int threaded; // lock is initialized
+} tile_decode_job;
+
+static void tile_job_fail(tile_decode_job* job, int err) {
+    if (job->threaded) pthread_mutex_lock(&job->lock);
+    if (!job->failed) job->failed = err;
+    if (job->threaded) pthread_mutex_unlock(&job->lock);
+}
+
+// Decoder thread: inflates tiles until none are left and decodes the part of
+// each tile inside the clip straight into the output. Tiles never overlap, so
+// the threads write disjoint pixels.
+static void* tile_decode_worker(void* data) {
+    tile_decode_job* job = (tile_decode_job*)data;
+    const zdzeg_image* img = job->img;
+    int nch = job->pal->num_channels;
+    unsigned char* row_samples = malloc((size_t)job->tile_w * 3 * (img->filtered ? 2 : 1));
+    unsigned char* payload = NULL;
+    unsigned long payload_cap = 0;
+    decompressor d;
+    memset(&d, 0, sizeof(d));
+    if (!row_samples) {
+        tile_job_fail(job, ZDZEG_ERR_NOMEM);
+        return NULL;
+    }
+    for (;;) {
+        int k = -1;
+        if (job->threaded) pthread_mutex_lock(&job->lock);
+        if (!job->failed && job->next_tile < job->span_tx * job->span_ty) k = job->next_tile++;
+        if (job->threaded) pthread_mutex_unlock(&job->lock);
+        if (k < 0) break;
+
+        int tx = job->first_tx + k % job->span_tx;
+        int ty = job->first_ty + k / job->span_tx;
+        int x0 = tx * job->tile_w;
+        int y0 = ty * job->tile_h;
+        int tw = img->width - x0 < job->tile_w ? img->width - x0 : job->tile_w;
+        int th = img->height - y0 < job->tile_h ? img->height - y0 : job->tile_h;
+        const unsigned char* entry = img->data + ZDZEG_HEADER_SIZE + ZDZEG_TILE_INFO_SIZE + ((size_t)ty * job->tiles_x + tx) * ZDZEG_TILE_ENTRY_SIZE;
+        uint64_t offset = zdzeg_get_be64(entry);
+        unsigned long compressed_size = zdzeg_get_be32(entry + 8);
+        unsigned long payload_size = zdzeg_get_be32(entry + 12);
+        if (offset > img->size || compressed_size > img->size - offset ||
+            (!img->packed && payload_size % 3 != 0) || payload_size > ((unsigned long)tw * nch + img->filtered) * th * 3) {
+            tile_job_fail(job, ZDZEG_ERR_CORRUPT);
+            break;
+        }
+        if (payload_size > payload_cap) {
+            unsigned char* temp = realloc(payload, payload_size);
+            if (!temp) {
+                tile_job_fail(job, ZDZEG_ERR_NOMEM);
+                break;
+            }
+            payload = temp;
+            payload_cap = payload_size;
+        }
+        int result = decompress_stream(&d, img->codec, img->data + offset, compressed_size,
+                                       payload ? payload : row_samples, payload_size);
+        run_reader r;
+        run_reader_init(&r, payload, payload_size, img);
+        if (result == ZDZEG_OK &&
+            decode_block_argb(&r, x0, y0, tw, th, job->pal, filter_mask(img), &job->clip, job->pixels, job->pitch, row_samples)) {
+            result = ZDZEG_ERR_CORRUPT;
+        }
+        if (result != ZDZEG_OK) {
+            tile_job_fail(job, result);
+            break;
+        }
+    }
+    decompressor_free(&d);
+    free(payload);
+    free(row_samples);
+    return NULL;
+}
+
+// Decodes the tiles of a tiled file that overlap `clip`, spreading them
+// across one thread per CPU core.
+static int decode_tiles_argb(const zdzeg_image* img, const argb_palette* pal, const zdzeg_rect* clip, uint8_t* pixels, int pitch) {
+    if (img->size < ZDZEG_HEADER_SIZE + ZDZEG_TILE_INFO_SIZE) return ZDZEG_ERR_CORRUPT;
+    tile_decode_job job;
+    memset(&job, 0, sizeof(job));
+    job.img = img;
+    job.pal = pal;
+    job.tile_w = (int)zdzeg_get_be32(img->data + ZDZEG_HEADER_SIZE);
+    job.tile_h = (int)zdzeg_get_be32(img->data + ZDZEG_HEADER_SIZE + 4);
+    if (job.tile_w <= 0 || job.tile_h <= 0 || job.tile_w > 4096 || job.tile_h > 4096) return ZDZEG_ERR_CORRUPT;
+    job.tiles_x = zdzeg_tile_count(img->width, job.tile_w);
+    uint64_t tile_count = (uint64_t)job.tiles_x * zdzeg_tile_count(img->height, job.tile_h);
+    if (tile_count > (img->size - ZDZEG_HEADER_SIZE - ZDZEG_TILE_INFO_SIZE) / ZDZEG_TILE_ENTRY_SIZE) return ZDZEG_ERR_CORRUPT;
+    job.clip = *clip;
+    job.pixels = pixels;
+    job.pitch = pitch;
+    job.first_tx = clip->x / job.tile_w;
+    job.first_ty = clip->y / job.tile_h;
+    job.span_tx = (clip->x + clip->w - 1) / job.tile_w - job.first_tx + 1;
+    job.span_ty = (clip->y + clip->h - 1) / job.tile_h - job.first_ty + 1;
+
+    int tiles = job.span_tx * job.span_ty;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int thread_count = cpus > 0 ? (int)cpus : 1;
+    if (thread_count > tiles) thread_count = tiles;
+    pthread_t threads[64];
+    if (thread_count > 64) thread_count = 64;
+    int started = 0;
+    if (thread_count > 1 && pthread_mutex_init(&job.lock, NULL) == 0) {
+        job.threaded = 1;
+        // The calling thread decodes too, so start one thread fewer.
+        for (int i = 0; i < thread_count - 1; ++i) {
+            if (pthread_create(&threads[started], NULL, tile_decode_worker, &job) == 0) started++;
+        }
+    }
+    tile_decode_worker(&job);
+    for (int i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+    if (job.threaded) pthread_mutex_destroy(&job.lock);
+    return job.failed;
+}
+
+// Decodes `region` to ARGB8888, or to one byte per pixel when `index8` is set.
+static int decode_region(const zdzeg_image* img, const zdzeg_rect* region, void* pixels, int pitch, int index8) {
+    if (region->x < 0 || region->y < 0 || region->w <= 0 || region->h <= 0 ||
+        region->x + region->w > img->width || region->y + region->h > img->height) {
+        return ZDZEG_ERR_PARAM;
+    }
+    argb_palette pal;
+    build_palette(&pal, img->levels, img->channel);
+    pal.index8 = index8;
+    if (img->tiled) return decode_tiles_argb(img, &pal, region, (uint8_t*)pixels, pitch);
+    unsigned char* row_samples = malloc(img->filtered ? (size_t)img->width * 3 * 2 : (size_t)region->w * 3);
+    if (!row_samples) return ZDZEG_ERR_NOMEM;
+    run_reader r;
+    run_reader_init(&r, img->rle, img->rle_len, img);
+    int failed = decode_block_argb(&r, 0, 0, img->width, img->height, &pal, filter_mask(img), region, (uint8_t*)pixels, pitch, row_samples);
+    free(row_samples);
+    return failed ? ZDZEG_ERR_CORRUPT : ZDZEG_OK;
+}
+
+int zdzeg_decode_argb(const zdzeg_image* img, const zdzeg_rect* region, void* pixels, int pitch) {
+    return decode_region(img, region, pixels, pitch, 0);
+}
+
+int zdzeg_decode_index8(const zdzeg_image* img, const zdzeg_rect* region, void* pixels, int pitch) {
+    if (img->channel == ZDZEG_CHANNEL_FULL) return ZDZEG_ERR_PARAM;
+    return decode_region(img, region, pixels, pitch, 1);
+}
+
+int zdzeg_palette(const zdzeg_image* img, uint32_t colors[256]) {
+    if (img->channel == ZDZEG_CHANNEL_FULL) return 0;
+    argb_palette pal;
+    build_palette(&pal, img->levels, img->channel);
+    memcpy(colors, pal.lut[0], sizeof(pal.lut[0]));
+    return img->levels;
+}
+
+int zdzeg_decode_mem(const unsigned char* data, size_t size, void* pixels, size_t pixels_cap, int pitch,
+                     int* out_w, int* out_h) {
+    zdzeg_image img;
+    int result = zdzeg_open_mem(data, size, NULL, &img);
+    if (result != ZDZEG_OK) return result;
+    *out_w = img.width;
+    *out_h = img.height;
+    if (pitch == 0) pitch = img.width * 4;
+    if (pitch < img.width * 4 || (uint64_t)pitch * (img.height - 1) + (uint64_t)img.width * 4 > pixels_cap) {
+        zdzeg_close(&img);
+        return ZDZEG_ERR_SPACE;
+    }
+    zdzeg_rect full = {0, 0, img.width, img.height};
+    result = zdzeg_decode_argb(&img, &full, pixels, pitch);
+    zdzeg_close(&img);
+    return result;
+}
+
+// --- Archives ---
+
+int zdzeg_pack_open(const char* filepath, zdzeg_pack* pack) {
+    memset(pack, 0, sizeof(*pack));
+    if (zdzeg_map_file(filepath, &pack->file)) return ZDZEG_ERR_IO;
+    // Members are read in whatever order they are viewed, not front to back
+    if (pack->file.source == ZDZEG_FILE_MAPPED) madvise((void*)pack->file.data, pack->file.size, MADV_NORMAL);
+    const unsigned char* data = pack->file.data;
+    size_t size = pack->file.size;
+    if (size < ZDZEG_PACK_HEADER_SIZE + ZDZEG_PACK_FOOTER_SIZE || memcmp(data, ZDZEG_PACK_MAGIC, 4) != 0 ||
+        data[4] != ZDZEG_PACK_VERSION || memcmp(data + size - 4, ZDZEG_PACK_MAGIC, 4) != 0) {
+        zdzeg_pack_close(pack);
+        return ZDZEG_ERR_CORRUPT;
+    }
+    const unsigned char* footer = data + size - ZDZEG_PACK_FOOTER_SIZE;
+    uint64_t index = zdzeg_get_be64(footer);
+    uint64_t count = zdzeg_get_be32(footer + 8);
+    uint64_t index_end = size - ZDZEG_PACK_FOOTER_SIZE;
+    if (index < ZDZEG_PACK_HEADER_SIZE || index > index_end || count > INT32_MAX ||
+        count * ZDZEG_PACK_ENTRY_SIZE > index_end - index) {
+        zdzeg_pack_close(pack);
+        return ZDZEG_ERR_CORRUPT;
+    }
+    pack->count = (int)count;
+    pack->entries = data + index;
+    pack->names = (const char*)pack->entries + count * ZDZEG_PACK_ENTRY_SIZE;
+    uint64_t names_size = index_end - index - count * ZDZEG_PACK_ENTRY_SIZE;
+
+    // Check every entry once, so lookups can trust the index
+    const char* previous = NULL;
+    for (int i = 0; i < pack->count; ++i) {
+        const unsigned char* e = pack->entries + (size_t)i * ZDZEG_PACK_ENTRY_SIZE;
+        uint64_t offset = zdzeg_get_be64(e), member_size = zdzeg_get_be64(e + 8);
+        uint64_t name_offset = zdzeg_get_be32(e + 24), name_len = (e[28] << 8) | e[29];
+        const char* name = pack->names + name_offset;
+        if (offset < ZDZEG_PACK_HEADER_SIZE || offset > index || member_size > index - offset ||
+            name_len == 0 || name_offset >= names_size || name_len >= names_size - name_offset ||
+            name[name_len] != '\0' || memchr(name, '\0', name_len) || (previous && strcmp(previous, name) >= 0)) {
+            zdzeg_pack_close(pack);
+            return ZDZEG_ERR_CORRUPT;
+        }
+        previous = name;
+    }
+    return ZDZEG_OK;
+}
+
+void zdzeg_pack_close(zdzeg_pack* pack) {
+    zdzeg_unmap_file(&pack->file);
+    memset(pack, 0, sizeof(*pack));
+}
+
+void zdzeg_pack_get(const zdzeg_pack* pack, int index, zdzeg_pack_entry* entry) {
+    const unsigned char* e = pack->entries + (size_t)index * ZDZEG_PACK_ENTRY_SIZE;
+    entry->name = pack->names + zdzeg_get_be32(e + 24);
+    entry->data = pack->file.data + zdzeg_get_be64(e);
+    entry->size = (size_t)zdzeg_get_be64(e + 8);
+    entry->width = (int)zdzeg_get_be32(e + 16);
+    entry->height = (int)zdzeg_get_be32(e + 20);
+    entry->levels = e[30];
+    entry->channel = e[31];
+}
+
+int zdzeg_pack_find(const zdzeg_pack* pack, const char* name) {
+    int lo = 0, hi = pack->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        const unsigned char* e = pack->entries + (size_t)mid * ZDZEG_PACK_ENTRY_SIZE;
+        int order = strcmp(pack->names + zdzeg_get_be32(e + 24), name);
+        if (order == 0) return mid;
+        if (order < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+int zdzeg_pack_open_image(const zdzeg_pack* pack, int index, int box_w, int box_h, zdzeg_image* img) {
+    if (index < 0 || index >= pack->count) return ZDZEG_ERR_PARAM;
+    zdzeg_pack_entry entry;
+    zdzeg_pack_get(pack, index, &entry);
+    memset(img, 0, sizeof(*img));
+    zdzeg_borrow_memory(entry.data, entry.size, &img->file);
+    img->data = img->file.data;
+    img->size = img->file.size;
+    if (box_w > 0 && box_h > 0) select_fit_level(box_w, box_h, img);
+    return parse_zdzeg(entry.name, img);
+}
+
+// A member added to an archive being written.
+typedef struct {
+    char* name;
+    uint64_t offset, size;
+    int width, height, levels, channel;
+} pack_member;
+
+struct zdzeg_pack_writer {
+    FILE* f;
+    uint64_t written; // bytes since the start of the archive
+    pack_member* members;
+    int count, capacity;
+    int error; // first error, or ZDZEG_OK
+};
+
+static void pack_write(zdzeg_pack_writer* writer, const void* data, size_t len) {
+    if (writer->error == ZDZEG_OK && fwrite(data, 1, len, writer->f) != len) writer->error = ZDZEG_ERR_IO;
+    writer->written += len;
+}
+
+zdzeg_pack_writer* zdzeg_pack_writer_create(FILE* f) {
+    zdzeg_pack_writer* writer = (zdzeg_pack_writer*)calloc(1, sizeof(zdzeg_pack_writer));
+    if (!writer) return NULL;
+    writer->f = f;
+    unsigned char header[ZDZEG_PACK_HEADER_SIZE] = {0};
+    memcpy(header, ZDZEG_PACK_MAGIC, 4);
+    header[4] = ZDZEG_PACK_VERSION;
+    pack_write(writer, header, sizeof(header));
+    return writer;
+}
+
+int zdzeg_pack_add(zdzeg_pack_writer* writer, const char* name, const unsigned char* data, size_t size) {
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len > 0xFFFF) return ZDZEG_ERR_PARAM;
+    if (writer->count == writer->capacity) {
+        int capacity = writer->capacity ? writer->capacity * 2 : 64;
+        pack_member* grown = (pack_member*)realloc(writer->members, capacity * sizeof(pack_member));
+        if (!grown) {
+            if (!writer->error) writer->error = ZDZEG_ERR_NOMEM;
+            return ZDZEG_ERR_NOMEM;
+        }
+        writer->members = grown;
+        writer->capacity = capacity;
+    }
+    pack_member* m = &writer->members[writer->count];
+    memset(m, 0, sizeof(*m));
+    m->name = strdup(name);
+    if (!m->name) {
+        if (!writer->error) writer->error = ZDZEG_ERR_NOMEM;
+        return ZDZEG_ERR_NOMEM;
+    }
+    zdzeg_header hdr;
+    if (zdzeg_read_header(data, size, &hdr) > 0) {
+        m->width = hdr.width;
+        m->height = hdr.height;
+        m->levels = hdr.levels;
+        m->channel = hdr.channel;
+    }
+    m->offset = writer->written;
+    m->size = size;
+    writer->count++;
+    pack_write(writer, data, size);
+    return writer->error;
+}
+
+static int compare_members(const void* a, const void* b) {
+    return strcmp(((const pack_member*)a)->name, ((const pack_member*)b)->name);
+}
+
+int zdzeg_pack_finish(zdzeg_pack_writer* writer) {
+    qsort(writer->members, writer->count, sizeof(pack_member), compare_members);
+    uint64_t names_size = 0;
+    for (int i = 0; i < writer->count; ++i) {
+        if (i > 0 && strcmp(writer->members[i - 1].name, writer->members[i].name) == 0 && !writer->error) {
+            writer->error = ZDZEG_ERR_PARAM;
+        }
+        names_size += strlen(writer->members[i].name) + 1;
+    }
+    // Name offsets are 32-bit
+    if (names_size > UINT32_MAX && !writer->error) writer->error = ZDZEG_ERR_PARAM;
+    uint64_t index = writer->written;
+    uint32_t name_offset = 0;
+    for (int i = 0; i < writer->count && !writer->error; ++i) {
+        const pack_member* m = &writer->members[i];
+        size_t name_len = strlen(m->name);
+        unsigned char e[ZDZEG_PACK_ENTRY_SIZE];
+        zdzeg_put_be64(e, m->offset);
+        zdzeg_put_be64(e + 8, m->size);
+        zdzeg_put_be32(e + 16, (uint32_t)m->width);
+        zdzeg_put_be32(e + 20, (uint32_t)m->height);
+        zdzeg_put_be32(e + 24, name_offset);
+        e[28] = (unsigned char)(name_len >> 8);
+        e[29] = (unsigned char)name_len;
+        e[30] = (unsigned char)m->levels;
+        e[31] = (unsigned char)m->channel;
+        pack_write(writer, e, sizeof(e));
+        name_offset += (uint32_t)name_len + 1;
+    }
+    for (int i = 0; i < writer->count && !writer->error; ++i) {
+        pack_write(writer, writer->members[i].name, strlen(writer->members[i].name) + 1);
+    }
+    unsigned char footer[ZDZEG_PACK_FOOTER_SIZE];
+    zdzeg_put_be64(footer, index);
+    zdzeg_put_be32(footer + 8, (uint32_t)writer->count);
+    memcpy(footer + 12, ZDZEG_PACK_MAGIC, 4);
+    pack_write(writer, footer, sizeof(footer));
+
+    int result = writer->error;
+    for (int i = 0; i < writer->count; ++i) free(writer->members[i].name);
+    free(writer->members);
+    free(writer);
+    return result;
+}
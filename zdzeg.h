@@ -0,0 +1,218 @@
+// libzdzeg: encodes and decodes .zdzeg images in memory. It depends only on
+// zlib and pthreads, so it can be linked into programs without SDL. Building
+// it with -DZDZEG_WITH_ZSTD (and -lzstd) or -DZDZEG_WITH_LZ4 (and -llz4) adds
+// those compression codecs.
+#ifndef ZDZEG_H
+#define ZDZEG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "zdzeg_format.h"
+#include "zdzeg_io.h"
+
+// Every function returns ZDZEG_OK on success or one of these error codes.
+#define ZDZEG_OK 0
+#define ZDZEG_ERR_PARAM 1   // invalid levels, channel, tile size or region
+#define ZDZEG_ERR_NOMEM 2   // a memory allocation failed
+#define ZDZEG_ERR_IO 3      // reading or writing a file failed
+#define ZDZEG_ERR_SPACE 4   // the output buffer is too small
+#define ZDZEG_ERR_CORRUPT 5 // not a .zdzeg file, or its data is damaged
+#define ZDZEG_ERR_COMPRESS 6 // the compressor failed
+#define ZDZEG_ERR_CODEC 7    // the compression codec is not built into this library
+
+// Short description of an error code, for messages.
+const char* zdzeg_strerror(int err);
+
+// Name of a ZDZEG_CODEC_* value ("zlib", "zstd" or "lz4").
+const char* zdzeg_codec_name(int codec);
+
+// Parses "name" or "name:level" (for example "zstd:19") into a codec and a
+// compression level (0 when none is given). Returns ZDZEG_OK, ZDZEG_ERR_PARAM
+// for an unknown name or ZDZEG_ERR_CODEC if the codec is not built in.
+int zdzeg_codec_parse(const char* spec, int* codec, int* level);
+
+// 1 if files using `codec` can be encoded and decoded by this build.
+int zdzeg_codec_available(int codec);
+
+typedef struct {
+    int x, y, w, h;
+} zdzeg_rect;
+
+// --- Encoding ---
+// Input images are RGB24: three bytes per pixel, rows `pitch` bytes apart.
+
+// How the quantized values are coded before compression.
+#define ZDZEG_CODING_PACKED 0 // varint runs and bit-packed literals (the default)
+#define ZDZEG_CODING_RUNS 1   // fixed 3-byte runs, readable by older viewers
+
+// Auto-tuning: instead of compressing at one setting, the encoder races
+// several deflate level and strategy combinations on every stream (zlib
+// only) and keeps the output that best fits the policy.
+#define ZDZEG_TUNE_OFF 0
+#define ZDZEG_TUNE_SMALLEST 1    // the smallest output
+#define ZDZEG_TUNE_FAST_DECODE 2 // the fastest to inflate within tune_slack percent of the smallest
+
+// Whether rows are predicted before they are run coded.
+#define ZDZEG_ROW_FILTERS_AUTO 0 // pick the best filter for every row (the default)
+#define ZDZEG_ROW_FILTERS_OFF 1  // store the quantized values as they are
+
+typedef struct {
+    int levels;      // quantization levels per channel, 4-32
+    int channel;     // ZDZEG_CHANNEL_*
+    int tile_size;   // 0 for one stream, or 1-4096 for square tiles
+    int coding;      // ZDZEG_CODING_*
+    int row_filters; // ZDZEG_ROW_FILTERS_*
+    int codec;       // ZDZEG_CODEC_*
+    int level;       // compression level (zlib 1-9, zstd 1-22, lz4 1-12), 0 for the codec's default
+    int tune;        // ZDZEG_TUNE_*; replaces `level` when on
+    int tune_slack;  // size margin in percent for ZDZEG_TUNE_FAST_DECODE
+    int pyramid;     // reduced levels (1/2, 1/4, ...) to store, 0-ZDZEG_PYRAMID_MAX
+} zdzeg_params;
+
+// Scratch buffers and a deflate stream reused from image to image. An
+// encoder must only be used by one thread at a time; the encode functions
+// also accept NULL and then use a temporary one.
+typedef struct zdzeg_encoder zdzeg_encoder;
+
+zdzeg_encoder* zdzeg_encoder_create(void);
+void zdzeg_encoder_free(zdzeg_encoder* enc);
+
+// Describes the combination auto-tuning picked for the last image the
+// encoder wrote, such as "level 9, rle" (for tiled files, the one that won
+// the most tiles), or returns NULL if that image was not tuned.
+const char* zdzeg_encoder_tuning(const zdzeg_encoder* enc);
+
+// Largest file zdzeg_encode_mem can produce for an image of this size.
+size_t zdzeg_encode_bound(int width, int height, const zdzeg_params* params);
+
+// Encodes an image into `out`, which holds `out_cap` bytes, and stores the
+// file size in *out_len. A buffer of zdzeg_encode_bound bytes always fits;
+// with a smaller one the call can fail with ZDZEG_ERR_SPACE.
+int zdzeg_encode_mem(zdzeg_encoder* enc, const unsigned char* rgb, int width, int height, int pitch,
+                     const zdzeg_params* params, unsigned char* out, size_t out_cap, size_t* out_len);
+
+// Encodes an image into a seekable stream, writing compressed data as it is
+// produced. The file starts at the stream's current position, and the stream
+// is left positioned at its end.
+int zdzeg_encode_file(zdzeg_encoder* enc, const unsigned char* rgb, int width, int height, int pitch,
+                      const zdzeg_params* params, FILE* f);
+
+// --- Decoding ---
+// Decoded pixels are ARGB8888: one native-endian 32-bit 0xAARRGGBB value per
+// pixel, the format SDL calls SDL_PIXELFORMAT_ARGB8888. Opening and decoding
+// keep no shared state, so any number of threads can call them at once.
+
+// An opened .zdzeg file with its header parsed. For untiled files the RLE
+// payload is already inflated; tiled files inflate tile by tile on decode.
+// When a reduced pyramid level was opened, width and height are that
+// level's size and full_width and full_height the image's.
+typedef struct {
+    zdzeg_mapped_file file;
+    const unsigned char* data; // the opened level within the file
+    size_t size;
+    int width, height, levels, channel;
+    int full_width, full_height;
+    int level;          // pyramid level opened, 0 for the image itself
+    int pyramid_levels; // reduced levels the file stores
+    int codec; // ZDZEG_CODEC_* of the compressed streams
+    int tiled;
+    int packed;   // payload uses ZDZEG_CODING_PACKED
+    int filtered; // rows carry a ZDZEG_ROW_FILTER_* type and residuals
+    unsigned char* payload; // inflated data for untiled files
+    const unsigned char* rle;
+    unsigned long rle_len;
+} zdzeg_image;
+
+// Opens a file by memory-mapping it.
+int zdzeg_open(const char* filepath, zdzeg_image* img);
+
+// Opens the coarsest pyramid level that still has at least as many pixels
+// as the image shown scaled to fit inside box_w x box_h, or the image itself
+// when the box needs full resolution or the file has no pyramid. Only that
+// level is read and inflated.
+int zdzeg_open_fit(const char* filepath, int box_w, int box_h, zdzeg_image* img);
+
+// Opens a file that is already in memory; `data` must outlive the image.
+// `name` is only used for version 1 files, whose levels and channel are
+// taken from the file name (it may be NULL).
+int zdzeg_open_mem(const unsigned char* data, size_t size, const char* name, zdzeg_image* img);
+
+void zdzeg_close(zdzeg_image* img);
+
+// Decodes the part of the image inside `region`, which must lie within the
+// image, into `pixels`: region->h rows of region->w pixels, `pitch` bytes
+// apart. Tiles of a tiled file are decoded in parallel, and only the tiles
+// overlapping the region are inflated.
+int zdzeg_decode_argb(const zdzeg_image* img, const zdzeg_rect* region, void* pixels, int pitch);
+
+// Like zdzeg_decode_argb for single-channel images (bw, red, green, blue),
+// but writes one byte per pixel: its quantization level, which indexes the
+// table from zdzeg_palette. A quarter of the writes of ARGB output. Returns
+// ZDZEG_ERR_PARAM for "full" images.
+int zdzeg_decode_index8(const zdzeg_image* img, const zdzeg_rect* region, void* pixels, int pitch);
+
+// Fills colors[] with the ARGB8888 colour of every byte zdzeg_decode_index8
+// can write (entries past the image's levels repeat the brightest) and
+// returns the number of levels, or 0 for "full" images, which have no palette.
+int zdzeg_palette(const zdzeg_image* img, uint32_t colors[256]);
+
+// Decodes a whole file held in memory into `pixels` (`pixels_cap` bytes,
+// rows `pitch` bytes apart, or width * 4 when pitch is 0). The image size is
+// stored in *out_w and *out_h even when the buffer turns out to be too small
+// (ZDZEG_ERR_SPACE), so callers can size the buffer and call again.
+int zdzeg_decode_mem(const unsigned char* data, size_t size, void* pixels, size_t pixels_cap, int pitch,
+                     int* out_w, int* out_h);
+
+// --- Archives ---
+// A .zdzpack archive is mapped once and its index checked when it is
+// opened; after that, finding a member and opening it only read the mapping.
+
+typedef struct {
+    zdzeg_mapped_file file;
+    int count;
+    const unsigned char* entries; // `count` index entries, sorted by name
+    const char* names;
+} zdzeg_pack;
+
+// One member of an archive. `name` and `data` point into the mapping.
+typedef struct {
+    const char* name;
+    const unsigned char* data;
+    size_t size;
+    int width, height, levels, channel; // from the member's header, 0 for v1 members
+} zdzeg_pack_entry;
+
+// Maps an archive and validates its index.
+int zdzeg_pack_open(const char* filepath, zdzeg_pack* pack);
+
+void zdzeg_pack_close(zdzeg_pack* pack);
+
+// Fills *entry with member `index`, 0 to count - 1, in name order.
+void zdzeg_pack_get(const zdzeg_pack* pack, int index, zdzeg_pack_entry* entry);
+
+// Index of the member called `name`, or -1 if there is none.
+int zdzeg_pack_find(const zdzeg_pack* pack, const char* name);
+
+// Opens member `index` like zdzeg_open_fit, or at full resolution when
+// box_w or box_h is 0. The image borrows the mapping, so the archive must
+// stay open until the image is closed.
+int zdzeg_pack_open_image(const zdzeg_pack* pack, int index, int box_w, int box_h, zdzeg_image* img);
+
+// Writes an archive member by member. The stream needn't be seekable: data
+// goes out as it is added and the index is written by zdzeg_pack_finish.
+typedef struct zdzeg_pack_writer zdzeg_pack_writer;
+
+// Starts an archive at the current position of `f`. Returns NULL when out
+// of memory.
+zdzeg_pack_writer* zdzeg_pack_writer_create(FILE* f);
+
+// Appends one .zdzeg file under `name`, which must be unique in the archive.
+int zdzeg_pack_add(zdzeg_pack_writer* writer, const char* name, const unsigned char* data, size_t size);
+
+// Writes the index and frees the writer. Returns the first error of the
+// archive, so a failed zdzeg_pack_add can be checked here.
+int zdzeg_pack_finish(zdzeg_pack_writer* writer);
+
+#endif
@@ -0,0 +1,232 @@
+// Shared description of the .zdzeg file layout, used by the encoder and the viewer.
+#ifndef ZDZEG_FORMAT_H
+#define ZDZEG_FORMAT_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Version 2 files start with an uncompressed header, all fields big-endian:
+//   0  magic "ZDZG"
+//   4  version (2)
+//   5  levels (4-32)
+//   6  channel (0 red, 1 green, 2 blue, 3 full, 4 bw)
+//   7  flags (ZDZEG_FLAG_*) in the low 4 bits, compression codec
+//      (ZDZEG_CODEC_*) in the high 4 bits
+//   8  width
+//  12  height
+//  16  payload size: exact length of the decompressed RLE stream (64-bit)
+//  24  compressed stream of the RLE payload
+//
+// Tiled files (ZDZEG_FLAG_TILED) follow the header with a tile directory:
+//  24  tile width
+//  28  tile height
+//  32  one 16-byte entry per tile, tiles in row-major order:
+//        offset of the tile's stream from the start of the file (64-bit)
+//        compressed size of the tile (32-bit)
+//        payload size of the tile (32-bit)
+// and then the tile streams. Each tile is run-length encoded on its own, row
+// by row within the tile, and compressed as an independent stream, so
+// tiles can be decoded in parallel or only where they are needed. Edge tiles
+// are cropped to the image. The header's payload size is the sum over tiles.
+//
+// Every compressed stream is a complete zlib stream, zstd frame or LZ4 frame,
+// depending on the codec. Files written before codecs existed have 0 there,
+// which is zlib.
+//
+// Packed files (ZDZEG_FLAG_PACKED) replace the 3-byte runs with a compact
+// token stream. Every token starts with a LEB128 varint (7 bits per byte,
+// low bits first, high bit set on all but the last byte) holding
+// (count << 1) | literal:
+//   literal 0: a run of `count` copies of the value in the next byte
+//   literal 1: `count` values bit-packed at zdzeg_value_bits(levels) bits
+//              each, most significant bit first, padded to a whole byte
+// Runs carry over row boundaries as before; count is never 0. Tiles of a
+// tiled file use the same coding, each starting with a fresh token.
+//
+// Filtered files (ZDZEG_FLAG_FILTERED) predict every row before it is run
+// coded, like PNG but on quantized values. Each row of the image (or of a
+// tile) starts with one extra value, its filter type (ZDZEG_ROW_FILTER_*),
+// followed by the residuals (value - prediction) & mask, where mask is
+// (1 << zdzeg_value_bits(levels)) - 1. Predictions use the reconstructed
+// values of the sample one pixel to the left (a), the one above (b) and the
+// one above-left (c) in the same channel; samples outside the image or tile
+// count as 0. The filter type is coded like any other value, so files with
+// 4 levels (2-bit values) can't use ZDZEG_ROW_FILTER_PAETH.
+//
+// Files with a pyramid (ZDZEG_FLAG_PYRAMID) store reduced copies of the
+// image after its own data. Level k is the image scaled by 1/2^k, each side
+// rounded up (zdzeg_level_size), averaged from 2x2 blocks of level k-1. Every
+// level is a complete v2 file of its own with the same settings and no
+// pyramid; the offsets in its tile directory count from the level's start.
+// The file ends with the pyramid directory:
+//   one 16-byte entry per level, from level 1 up:
+//     offset of the level from the start of the file (64-bit)
+//     size of the level (64-bit)
+//   level count (32-bit)
+//   magic "ZPYR"
+// The image's own data ends where level 1 starts.
+//
+// Version 1 files have no header of their own: the whole file is one zlib
+// stream whose first 8 bytes are width and height, and the levels and channel
+// are only known from the file name. A v1 file can never start with the magic
+// because a zlib stream's first byte has 8 in its low nibble.
+#define ZDZEG_MAGIC "ZDZG"
+#define ZDZEG_VERSION 2
+#define ZDZEG_HEADER_SIZE 24
+
+#define ZDZEG_FLAG_TILED 0x01
+#define ZDZEG_FLAG_PACKED 0x02
+#define ZDZEG_FLAG_FILTERED 0x04
+#define ZDZEG_FLAG_PYRAMID 0x08
+#define ZDZEG_KNOWN_FLAGS (ZDZEG_FLAG_TILED | ZDZEG_FLAG_PACKED | ZDZEG_FLAG_FILTERED | ZDZEG_FLAG_PYRAMID)
+#define ZDZEG_CODEC_SHIFT 4
+
+// Compression codecs, stored in the high bits of the flags byte.
+#define ZDZEG_CODEC_ZLIB 0
+#define ZDZEG_CODEC_ZSTD 1
+#define ZDZEG_CODEC_LZ4 2
+#define ZDZEG_CODEC_COUNT 3
+#define ZDZEG_TILE_INFO_SIZE 8
+#define ZDZEG_TILE_ENTRY_SIZE 16
+
+#define ZDZEG_PYRAMID_MAGIC "ZPYR"
+#define ZDZEG_PYRAMID_MAX 16 // most reduced levels a file can store
+#define ZDZEG_PYRAMID_ENTRY_SIZE 16
+#define ZDZEG_PYRAMID_FOOTER_SIZE 8
+
+// .zdzpack archives hold many .zdzeg files, so a whole set is opened with
+// one mapping. All fields big-endian:
+//   0  magic "ZPAK"
+//   4  version (1)
+//   5  3 reserved bytes (0)
+//   8  the member files, complete .zdzeg files back to back
+// then the index, one 32-byte entry per member, sorted by name (bytewise):
+//     offset of the member from the start of the archive (64-bit)
+//     size of the member (64-bit)
+//     width, height (32-bit), 0 for v1 members
+//     offset of the name in the name table (32-bit)
+//     length of the name (16-bit)
+//     levels, channel (8-bit), 0 for v1 members
+// then the name table, every name followed by a NUL byte, and the footer:
+//     offset of the index (64-bit)
+//     entry count (32-bit)
+//     magic "ZPAK"
+// Names are paths relative to the archive, '/'-separated.
+#define ZDZEG_PACK_MAGIC "ZPAK"
+#define ZDZEG_PACK_VERSION 1
+#define ZDZEG_PACK_HEADER_SIZE 8
+#define ZDZEG_PACK_ENTRY_SIZE 32
+#define ZDZEG_PACK_FOOTER_SIZE 16
+
+// Row filter types of filtered files.
+#define ZDZEG_ROW_FILTER_NONE 0    // value
+#define ZDZEG_ROW_FILTER_SUB 1     // predicted from a
+#define ZDZEG_ROW_FILTER_UP 2      // predicted from b
+#define ZDZEG_ROW_FILTER_AVERAGE 3 // predicted from (a + b) / 2
+#define ZDZEG_ROW_FILTER_PAETH 4   // predicted from whichever of a, b, c is closest to a + b - c
+#define ZDZEG_ROW_FILTER_COUNT 5
+
+// Channel indices as stored in the header.
+#define ZDZEG_CHANNEL_RED 0
+#define ZDZEG_CHANNEL_GREEN 1
+#define ZDZEG_CHANNEL_BLUE 2
+#define ZDZEG_CHANNEL_FULL 3
+#define ZDZEG_CHANNEL_BW 4
+#define ZDZEG_CHANNEL_COUNT 5
+
+typedef struct {
+    int version;
+    int levels;
+    int channel;
+    int flags;
+    int codec;
+    int width;
+    int height;
+    uint64_t payload_size;
+} zdzeg_header;
+
+static inline void zdzeg_put_be32(unsigned char* p, uint32_t v) {
+    p[0] = (v >> 24) & 0xFF;
+    p[1] = (v >> 16) & 0xFF;
+    p[2] = (v >> 8) & 0xFF;
+    p[3] = v & 0xFF;
+}
+
+static inline uint32_t zdzeg_get_be32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void zdzeg_put_be64(unsigned char* p, uint64_t v) {
+    zdzeg_put_be32(p, (uint32_t)(v >> 32));
+    zdzeg_put_be32(p + 4, (uint32_t)v);
+}
+
+static inline uint64_t zdzeg_get_be64(const unsigned char* p) {
+    return ((uint64_t)zdzeg_get_be32(p) << 32) | zdzeg_get_be32(p + 4);
+}
+
+// Serializes a v2 header into the first ZDZEG_HEADER_SIZE bytes of `out`.
+static inline void zdzeg_write_header(unsigned char* out, const zdzeg_header* hdr) {
+    memcpy(out, ZDZEG_MAGIC, 4);
+    out[4] = ZDZEG_VERSION;
+    out[5] = (unsigned char)hdr->levels;
+    out[6] = (unsigned char)hdr->channel;
+    out[7] = (unsigned char)(hdr->flags | (hdr->codec << ZDZEG_CODEC_SHIFT));
+    zdzeg_put_be32(out + 8, (uint32_t)hdr->width);
+    zdzeg_put_be32(out + 12, (uint32_t)hdr->height);
+    zdzeg_put_be64(out + 16, hdr->payload_size);
+}
+
+// Parses a v2 header from the start of a file.
+// Returns 1 if the header was read, 0 if the data is not a v2 file (so it
+// should be treated as v1), or -1 if it is a v2 file with invalid fields or
+// an unsupported version.
+static inline int zdzeg_read_header(const unsigned char* data, size_t size, zdzeg_header* hdr) {
+    if (size < 4 || memcmp(data, ZDZEG_MAGIC, 4) != 0) return 0;
+    if (size < ZDZEG_HEADER_SIZE) return -1;
+    hdr->version = data[4];
+    hdr->levels = data[5];
+    hdr->channel = data[6];
+    hdr->flags = data[7] & ((1 << ZDZEG_CODEC_SHIFT) - 1);
+    hdr->codec = data[7] >> ZDZEG_CODEC_SHIFT;
+    hdr->width = (int)zdzeg_get_be32(data + 8);
+    hdr->height = (int)zdzeg_get_be32(data + 12);
+    hdr->payload_size = zdzeg_get_be64(data + 16);
+    if (hdr->version != ZDZEG_VERSION) return -1;
+    if (hdr->flags & ~ZDZEG_KNOWN_FLAGS) return -1;
+    if (hdr->codec >= ZDZEG_CODEC_COUNT) return -1;
+    if (hdr->levels < 4 || hdr->levels > 32) return -1;
+    if (hdr->channel < 0 || hdr->channel >= ZDZEG_CHANNEL_COUNT) return -1;
+    if (hdr->width <= 0 || hdr->height <= 0) return -1;
+    return 1;
+}
+
+// Bits per value in the literals of a packed file: ceil(log2(levels)).
+static inline int zdzeg_value_bits(int levels) {
+    int bits = 1;
+    while ((1 << bits) < levels) bits++;
+    return bits;
+}
+
+// The Paeth predictor: whichever of a (left), b (up) and c (up-left) is
+// closest to a + b - c, preferring a, then b.
+static inline int zdzeg_paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = p > a ? p - a : a - p;
+    int pb = p > b ? p - b : b - p;
+    int pc = p > c ? p - c : c - p;
+    if (pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+// Size of pyramid level `level` along a side of `size` pixels.
+static inline int zdzeg_level_size(int size, int level) {
+    return (int)(((int64_t)size + (1 << level) - 1) >> level);
+}
+
+// Number of tiles needed to cover `size` pixels with tiles of `tile` pixels.
+static inline int zdzeg_tile_count(int size, int tile) {
+    return (size + tile - 1) / tile;
+}
+
+#endif
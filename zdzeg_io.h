@@ -0,0 +1,95 @@
+// Read-only access to whole .zdzeg files, shared by the tools that decode them.
+#ifndef ZDZEG_IO_H
+#define ZDZEG_IO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// How the bytes of a zdzeg_mapped_file are released.
+#define ZDZEG_FILE_HEAP 0     // read into a malloc'd buffer
+#define ZDZEG_FILE_MAPPED 1   // mmap of the file
+#define ZDZEG_FILE_BORROWED 2 // memory owned by the caller
+
+// The bytes of a file, memory-mapped when possible so they are read straight
+// from the page cache. Files that can't be mapped (pipes, some network
+// filesystems) are read into a heap buffer instead.
+typedef struct {
+    const unsigned char* data;
+    size_t size;
+    int source; // ZDZEG_FILE_*
+} zdzeg_mapped_file;
+
+static inline void zdzeg_unmap_file(zdzeg_mapped_file* file) {
+    if (file->source == ZDZEG_FILE_MAPPED) {
+        munmap((void*)file->data, file->size);
+    } else if (file->source == ZDZEG_FILE_HEAP) {
+        free((void*)file->data);
+    }
+    memset(file, 0, sizeof(*file));
+}
+
+// Wraps bytes that are already in memory, such as a file encoded into a
+// buffer. They must stay valid until the file is unmapped, which leaves them
+// alone.
+static inline void zdzeg_borrow_memory(const unsigned char* data, size_t size, zdzeg_mapped_file* file) {
+    file->data = data;
+    file->size = size;
+    file->source = ZDZEG_FILE_BORROWED;
+}
+
+// Maps `filepath` for reading. The data is inflated front to back, so the
+// kernel is told to read ahead and drop pages behind.
+// Returns 0 on success, 1 on failure.
+static inline int zdzeg_map_file(const char* filepath, zdzeg_mapped_file* file) {
+    memset(file, 0, sizeof(*file));
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) return 1;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            file->data = (const unsigned char*)map;
+            file->size = (size_t)st.st_size;
+            file->source = ZDZEG_FILE_MAPPED;
+            return 0;
+        }
+    }
+    // Fall back to reading the stream until it ends
+    size_t capacity = 1 << 16, size = 0;
+    unsigned char* buf = (unsigned char*)malloc(capacity);
+    while (buf) {
+        if (size == capacity) {
+            unsigned char* grown = (unsigned char*)realloc(buf, capacity * 2);
+            if (!grown) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = grown;
+            capacity *= 2;
+        }
+        ssize_t n = read(fd, buf + size, capacity - size);
+        if (n < 0) {
+            free(buf);
+            buf = NULL;
+        } else if (n == 0) {
+            break;
+        } else {
+            size += (size_t)n;
+        }
+    }
+    close(fd);
+    if (!buf) return 1;
+    file->data = buf;
+    file->size = size;
+    return 0;
+}
+
+#endif